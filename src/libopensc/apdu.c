@@ -26,6 +26,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
@@ -198,6 +204,94 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	return SC_SUCCESS;
 }
 
+int sc_apdu_get_scratch_octets(sc_reader_t *reader, const sc_apdu_t *apdu,
+	unsigned int proto, u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen)
+{
+	sc_card_t *card;
+	size_t	nlen, need;
+	u8	*buf = NULL;
+
+	if (reader == NULL || apdu == NULL || sbuf == NULL || slen == NULL || rbuf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	need = nlen + rlen;
+
+	/* The worker of sc_transmit_apdu_async() may transmit to the card
+	 * while another thread sends an APDU synchronously; whoever comes
+	 * second gets a buffer of its own */
+	card = reader->card;
+	if (card != NULL && sc_mutex_lock(card->ctx, card->mutex) == SC_SUCCESS) {
+		if (!card->scratch_busy) {
+			if (need > card->scratch_len) {
+				/* large enough for the longest APDUs of the reader, so
+				 * this happens once unless a caller exceeds the limits */
+				size_t len = 4 + 3 + (reader->max_send_size ? reader->max_send_size : 255) + 3
+					+ (reader->max_recv_size ? reader->max_recv_size : 256) + 2;
+
+				sc_apdu_free_scratch(card);
+				if (len < need)
+					len = need;
+				card->scratch = malloc(len);
+				if (card->scratch != NULL)
+					card->scratch_len = len;
+			}
+			if (card->scratch != NULL) {
+				card->scratch_busy = 1;
+				buf = card->scratch;
+			}
+		}
+		sc_mutex_unlock(card->ctx, card->mutex);
+	}
+
+	if (buf == NULL) {
+		buf = malloc(need);
+		if (buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (sc_apdu2bytes(reader->ctx, apdu, proto, buf, nlen) != SC_SUCCESS) {
+		sc_apdu_release_scratch_octets(reader, buf, 0);
+		return SC_ERROR_INTERNAL;
+	}
+	*sbuf = buf;
+	*slen = nlen;
+	*rbuf = buf + nlen;
+
+	return SC_SUCCESS;
+}
+
+void sc_apdu_release_scratch_octets(sc_reader_t *reader, u8 *sbuf, size_t len)
+{
+	sc_card_t *card;
+
+	if (reader == NULL || sbuf == NULL)
+		return;
+	sc_mem_clear(sbuf, len);
+
+	card = reader->card;
+	if (card == NULL || sbuf != card->scratch) {
+		free(sbuf);
+		return;
+	}
+	/* only the thread holding the buffer changes it, the mutex just
+	 * orders this against the check in sc_apdu_get_scratch_octets() */
+	sc_mutex_lock(card->ctx, card->mutex);
+	card->scratch_busy = 0;
+	sc_mutex_unlock(card->ctx, card->mutex);
+}
+
+void sc_apdu_free_scratch(sc_card_t *card)
+{
+	if (card->scratch != NULL) {
+		sc_mem_clear(card->scratch, card->scratch_len);
+		free(card->scratch);
+	}
+	card->scratch = NULL;
+	card->scratch_len = 0;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -362,10 +456,195 @@ sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+static void
+sc_apdu_trace_put(u8 *p, unsigned long long val, size_t len)
+{
+	while (len-- > 0) {
+		p[len] = (u8) val;
+		val >>= 8;
+	}
+}
+
+
+static void
+sc_apdu_trace_write(sc_context_t *ctx, int type, unsigned long long start,
+		unsigned long long end, const u8 *data1, size_t len1,
+		const u8 *data2, size_t len2)
+{
+	u8 *rec;
+	size_t reclen = 1 + 8 + 4 + 2 + len1 + 2 + len2;
+
+	rec = malloc(reclen);
+	if (rec == NULL)
+		return;
+	rec[0] = (u8) type;
+	sc_apdu_trace_put(rec + 1, start, 8);
+	sc_apdu_trace_put(rec + 9, end - start, 4);
+	sc_apdu_trace_put(rec + 13, len1, 2);
+	memcpy(rec + 15, data1, len1);
+	sc_apdu_trace_put(rec + 15 + len1, len2, 2);
+	memcpy(rec + 17 + len1, data2, len2);
+
+	/* a single write keeps records of concurrent threads apart */
+	if (fwrite(rec, reclen, 1, ctx->apdu_trace_file) != 1)
+		sc_log(ctx, "unable to write APDU trace record");
+	fflush(ctx->apdu_trace_file);
+
+	sc_mem_clear(rec, reclen);
+	free(rec);
+}
+
+
+void
+sc_apdu_trace_mask(u8 *buf, size_t len)
+{
+	size_t off, lc;
+
+	if (len <= 5)
+		return;
+	switch (buf[1]) {
+	case 0x20:	/* VERIFY */
+	case 0x21:
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x25:
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x2D:
+		break;
+	default:
+		return;
+	}
+	if (buf[4] != 0) {
+		off = 5;
+		lc = buf[4];
+	} else if (len > 7) {
+		off = 7;
+		lc = (buf[5] << 8) | buf[6];
+	} else {
+		return;
+	}
+	if (lc > len - off)
+		lc = len - off;
+	memset(buf + off, 0, lc);
+}
+
+
+int
+sc_apdu_trace_open(sc_context_t *ctx, const char *filename)
+{
+	long size;
+
+	sc_apdu_trace_close(ctx);
+
+	/* append, so that several processes can record into the same file */
+	ctx->apdu_trace_file = fopen(filename, "ab");
+	if (ctx->apdu_trace_file == NULL) {
+		sc_log(ctx, "unable to create APDU trace file '%s'", filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fseek(ctx->apdu_trace_file, 0, SEEK_END);
+	size = ftell(ctx->apdu_trace_file);
+	if (size == 0 && fwrite(SC_APDU_TRACE_MAGIC, SC_APDU_TRACE_MAGIC_LEN, 1,
+				ctx->apdu_trace_file) != 1) {
+		sc_apdu_trace_close(ctx);
+		return SC_ERROR_INTERNAL;
+	}
+	sc_log(ctx, "recording APDU trace to '%s'", filename);
+	return SC_SUCCESS;
+}
+
+
+void
+sc_apdu_trace_close(sc_context_t *ctx)
+{
+	if (ctx->apdu_trace_file != NULL) {
+		fclose(ctx->apdu_trace_file);
+		ctx->apdu_trace_file = NULL;
+	}
+}
+
+
+void
+sc_apdu_trace_atr(sc_reader_t *reader)
+{
+	unsigned long long now;
+	u8 proto[4];
+
+	if (reader->ctx->apdu_trace_file == NULL)
+		return;
+	now = sc_get_time_usec();
+	sc_apdu_trace_put(proto, reader->active_protocol, sizeof(proto));
+	sc_apdu_trace_write(reader->ctx, SC_APDU_TRACE_ATR, now, now,
+			reader->atr.value, reader->atr.len, proto, sizeof(proto));
+}
+
+
+static int
+sc_apdu_trace_transmit(struct sc_card *card, struct sc_apdu *apdu)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_reader *reader = card->reader;
+	unsigned long long start;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	size_t ssize = 0;
+	int rv;
+
+	/* encode the command before the reader driver gets a chance to modify
+	 * the APDU */
+	if (sc_apdu_get_octets(ctx, apdu, &sbuf, &ssize, reader->active_protocol) != SC_SUCCESS)
+		sbuf = NULL;
+	else
+		sc_apdu_trace_mask(sbuf, ssize);
+	start = sc_get_time_usec();
+	rv = reader->ops->transmit(reader, apdu);
+	if (rv == SC_SUCCESS && sbuf != NULL) {
+		rbuf = malloc(apdu->resplen + 2);
+		if (rbuf != NULL) {
+			if (apdu->resplen)
+				memcpy(rbuf, apdu->resp, apdu->resplen);
+			rbuf[apdu->resplen] = (u8) apdu->sw1;
+			rbuf[apdu->resplen + 1] = (u8) apdu->sw2;
+			sc_apdu_trace_write(ctx, SC_APDU_TRACE_APDU, start, sc_get_time_usec(),
+					sbuf, ssize, rbuf, apdu->resplen + 2);
+			sc_mem_clear(rbuf, apdu->resplen + 2);
+			free(rbuf);
+		}
+	}
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	return rv;
+}
+
+
+/* Returns 1 if the command may change the currently selected file */
+static int
+sc_apdu_changes_selection(const sc_apdu_t *apdu)
+{
+	switch (apdu->ins) {
+	case 0xA4:	/* SELECT */
+	case 0xE0:	/* CREATE FILE */
+	case 0xE4:	/* DELETE FILE */
+	case 0x70:	/* MANAGE CHANNEL */
+		return 1;
+	case 0xB0: case 0xD6: case 0x0E:
+		/* short EF identifier in P1 */
+		return (apdu->p1 & 0x80) != 0;
+	case 0xB1: case 0xD7: case 0x0F:
+		/* file identifier in P1-P2 */
+		return apdu->p1 != 0 || apdu->p2 != 0;
+	case 0xB2: case 0xB3: case 0xDC: case 0xDD: case 0xE2:
+		/* short EF identifier in P2 */
+		return (apdu->p2 & 0xF8) != 0;
+	}
+	return 0;
+}
+
 static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	unsigned long long start;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -374,14 +653,34 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 
 	sc_log(ctx, "CLA:%X, INS:%X, P1:%X, P2:%X, data(%i) %p",
 			apdu->cla, apdu->ins, apdu->p1, apdu->p2, apdu->datalen, apdu->data);
+
+	/* the current file is only known after sc_select_file() */
+	if (sc_apdu_changes_selection(apdu)) {
+		card->ef_cache.path_valid = 0;
+		card->se_memo.valid = 0;
+	}
+	if (apdu->ins == 0x22)	/* MANAGE SECURITY ENVIRONMENT */
+		card->se_memo.valid = 0;
+
+	/* with secure messaging the plain APDU is counted */
+	card->stats.apdus++;
+	card->stats.ins[apdu->ins]++;
+	card->stats.bytes_out += sc_apdu_get_length(apdu, card->reader->active_protocol);
+
+	/* send APDU to the reader driver */
+	start = sc_get_time_usec();
 #ifdef ENABLE_SM
 	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
-		return sc_sm_single_transmit(card, apdu);
+		rv = sc_sm_single_transmit(card, apdu);
+	else
 #endif
-
-	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, apdu);
+	if (ctx->apdu_trace_file != NULL)
+		rv = sc_apdu_trace_transmit(card, apdu);
+	else
+		rv = card->reader->ops->transmit(card->reader, apdu);
+	card->stats.transmit_usec += sc_get_time_usec() - start;
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
+	card->stats.bytes_in += apdu->resplen + 2;
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -455,17 +754,29 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 
 	do {
 		unsigned char resp[256];
+		unsigned char *rbuf;
 		size_t resp_len = le;
 
+		/* receive directly into the caller's buffer if the chunk fits,
+		 * so long chains are not copied twice */
+		rbuf = buflen >= le ? buf : resp;
+#ifdef ENABLE_SM
+		/* the SM response is unwrapped into apdu->resp on errors */
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+			rbuf = resp;
+#endif
+
 		/* call GET RESPONSE to get more date from the card;
 		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
-		rv = card->ops->get_response(card, &resp_len, resp);
+		if (rbuf == resp)
+			memset(resp, 0, sizeof(resp));
+		card->stats.get_response++;
+		rv = card->ops->get_response(card, &resp_len, rbuf);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
 			if (resp_len)   {
-				sc_log(ctx, "SM response data %s", sc_dump_hex(resp, resp_len));
-				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
+				sc_log(ctx, "SM response data %s", sc_dump_hex(rbuf, resp_len));
+				sc_sm_update_apdu_response(card, rbuf, resp_len, rv, apdu);
 			}
 #endif
 			LOG_TEST_RET(ctx, rv, "GET RESPONSE error");
@@ -476,7 +787,8 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen < le)
 			le = buflen;
 
-		memcpy(buf, resp, le);
+		if (rbuf == resp)
+			memcpy(buf, resp, le);
 		buf    += le;
 		buflen -= le;
 
@@ -634,6 +946,50 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+int sc_transmit_apdus(sc_card_t *card, sc_apdu_t **apdus, size_t count,
+		unsigned long flags, unsigned int sw_mask, unsigned int sw_stop, int *results)
+{
+	size_t i;
+	int r;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+	sc_log(card->ctx, "%lu APDUs, flags 0x%lX", (unsigned long) count, flags);
+
+	/* the nested locks of sc_transmit_apdu() do not end the transaction */
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "unable to acquire lock");
+
+	for (i = 0; i < count; ) {
+		sc_apdu_t *apdu = apdus[i++];
+		int fatal = 1;
+
+		r = sc_transmit_apdu(card, apdu);
+		if (r == SC_SUCCESS) {
+			r = sc_check_sw(card, apdu->sw1, apdu->sw2);
+			fatal = r != SC_SUCCESS && (flags & SC_TRANSMIT_APDUS_STOP_ON_ERROR)
+				&& !(apdu->flags & SC_APDU_FLAGS_NOT_FATAL);
+			if (sw_mask != 0 && (((apdu->sw1 << 8) | apdu->sw2) & sw_mask) == sw_stop)
+				fatal = 1;
+		}
+		if (results != NULL)
+			results[i - 1] = r;
+		if (fatal) {
+			sc_log(card->ctx, "APDU %lu of %lu ends the sequence: SW %02X%02X, %d",
+					(unsigned long) i, (unsigned long) count, apdu->sw1, apdu->sw2, r);
+			break;
+		}
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(card->ctx, (int) i);
+}
+
+
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 {
@@ -750,3 +1106,266 @@ sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 
 	return SC_SUCCESS;
 }
+
+/*********************************************************************/
+/*   asynchronous APDU transmission                                  */
+/*********************************************************************/
+
+/*
+ * Every reader used with sc_transmit_apdu_async() gets a worker thread
+ * which sends the queued APDUs in order with sc_transmit_apdu(). One thread
+ * can thus keep many readers busy without blocking in the reader driver.
+ */
+struct sc_apdu_future {
+	sc_card_t *card;
+	sc_apdu_t *apdu;
+	sc_apdu_callback_t callback;
+	void *arg;
+
+	int result;
+	int done;
+	int detached;		/* freed by the worker when done */
+	struct sc_apdu_future *next;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+struct sc_apdu_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct sc_apdu_future *head, *tail;
+	int stop;
+};
+
+static void sc_apdu_future_release(sc_apdu_future_t *future)
+{
+	pthread_cond_destroy(&future->cond);
+	pthread_mutex_destroy(&future->mutex);
+	free(future);
+}
+
+static void sc_apdu_future_complete(sc_apdu_future_t *future, int result)
+{
+	int detached;
+
+	future->result = result;
+	if (future->callback)
+		future->callback(future, future->arg);
+
+	pthread_mutex_lock(&future->mutex);
+	future->done = 1;
+	detached = future->detached;
+	pthread_cond_broadcast(&future->cond);
+	pthread_mutex_unlock(&future->mutex);
+	if (detached)
+		sc_apdu_future_release(future);
+}
+
+static void *sc_apdu_worker_main(void *arg)
+{
+	struct sc_apdu_worker *worker = (struct sc_apdu_worker *) arg;
+	sc_apdu_future_t *future;
+
+	for (;;) {
+		pthread_mutex_lock(&worker->mutex);
+		while (worker->head == NULL && !worker->stop)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		future = worker->head;
+		if (future != NULL) {
+			worker->head = future->next;
+			if (worker->head == NULL)
+				worker->tail = NULL;
+		}
+		pthread_mutex_unlock(&worker->mutex);
+		if (future == NULL)
+			break;
+
+		sc_apdu_future_complete(future, sc_transmit_apdu(future->card, future->apdu));
+	}
+	return NULL;
+}
+
+static int sc_apdu_worker_get(sc_card_t *card, struct sc_apdu_worker **out)
+{
+	sc_reader_t *reader = card->reader;
+	struct sc_apdu_worker *worker;
+	int r;
+
+	r = sc_mutex_lock(card->ctx, card->ctx->mutex);
+	if (r != SC_SUCCESS)
+		return r;
+	worker = reader->apdu_worker;
+	if (worker == NULL) {
+		worker = calloc(1, sizeof(struct sc_apdu_worker));
+		if (worker == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		if (pthread_create(&worker->thread, NULL, sc_apdu_worker_main, worker) != 0) {
+			pthread_cond_destroy(&worker->cond);
+			pthread_mutex_destroy(&worker->mutex);
+			free(worker);
+			r = SC_ERROR_INTERNAL;
+			goto out;
+		}
+		reader->apdu_worker = worker;
+	}
+	*out = worker;
+out:
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+	return r;
+}
+#endif
+
+int sc_transmit_apdu_async(sc_card_t *card, sc_apdu_t *apdu,
+		sc_apdu_callback_t callback, void *arg, sc_apdu_future_t **out)
+{
+	sc_apdu_future_t *future;
+#ifdef HAVE_PTHREAD
+	struct sc_apdu_worker *worker = NULL;
+	int r;
+#endif
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (out == NULL && callback == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	future = calloc(1, sizeof(sc_apdu_future_t));
+	if (future == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	future->card = card;
+	future->apdu = apdu;
+	future->callback = callback;
+	future->arg = arg;
+	future->detached = (out == NULL);
+
+#ifdef HAVE_PTHREAD
+	r = sc_apdu_worker_get(card, &worker);
+	if (r != SC_SUCCESS) {
+		free(future);
+		return r;
+	}
+	pthread_mutex_init(&future->mutex, NULL);
+	pthread_cond_init(&future->cond, NULL);
+	if (out != NULL)
+		*out = future;
+
+	pthread_mutex_lock(&worker->mutex);
+	if (worker->tail != NULL)
+		worker->tail->next = future;
+	else
+		worker->head = future;
+	worker->tail = future;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+#else
+	future->result = sc_transmit_apdu(card, apdu);
+	if (callback)
+		callback(future, arg);
+	future->done = 1;
+	if (out != NULL)
+		*out = future;
+	else
+		free(future);
+#endif
+	return SC_SUCCESS;
+}
+
+int sc_apdu_future_done(sc_apdu_future_t *future)
+{
+	int done;
+
+	if (future == NULL)
+		return 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&future->mutex);
+	done = future->done;
+	pthread_mutex_unlock(&future->mutex);
+#else
+	done = future->done;
+#endif
+	return done;
+}
+
+int sc_apdu_future_wait(sc_apdu_future_t *future, int timeout)
+{
+#ifdef HAVE_PTHREAD
+	struct timeval tv;
+	struct timespec ts;
+	int r = SC_SUCCESS;
+#endif
+
+	if (future == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+#ifdef HAVE_PTHREAD
+	if (timeout > 0) {
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + timeout / 1000;
+		ts.tv_nsec = (tv.tv_usec + (timeout % 1000) * 1000) * 1000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&future->mutex);
+	while (!future->done && r == SC_SUCCESS) {
+		if (timeout == 0)
+			r = SC_ERROR_EVENT_TIMEOUT;
+		else if (timeout < 0)
+			pthread_cond_wait(&future->cond, &future->mutex);
+		else if (pthread_cond_timedwait(&future->cond, &future->mutex, &ts) != 0 && !future->done)
+			r = SC_ERROR_EVENT_TIMEOUT;
+	}
+	pthread_mutex_unlock(&future->mutex);
+	if (r != SC_SUCCESS)
+		return r;
+#endif
+	return future->result;
+}
+
+void sc_apdu_future_free(sc_apdu_future_t *future)
+{
+	if (future == NULL)
+		return;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&future->mutex);
+	if (!future->done) {
+		/* the worker frees it */
+		future->detached = 1;
+		pthread_mutex_unlock(&future->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&future->mutex);
+	sc_apdu_future_release(future);
+#else
+	free(future);
+#endif
+}
+
+void sc_apdu_worker_stop(sc_reader_t *reader)
+{
+#ifdef HAVE_PTHREAD
+	struct sc_apdu_worker *worker = reader->apdu_worker;
+
+	if (worker == NULL)
+		return;
+	pthread_mutex_lock(&worker->mutex);
+	worker->stop = 1;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->mutex);
+	free(worker);
+	reader->apdu_worker = NULL;
+#endif
+}
@@ -23,14 +23,18 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "asn1.h"
+#include "cardctl.h"
 #include "common/compat_strlcpy.h"
 
 /*
@@ -93,6 +97,295 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 	return card;
 }
 
+/* Upper limit for the content kept in the EF content cache of one card */
+#define SC_EF_CACHE_MAX_SIZE	(256 * 1024)
+/* Upper limit for the number of absent files remembered for one card */
+#define SC_EF_CACHE_MAX_ABSENT	64
+
+static int sc_ef_cache_path_equal(const sc_path_t *p1, const sc_path_t *p2)
+{
+	return p1->type == p2->type
+		&& p1->len == p2->len && !memcmp(p1->value, p2->value, p1->len)
+		&& p1->aid.len == p2->aid.len && !memcmp(p1->aid.value, p2->aid.value, p1->aid.len);
+}
+
+/* Only absolute paths identify a file */
+static int sc_ef_cache_path_absolute(const sc_path_t *path)
+{
+	return path->type == SC_PATH_TYPE_DF_NAME
+		|| (path->type == SC_PATH_TYPE_PATH && (path->aid.len > 0
+				|| (path->len >= 2 && path->value[0] == 0x3F && path->value[1] == 0x00)));
+}
+
+/* Remember the selected file as key for the cache. Any other kind of
+ * SELECT leaves the key unknown. */
+static void sc_ef_cache_select(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_ef_cache *cache = &card->ef_cache;
+
+	cache->path_valid = 0;
+	cache->path_on_card = 0;
+	if (!cache->enabled && !cache->select_enabled)
+		return;
+	if (sc_ef_cache_path_absolute(path)) {
+		cache->path = *path;
+		cache->path_valid = 1;
+		cache->path_on_card = 1;
+	}
+}
+
+static struct sc_ef_cache_fci *sc_ef_cache_find_fci(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_ef_cache_fci *fci;
+
+	for (fci = card->ef_cache.fci; fci != NULL; fci = fci->next)
+		if (fci->file != NULL && sc_ef_cache_path_equal(&fci->path, path))
+			return fci;
+	return NULL;
+}
+
+static void sc_ef_cache_store_fci(sc_card_t *card, const sc_path_t *path, const sc_file_t *file)
+{
+	struct sc_ef_cache_fci *fci;
+
+	fci = sc_ef_cache_find_fci(card, path);
+	if (fci == NULL) {
+		fci = calloc(1, sizeof(struct sc_ef_cache_fci));
+		if (fci == NULL)
+			return;
+		fci->path = *path;
+		fci->next = card->ef_cache.fci;
+		card->ef_cache.fci = fci;
+	}
+	if (fci->file != NULL)
+		sc_file_free(fci->file);
+	sc_file_dup(&fci->file, file);
+}
+
+static void sc_ef_cache_drop_fci(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_ef_cache_fci **pp = &card->ef_cache.fci;
+
+	while (*pp != NULL) {
+		struct sc_ef_cache_fci *fci = *pp;
+
+		if (path == NULL || sc_ef_cache_path_equal(&fci->path, path)) {
+			*pp = fci->next;
+			if (fci->file != NULL)
+				sc_file_free(fci->file);
+			free(fci);
+		} else {
+			pp = &fci->next;
+		}
+	}
+}
+
+static int sc_ef_cache_is_absent(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_ef_cache_absent *absent;
+
+	for (absent = card->ef_cache.absent; absent != NULL; absent = absent->next)
+		if (sc_ef_cache_path_equal(&absent->path, path))
+			return 1;
+	return 0;
+}
+
+static void sc_ef_cache_store_absent(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_ef_cache_absent *absent;
+
+	if (card->ef_cache.absent_count >= SC_EF_CACHE_MAX_ABSENT
+			|| sc_ef_cache_is_absent(card, path))
+		return;
+	absent = calloc(1, sizeof(struct sc_ef_cache_absent));
+	if (absent == NULL)
+		return;
+	absent->path = *path;
+	absent->next = card->ef_cache.absent;
+	card->ef_cache.absent = absent;
+	card->ef_cache.absent_count++;
+}
+
+/* Files may appear after anything was written to the card */
+static void sc_ef_cache_drop_absent(sc_card_t *card)
+{
+	struct sc_ef_cache_absent *absent;
+
+	while ((absent = card->ef_cache.absent) != NULL) {
+		card->ef_cache.absent = absent->next;
+		free(absent);
+	}
+	card->ef_cache.absent_count = 0;
+}
+
+/* Builds a SELECT by file identifier for a child of the selected DF or a
+ * sibling of the selected EF */
+static int sc_ef_cache_relative_path(sc_card_t *card, const sc_path_t *in_path,
+		sc_path_t *rel)
+{
+	const struct sc_ef_cache *cache = &card->ef_cache;
+	const sc_path_t *cur = &cache->path;
+	const struct sc_ef_cache_fci *fci;
+	size_t prefix;
+
+	if (!cache->path_valid || !cache->path_on_card || cur->type != SC_PATH_TYPE_PATH
+			|| in_path->type != SC_PATH_TYPE_PATH || in_path->len < 2
+			|| cur->aid.len != in_path->aid.len
+			|| memcmp(cur->aid.value, in_path->aid.value, cur->aid.len) != 0)
+		return 0;
+
+	if (in_path->len == cur->len + 2) {
+		/* an EF has no children, so the selected file must be a DF */
+		prefix = cur->len;
+	} else if (in_path->len == cur->len && cur->len >= (cur->aid.len ? 2 : 4)) {
+		/* siblings only share the current DF if the selected file is an EF */
+		fci = sc_ef_cache_find_fci(card, cur);
+		if (fci == NULL || fci->file == NULL || fci->file->type == SC_FILE_TYPE_DF)
+			return 0;
+		prefix = cur->len - 2;
+	} else {
+		return 0;
+	}
+	if (memcmp(in_path->value, cur->value, prefix) != 0)
+		return 0;
+
+	memset(rel, 0, sizeof(*rel));
+	rel->type = SC_PATH_TYPE_FILE_ID;
+	memcpy(rel->value, in_path->value + in_path->len - 2, 2);
+	rel->len = 2;
+	return 1;
+}
+
+static void sc_ef_cache_free_entry(sc_card_t *card, struct sc_ef_cache_entry *entry)
+{
+	card->ef_cache.size -= entry->len;
+	sc_mem_clear(entry->data, entry->len);
+	free(entry->data);
+	free(entry);
+}
+
+void sc_invalidate_ef_cache(sc_card_t *card)
+{
+	struct sc_ef_cache_entry *entry;
+
+	while ((entry = card->ef_cache.entries) != NULL) {
+		card->ef_cache.entries = entry->next;
+		sc_ef_cache_free_entry(card, entry);
+	}
+	sc_ef_cache_drop_fci(card, NULL);
+	sc_ef_cache_drop_absent(card);
+	card->ef_cache.path_valid = 0;
+}
+
+/* Drop the cached content of the selected file before it is modified. If the
+ * selected file is not known, everything is dropped. */
+static void sc_ef_cache_drop_current(sc_card_t *card)
+{
+	struct sc_ef_cache *cache = &card->ef_cache;
+	struct sc_ef_cache_entry **pp = &cache->entries;
+
+	if (!cache->path_valid) {
+		sc_invalidate_ef_cache(card);
+		return;
+	}
+	while (*pp != NULL) {
+		struct sc_ef_cache_entry *entry = *pp;
+
+		if (sc_ef_cache_path_equal(&entry->path, &cache->path)) {
+			*pp = entry->next;
+			sc_ef_cache_free_entry(card, entry);
+		} else {
+			pp = &entry->next;
+		}
+	}
+	sc_ef_cache_drop_fci(card, &cache->path);
+	sc_ef_cache_drop_absent(card);
+}
+
+/* Returns the number of bytes copied to 'buf', or -1 if the requested data
+ * is not cached */
+static int sc_ef_cache_read(sc_card_t *card, unsigned int rec_nr, unsigned int idx,
+		u8 *buf, size_t count, unsigned long flags)
+{
+	struct sc_ef_cache *cache = &card->ef_cache;
+	struct sc_ef_cache_entry *entry;
+	size_t n;
+
+	if (!cache->enabled || !cache->path_valid)
+		return -1;
+
+	for (entry = cache->entries; entry != NULL; entry = entry->next) {
+		if (entry->rec_nr != rec_nr || entry->flags != flags
+				|| !sc_ef_cache_path_equal(&entry->path, &cache->path))
+			continue;
+		if (idx < entry->offset || idx > entry->offset + entry->len)
+			continue;
+		n = entry->offset + entry->len - idx;
+		if (n >= count)
+			n = count;
+		else if (!entry->complete)
+			continue;
+		memcpy(buf, entry->data + (idx - entry->offset), n);
+		card->stats.ef_cache_hits++;
+		return (int) n;
+	}
+	return -1;
+}
+
+/* Store 'len' bytes read at 'idx' in response to a request of 'count' bytes.
+ * Transparent content read right after a cached range extends that range. */
+static void sc_ef_cache_store(sc_card_t *card, unsigned int rec_nr, unsigned int idx,
+		const u8 *buf, size_t len, size_t count, unsigned long flags)
+{
+	struct sc_ef_cache *cache = &card->ef_cache;
+	struct sc_ef_cache_entry *entry;
+	u8 *data;
+
+	if (!cache->enabled || !cache->path_valid)
+		return;
+	if (cache->size + len > SC_EF_CACHE_MAX_SIZE)
+		return;
+
+	for (entry = cache->entries; entry != NULL; entry = entry->next) {
+		if (entry->rec_nr != rec_nr || entry->flags != flags
+				|| !sc_ef_cache_path_equal(&entry->path, &cache->path))
+			continue;
+		if (rec_nr != 0) {
+			if (entry->len >= len)
+				return;
+			/* keep the longer read of the record */
+			cache->size -= entry->len;
+			entry->len = 0;
+			break;
+		}
+		if (idx >= entry->offset && idx + len <= entry->offset + entry->len)
+			return;
+		if (!entry->complete && entry->offset + entry->len == idx)
+			break;
+	}
+
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(struct sc_ef_cache_entry));
+		if (entry == NULL)
+			return;
+		entry->path = cache->path;
+		entry->rec_nr = rec_nr;
+		entry->flags = flags;
+		entry->offset = idx;
+		entry->next = cache->entries;
+		cache->entries = entry;
+	}
+
+	data = realloc(entry->data, entry->len + len + 1);
+	if (data == NULL)
+		return;
+	memcpy(data + entry->len, buf, len);
+	entry->data = data;
+	entry->len += len;
+	entry->complete = len < count;
+	cache->size += len;
+}
+
 static void sc_card_free(sc_card_t *card)
 {
 	sc_free_apps(card);
@@ -120,6 +413,9 @@ static void sc_card_free(sc_card_t *card)
 		card->algorithm_count = 0;
 	}
 
+	sc_invalidate_ef_cache(card);
+	sc_apdu_free_scratch(card);
+
 	if (card->cache.current_ef)
 		sc_file_free(card->cache.current_ef);
 
@@ -152,7 +448,7 @@ size_t sc_get_max_recv_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_recv_size != 0
-			&& (card->reader->max_recv_size < card->max_recv_size))
+			&& (card->reader->max_recv_size < max_recv_size))
 		max_recv_size = card->reader->max_recv_size;
 
 	return max_recv_size;
@@ -177,17 +473,177 @@ size_t sc_get_max_send_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_send_size != 0
-			&& (card->reader->max_send_size < card->max_send_size))
+			&& (card->reader->max_send_size < max_send_size))
 		max_send_size = card->reader->max_send_size;
 
 	return max_send_size;
 }
 
+/* Memo of the driver that accepted a card, enabled with the 'driver_cache'
+ * option. The file in the cache directory has one line for every ATR seen:
+ * "<ATR in hex> <driver short name>". */
+#define SC_DRIVER_CACHE_FILE		"card_drivers"
+#define SC_DRIVER_CACHE_MAX_LINES	64
+#define SC_DRIVER_CACHE_LINE_SIZE	(2 * SC_MAX_ATR_SIZE + 64)
+
+static int sc_driver_cache_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, SC_DRIVER_CACHE_FILE);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static struct sc_card_driver *sc_driver_cache_lookup(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX], atr[2 * SC_MAX_ATR_SIZE + 1];
+	char line[SC_DRIVER_CACHE_LINE_SIZE];
+	size_t atrlen;
+	FILE *f;
+	int i, found = 0;
+
+	if (sc_driver_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	atrlen = strlen(atr);
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, atr, atrlen) == 0 && line[atrlen] == ' ') {
+			found = 1;
+			break;
+		}
+	}
+	fclose(f);
+	if (!found)
+		return NULL;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *drv = ctx->card_drivers[i];
+
+		if (strcmp(drv->short_name, line + atrlen + 1) != 0)
+			continue;
+		if (drv->ops == NULL || drv->ops->match_card == NULL
+				|| (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
+					&& !strcmp("default", drv->short_name)))
+			return NULL;
+		return drv;
+	}
+	return NULL;
+}
+
+/* Rewrites the memo with the entry for the card's ATR at the end, or without
+ * it if 'short_name' is NULL. The oldest entries are dropped when the file
+ * is full. */
+static void sc_driver_cache_store(sc_card_t *card, const char *short_name)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX], tmpname[PATH_MAX], atr[2 * SC_MAX_ATR_SIZE + 1];
+	char (*lines)[SC_DRIVER_CACHE_LINE_SIZE];
+	size_t atrlen, n = 0, i;
+	FILE *f;
+	int r, fail;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (sc_driver_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	atrlen = strlen(atr);
+
+	lines = calloc(SC_DRIVER_CACHE_MAX_LINES, sizeof(*lines));
+	if (lines == NULL)
+		return;
+	f = fopen(fname, "r");
+	if (f != NULL) {
+		while (fgets(lines[n], sizeof(lines[n]), f) != NULL) {
+			lines[n][strcspn(lines[n], "\r\n")] = '\0';
+			if (lines[n][0] == '\0' || (strncmp(lines[n], atr, atrlen) == 0
+						&& lines[n][atrlen] == ' '))
+				continue;
+			if (++n == SC_DRIVER_CACHE_MAX_LINES) {
+				memmove(lines[0], lines[1], (n - 1) * sizeof(*lines));
+				n--;
+			}
+		}
+		fclose(f);
+	}
+	if (short_name != NULL)
+		snprintf(lines[n++], sizeof(lines[0]), "%s %s", atr, short_name);
+
+	/* write a temporary file with a unique name and rename it, concurrent
+	 * readers see either the old or the new memo */
+#ifdef _WIN32
+	r = snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", fname,
+			(unsigned long) GetCurrentThreadId());
+#else
+	r = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+#endif
+	if (r < 0 || (size_t) r >= sizeof(tmpname)) {
+		free(lines);
+		return;
+	}
+#ifdef _WIN32
+	f = fopen(tmpname, "w");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(tmpname, "w");
+#else
+	f = NULL;
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS) {
+		memcpy(tmpname + r - 6, "XXXXXX", 6);
+		fd = mkstemp(tmpname);
+	}
+	if (fd >= 0) {
+		f = fdopen(fd, "w");
+		if (f == NULL) {
+			close(fd);
+			unlink(tmpname);
+		}
+	}
+#endif
+	if (f == NULL) {
+		free(lines);
+		return;
+	}
+	fail = 0;
+	for (i = 0; i < n; i++)
+		if (fprintf(f, "%s\n", lines[i]) < 0)
+			fail = 1;
+	if (fclose(f) != 0)
+		fail = 1;
+	free(lines);
+#ifdef _WIN32
+	if (fail || !MoveFileExA(tmpname, fname, MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (fail || rename(tmpname, fname) != 0) {
+#endif
+		sc_log(ctx, "cannot update %s", fname);
+		unlink(tmpname);
+		return;
+	}
+	if (short_name != NULL)
+		sc_log(ctx, "remembered driver '%s' for the card", short_name);
+	else
+		sc_log(ctx, "forgot the driver of the card");
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
-	struct sc_card_driver *driver;
+	struct sc_card_driver *driver, *memo = NULL;
 	int i, r = 0, idx, connected = 0;
 
 	if (card_out == NULL || reader == NULL)
@@ -207,13 +663,26 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	connected = 1;
 	card->reader = reader;
 	card->ctx = ctx;
+	reader->card = card;
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
 
 	_sc_parse_atr(reader);
+	sc_apdu_trace_atr(reader);
+
+	/* Files not found by one driver probe are not selected again by the
+	 * next one. The card's file system does not depend on the driver;
+	 * drivers selecting by other means than sc_select_file() are not
+	 * affected. */
+	card->ef_cache.negative_enabled = (ctx->flags & SC_CTX_FLAG_ENABLE_NEGATIVE_CACHE) != 0;
+
+	/* sc_set_card_driver() may be called from another thread */
+	sc_mutex_lock(ctx, ctx->mutex);
+	driver = ctx->forced_driver;
+	sc_mutex_unlock(ctx, ctx->mutex);
 
 	/* See if the ATR matches any ATR specified in the config file */
-	if ((driver = ctx->forced_driver) == NULL) {
+	if (driver == NULL) {
 		sc_log(ctx, "matching configured ATRs");
 		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
 			driver = ctx->card_drivers[i];
@@ -257,11 +726,41 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		/* Go straight to the driver that accepted this ATR before. The
+		 * probes of the drivers in front of it are skipped. */
+		if (ctx->flags & SC_CTX_FLAG_ENABLE_DRIVER_CACHE)
+			memo = sc_driver_cache_lookup(card);
+		if (memo != NULL) {
+			sc_log(ctx, "trying remembered driver '%s'", memo->short_name);
+			*card->ops = *memo->ops;
+			if (memo->ops->match_card(card) == 1) {
+				card->driver = memo;
+				r = memo->ops->init(card);
+				if (r) {
+					sc_log(ctx, "driver '%s' init() failed: %s", memo->name, sc_strerror(r));
+					card->driver = NULL;
+					/* as in the scan below, only a card the driver
+					 * does not handle lets another driver try */
+					if (r != SC_ERROR_INVALID_CARD)
+						goto err;
+				}
+			}
+			if (card->driver == NULL) {
+				sc_log(ctx, "remembered driver '%s' did not accept the card", memo->short_name);
+				sc_mutex_lock(ctx, ctx->mutex);
+				sc_driver_cache_store(card, NULL);
+				sc_mutex_unlock(ctx, ctx->mutex);
+			}
+		}
+
+		if (card->driver == NULL)
+			sc_log(ctx, "matching built-in ATRs");
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			struct sc_card_driver *drv = ctx->card_drivers[i];
 			const struct sc_card_operations *ops = drv->ops;
 
+			if (drv == memo)
+				continue;
 			sc_log(ctx, "trying driver '%s'", drv->short_name);
 			if (ops == NULL || ops->match_card == NULL)   {
 				continue;
@@ -290,6 +789,13 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 			break;
 		}
+		if (card->driver != NULL && card->driver != memo
+				&& (ctx->flags & SC_CTX_FLAG_ENABLE_DRIVER_CACHE)) {
+			/* cards connected in other threads update the same file */
+			sc_mutex_lock(ctx, ctx->mutex);
+			sc_driver_cache_store(card, card->driver->short_name);
+			sc_mutex_unlock(ctx, ctx->mutex);
+		}
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -306,6 +812,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
 
+	card->ef_cache.enabled = (ctx->flags & SC_CTX_FLAG_ENABLE_EF_CACHE) != 0;
+	card->ef_cache.select_enabled = (ctx->flags & SC_CTX_FLAG_ENABLE_SELECT_CACHE) != 0;
+
 #ifdef ENABLE_SM
         /* Check, if secure messaging module present. */
 	r = sc_card_sm_check(card);
@@ -318,8 +827,10 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
-	if (connected)
+	if (connected) {
+		reader->card = NULL;
 		reader->ops->disconnect(reader);
+	}
 	if (card != NULL)
 		sc_card_free(card);
 	LOG_FUNC_RETURN(ctx, r);
@@ -336,12 +847,15 @@ int sc_disconnect_card(sc_card_t *card)
 	LOG_FUNC_CALLED(ctx);
 
 	assert(card->lock_count == 0);
+	/* send what was queued for the card */
+	sc_apdu_worker_stop(card->reader);
 	if (card->ops->finish) {
 		int r = card->ops->finish(card);
 		if (r)
 			sc_log(ctx, "card driver finish() failed: %s", sc_strerror(r));
 	}
 
+	card->reader->card = NULL;
 	if (card->reader->ops->disconnect) {
 		int r = card->reader->ops->disconnect(card->reader);
 		if (r)
@@ -374,6 +888,8 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	/* invalidate cache */
 	memset(&card->cache, 0, sizeof(card->cache));
 	card->cache.valid = 0;
+	sc_invalidate_ef_cache(card);
+	card->se_memo.valid = 0;
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -403,6 +919,8 @@ int sc_lock(sc_card_t *card)
 				/* invalidate cache */
 				memset(&card->cache, 0, sizeof(card->cache));
 				card->cache.valid = 0;
+				sc_invalidate_ef_cache(card);
+				card->se_memo.valid = 0;
 #ifdef ENABLE_SM
 				if (card->sm_ctx.ops.open)
 					card->sm_ctx.ops.open(card);
@@ -412,6 +930,9 @@ int sc_lock(sc_card_t *card)
 		}
 		if (r == 0)
 			card->cache.valid = 1;
+		/* the card state is unknown after (re)acquiring the reader */
+		if (r != 0 || card->reader->ops->lock != NULL)
+			card->se_memo.valid = 0;
 	}
 	if (r == 0)
 		card->lock_count++;
@@ -443,11 +964,18 @@ int sc_unlock(sc_card_t *card)
 		/* invalidate cache */
 		memset(&card->cache, 0, sizeof(card->cache));
 		card->cache.valid = 0;
+		card->se_memo.valid = 0;
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
-		if (card->reader->ops->unlock != NULL)
+		if (card->reader->ops->unlock != NULL) {
+			/* other applications may select files and set a
+			 * security environment until the reader is locked
+			 * again */
+			card->ef_cache.path_on_card = 0;
+			card->se_memo.valid = 0;
 			r = card->reader->ops->unlock(card->reader);
+		}
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -493,6 +1021,8 @@ int sc_create_file(sc_card_t *card, sc_file_t *file)
 
 	if (card->ops->create_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_fci(card, NULL);
+	sc_ef_cache_drop_absent(card);
 
 	r = card->ops->create_file(card, file);
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -512,61 +1042,124 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	sc_log(card->ctx, "called; type=%d, path=%s", path->type, pbuf);
 	if (card->ops->delete_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_invalidate_ef_cache(card);
 	r = card->ops->delete_file(card, path);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
-int sc_read_binary(sc_card_t *card, unsigned int idx,
-		   unsigned char *buf, size_t count, unsigned long flags)
+/* Read at most one APDU worth of data, from the EF cache if possible */
+static int sc_read_binary_chunk(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count, unsigned long flags)
 {
-	size_t max_le = sc_get_max_recv_size(card);
 	int r;
 
-	assert(card != NULL && card->ops != NULL && buf != NULL);
-	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
-	if (count == 0)
-		return 0;
+	r = sc_ef_cache_read(card, 0, idx, buf, count, flags);
+	if (r >= 0) {
+		sc_log(card->ctx, "%d bytes from EF content cache", r);
+		return r;
+	}
 
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.read_binary)   {
 		r = card->sm_ctx.ops.read_binary(card, idx, buf, count);
 		if (r)
-			LOG_FUNC_RETURN(card->ctx, r);
+			return r;
 	}
 #endif
-	if (card->ops->read_binary == NULL)
-		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	r = card->ops->read_binary(card, idx, buf, count, flags);
+	if (r >= 0)
+		sc_ef_cache_store(card, 0, idx, buf, r, count, flags);
+	return r;
+}
+
+/* Read 'count' bytes in chunks of at most max_recv_size. Every chunk goes
+ * to 'cb' if given, or straight into 'buf' otherwise. */
+static int sc_read_binary_chunks(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count, unsigned long flags,
+		sc_read_binary_cb_t cb, void *cb_arg)
+{
+	size_t max_le = sc_get_max_recv_size(card);
+	unsigned char *p = buf;
+	int bytes_read = 0;
+	int r;
 
-	if (count > max_le) {
-		int bytes_read = 0;
-		unsigned char *p = buf;
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	while (count > 0) {
+		size_t n = count > max_le ? max_le : count;
 
-		r = sc_lock(card);
-		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
-		while (count > 0) {
-			size_t n = count > max_le ? max_le : count;
-			r = sc_read_binary(card, idx, p, n, flags);
-			if (r < 0) {
-				sc_unlock(card);
-				LOG_TEST_RET(card->ctx, r, "sc_read_binary() failed");
+		r = sc_read_binary_chunk(card, idx, p, n, flags);
+		if (r < 0) {
+			sc_log(card->ctx, "reading %d bytes at index %d failed", n, idx);
+			break;
+		}
+		if (r == 0)
+			break;
+		if (cb != NULL) {
+			int rv = cb(cb_arg, idx, p, r);
+			if (rv < 0) {
+				r = rv;
+				break;
 			}
+		} else {
 			p += r;
-			idx += r;
-			bytes_read += r;
-			count -= r;
-			if (r == 0) {
-				sc_unlock(card);
-				LOG_FUNC_RETURN(card->ctx, bytes_read);
-			}
 		}
-		sc_unlock(card);
-		LOG_FUNC_RETURN(card->ctx, bytes_read);
+		idx += r;
+		bytes_read += r;
+		count -= r;
 	}
-	r = card->ops->read_binary(card, idx, buf, count, flags);
+	sc_unlock(card);
+	if (r < 0)
+		LOG_FUNC_RETURN(card->ctx, r);
+	LOG_FUNC_RETURN(card->ctx, bytes_read);
+}
+
+int sc_read_binary(sc_card_t *card, unsigned int idx,
+		   unsigned char *buf, size_t count, unsigned long flags)
+{
+	int r;
+
+	assert(card != NULL && card->ops != NULL && buf != NULL);
+	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	if (count == 0)
+		return 0;
+	if (card->ops->read_binary == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	if (count > sc_get_max_recv_size(card))
+		return sc_read_binary_chunks(card, idx, buf, count, flags, NULL, NULL);
+
+	r = sc_read_binary_chunk(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+int sc_read_binary_stream(sc_card_t *card, unsigned int idx, size_t count,
+		unsigned long flags, sc_read_binary_cb_t cb, void *cb_arg)
+{
+	unsigned char *buf;
+	size_t len;
+	int r;
+
+	assert(card != NULL && card->ops != NULL && cb != NULL);
+	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	if (count == 0)
+		return 0;
+	if (card->ops->read_binary == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	len = sc_get_max_recv_size(card);
+	if (len > count)
+		len = count;
+	buf = malloc(len);
+	if (buf == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	r = sc_read_binary_chunks(card, idx, buf, count, flags, cb, cb_arg);
+	free(buf);
+	return r;
+}
+
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
@@ -579,6 +1172,7 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, 0);
 	if (card->ops->write_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 
 	if (count > max_lc) {
 		int bytes_written = 0;
@@ -621,6 +1215,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	if (count == 0)
 		return 0;
 
+	sc_ef_cache_drop_current(card);
+
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.update_binary)   {
 		r = card->sm_ctx.ops.update_binary(card, idx, buf, count);
@@ -672,12 +1268,59 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 
 	if (card->ops->erase_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 
 	r = card->ops->erase_binary(card, offs, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 
+/* SELECT with the 'select_cache' option: nothing is sent if the file is
+ * already selected, a file identifier is used where the current DF allows
+ * it, and file information is returned from the FCI cache */
+static int sc_select_file_cached(sc_card_t *card, const sc_path_t *in_path,
+		sc_file_t **file)
+{
+	struct sc_ef_cache *cache = &card->ef_cache;
+	struct sc_ef_cache_fci *fci = sc_ef_cache_find_fci(card, in_path);
+	sc_file_t **file_out = (fci == NULL) ? file : NULL;
+	sc_path_t rel;
+	int r;
+
+	if (cache->path_valid && cache->path_on_card
+			&& sc_ef_cache_path_equal(&cache->path, in_path)
+			&& file_out == NULL) {
+		sc_log(card->ctx, "file already selected");
+		card->stats.selects_elided++;
+		r = SC_SUCCESS;
+	} else {
+		r = SC_ERROR_INTERNAL;
+		if (sc_ef_cache_relative_path(card, in_path, &rel)) {
+			r = card->ops->select_file(card, &rel, file_out);
+			if (r < 0 && file_out != NULL && *file_out != NULL) {
+				sc_file_free(*file_out);
+				*file_out = NULL;
+			}
+		}
+		if (r < 0)
+			r = card->ops->select_file(card, in_path, file_out);
+		if (r < 0)
+			return r;
+		if (file_out != NULL) {
+			if (*file_out != NULL)
+				sc_ef_cache_store_fci(card, in_path, *file_out);
+			return r;
+		}
+	}
+
+	if (file != NULL && fci != NULL) {
+		sc_file_dup(file, fci->file);
+		if (*file == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	return r;
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
@@ -716,8 +1359,21 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-	r = card->ops->select_file(card, in_path, file);
+	if (card->ef_cache.negative_enabled && sc_ef_cache_path_absolute(in_path)
+			&& sc_ef_cache_is_absent(card, in_path)) {
+		sc_log(card->ctx, "file is known to be absent");
+		card->stats.absent_hits++;
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
+	}
+	if (card->ef_cache.select_enabled && sc_ef_cache_path_absolute(in_path))
+		r = sc_select_file_cached(card, in_path, file);
+	else
+		r = card->ops->select_file(card, in_path, file);
+	if (r == SC_ERROR_FILE_NOT_FOUND && card->ef_cache.negative_enabled
+			&& sc_ef_cache_path_absolute(in_path))
+		sc_ef_cache_store_absent(card, in_path);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+	sc_ef_cache_select(card, in_path);
 
 	if (file) {
 		if (*file)
@@ -783,7 +1439,16 @@ int sc_read_record(sc_card_t *card, unsigned int rec_nr, u8 *buf,
 
 	if (card->ops->read_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* only records addressed by number can be cached */
+	if (rec_nr != 0 && (flags & SC_RECORD_BY_REC_NR)) {
+		r = sc_ef_cache_read(card, rec_nr, 0, buf, count, flags);
+		if (r >= 0)
+			LOG_FUNC_RETURN(card->ctx, r);
+	}
 	r = card->ops->read_record(card, rec_nr, buf, count, flags);
+	if (r >= 0 && rec_nr != 0 && (flags & SC_RECORD_BY_REC_NR))
+		sc_ef_cache_store(card, rec_nr, 0, buf, r, count, flags);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -798,6 +1463,7 @@ int sc_write_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 
 	if (card->ops->write_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 	r = card->ops->write_record(card, rec_nr, buf, count, flags);
 
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -813,6 +1479,7 @@ int sc_append_record(sc_card_t *card, const u8 * buf, size_t count,
 
 	if (card->ops->append_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 	r = card->ops->append_record(card, buf, count, flags);
 
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -828,6 +1495,7 @@ int sc_update_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 
 	if (card->ops->update_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 	r = card->ops->update_record(card, rec_nr, buf, count, flags);
 
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -842,6 +1510,7 @@ int sc_delete_record(sc_card_t *card, unsigned int rec_nr)
 
 	if (card->ops->delete_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_ef_cache_drop_current(card);
 	r = card->ops->delete_record(card, rec_nr);
 
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -855,6 +1524,22 @@ sc_card_ctl(sc_card_t *card, unsigned long cmd, void *args)
 	assert(card != NULL);
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* APDU statistics are maintained for all cards */
+	switch (cmd) {
+	case SC_CARDCTL_GET_STATS:
+		if (args == NULL)
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+		sc_mutex_lock(card->ctx, card->mutex);
+		memcpy(args, &card->stats, sizeof(card->stats));
+		sc_mutex_unlock(card->ctx, card->mutex);
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	case SC_CARDCTL_RESET_STATS:
+		sc_mutex_lock(card->ctx, card->mutex);
+		memset(&card->stats, 0, sizeof(card->stats));
+		sc_mutex_unlock(card->ctx, card->mutex);
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+
 	if (card->ops->card_ctl != NULL)
 		r = card->ops->card_ctl(card, cmd, args);
 
@@ -960,67 +1645,251 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length, NULL);
 }
 
+/* Binary form of an ATR table, built once per context and table, so that
+ * matching needs no hex conversions. Unmasked ATRs are found by hashing,
+ * masked ones are compared within the bucket of their length. */
+struct sc_atr_index_entry {
+	u8 value[SC_MAX_ATR_SIZE];	/* reduced with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;
+	int idx;			/* index in the ATR table */
+	int masked;
+};
+
+struct sc_atr_index {
+	const struct sc_atr_table *table;
+	/* detect a table that was reallocated at the same address */
+	const char *first_atr, *last_atr;
+	size_t count;
+
+	/* usable entries ordered by length, then by table index; entries
+	 * of length 'len' are first[len] to first[len + 1] - 1 */
+	struct sc_atr_index_entry *entries;
+	size_t first[SC_MAX_ATR_SIZE + 2];
+
+	/* open addressing hash of the unmasked entries, 0 is an empty slot,
+	 * otherwise the entry number + 1 */
+	unsigned int *hash;
+	size_t hash_size;
+
+	struct sc_atr_index *next;
+};
+
+static unsigned long sc_atr_index_hash(const u8 *value, size_t len)
+{
+	unsigned long h = 2166136261UL ^ (unsigned long) len;
+
+	while (len-- > 0) {
+		h ^= *value++;
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+static void sc_atr_index_free(struct sc_atr_index *index)
+{
+	free(index->entries);
+	free(index->hash);
+	free(index);
+}
+
+/* Parses one table entry the way the hex ATR strings were compared before:
+ * the ATR must be written with separators and the mask must have the same
+ * form */
+static int sc_atr_index_parse(const struct sc_atr_table *src, struct sc_atr_index_entry *e)
+{
+	size_t len, mlen, s;
+
+	len = sizeof(e->value);
+	if (sc_hex_to_bin(src->atr, e->value, &len) != SC_SUCCESS
+			|| len == 0 || strlen(src->atr) != 3 * len - 1)
+		return 0;
+	e->len = len;
+	e->masked = src->atrmask != NULL;
+	if (e->masked) {
+		mlen = sizeof(e->mask);
+		if (strlen(src->atrmask) != strlen(src->atr)
+				|| sc_hex_to_bin(src->atrmask, e->mask, &mlen) != SC_SUCCESS
+				|| mlen != len)
+			return 0;
+		for (s = 0; s < len; s++)
+			e->value[s] &= e->mask[s];
+	}
+	return 1;
+}
+
+static struct sc_atr_index *sc_atr_index_build(const struct sc_atr_table *table)
+{
+	struct sc_atr_index *index;
+	struct sc_atr_index_entry e;
+	size_t count, n, i, len, slot, pos[SC_MAX_ATR_SIZE + 2];
+
+	index = calloc(1, sizeof(struct sc_atr_index));
+	if (index == NULL)
+		return NULL;
+	for (count = 0; table[count].atr != NULL; count++)
+		;
+	index->table = table;
+	index->count = count;
+	index->first_atr = count ? table[0].atr : NULL;
+	index->last_atr = count ? table[count - 1].atr : NULL;
+
+	/* count the usable entries of every length */
+	for (i = 0; i < count; i++) {
+		memset(&e, 0, sizeof(e));
+		if (sc_atr_index_parse(&table[i], &e))
+			index->first[e.len + 1]++;
+	}
+	for (len = 1; len < SC_MAX_ATR_SIZE + 2; len++)
+		index->first[len] += index->first[len - 1];
+	n = index->first[SC_MAX_ATR_SIZE + 1];
+
+	index->entries = calloc(n ? n : 1, sizeof(struct sc_atr_index_entry));
+	for (index->hash_size = 16; index->hash_size < 2 * n; index->hash_size *= 2)
+		;
+	index->hash = calloc(index->hash_size, sizeof(unsigned int));
+	if (index->entries == NULL || index->hash == NULL) {
+		sc_atr_index_free(index);
+		return NULL;
+	}
+
+	memcpy(pos, index->first, sizeof(pos));
+	for (i = 0; i < count; i++) {
+		memset(&e, 0, sizeof(e));
+		if (!sc_atr_index_parse(&table[i], &e))
+			continue;
+		e.idx = (int) i;
+		n = pos[e.len]++;
+		index->entries[n] = e;
+		if (e.masked)
+			continue;
+
+		/* the first of several equal ATRs wins */
+		slot = sc_atr_index_hash(e.value, e.len) & (index->hash_size - 1);
+		while (index->hash[slot] != 0) {
+			const struct sc_atr_index_entry *o = &index->entries[index->hash[slot] - 1];
+
+			if (o->len == e.len && !memcmp(o->value, e.value, e.len))
+				break;
+			slot = (slot + 1) & (index->hash_size - 1);
+		}
+		if (index->hash[slot] == 0)
+			index->hash[slot] = (unsigned int) n + 1;
+	}
+	return index;
+}
+
+/* Returns the index of 'table', building it on first use. Called with the
+ * context mutex held. */
+static struct sc_atr_index *sc_atr_index_get(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index **pp, *index;
+
+	for (pp = &ctx->atr_index; (index = *pp) != NULL; pp = &index->next) {
+		if (index->table != table)
+			continue;
+		if (index->first_atr == (index->count ? table[0].atr : NULL)
+				&& table[index->count].atr == NULL
+				&& (index->count == 0 || table[index->count - 1].atr == index->last_atr))
+			return index;
+		/* stale */
+		*pp = index->next;
+		sc_atr_index_free(index);
+		break;
+	}
+
+	index = sc_atr_index_build(table);
+	if (index != NULL) {
+		index->next = ctx->atr_index;
+		ctx->atr_index = index;
+	}
+	return index;
+}
+
+static void sc_atr_index_drop(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index **pp = &ctx->atr_index;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	while (*pp != NULL) {
+		struct sc_atr_index *index = *pp;
+
+		if (table == NULL || index->table == table) {
+			*pp = index->next;
+			sc_atr_index_free(index);
+		} else {
+			pp = &index->next;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_build_atr_index(sc_context_t *ctx)
+{
+	unsigned int i;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		if (ctx->card_drivers[i]->atr_map != NULL)
+			sc_atr_index_get(ctx, ctx->card_drivers[i]->atr_map);
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	sc_atr_index_drop(ctx, NULL);
+}
+
 static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
 {
-	u8 *card_atr_bin;
-	size_t card_atr_bin_len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	const struct sc_atr_index *index;
+	const struct sc_atr_index_entry *e;
+	unsigned long h;
+	size_t slot, n, s;
+	int res = -1;
 
 	if (ctx == NULL || table == NULL || atr == NULL)
 		return -1;
-	card_atr_bin = atr->value;
-	card_atr_bin_len = atr->len;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
-
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
-
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
-
-		sc_log(ctx, "ATR try : %s", tatr);
-
-		if (tatr_len != fix_hex_len) {
-			sc_log(ctx, "ignored - wrong length");
-			continue;
+	if (atr->len == 0 || atr->len > SC_MAX_ATR_SIZE)
+		return -1;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	index = sc_atr_index_get(ctx, table);
+	if (index == NULL) {
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return -1;
+	}
+
+	h = sc_atr_index_hash(atr->value, atr->len);
+	for (slot = h & (index->hash_size - 1); index->hash[slot] != 0;
+			slot = (slot + 1) & (index->hash_size - 1)) {
+		e = &index->entries[index->hash[slot] - 1];
+		if (e->len == atr->len && !memcmp(e->value, atr->value, atr->len)) {
+			res = e->idx;
+			break;
 		}
-		if (matr != NULL) {
-			sc_log(ctx, "ATR mask: %s", matr);
+	}
 
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
-				continue;
-			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
-			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
+	/* a masked entry in front of the exact match takes precedence */
+	for (n = index->first[atr->len]; n < index->first[atr->len + 1]; n++) {
+		e = &index->entries[n];
+		if (res >= 0 && e->idx > res)
+			break;
+		if (!e->masked)
+			continue;
+		for (s = 0; s < atr->len; s++)
+			if ((atr->value[s] & e->mask[s]) != e->value[s])
+				break;
+		if (s == atr->len) {
+			res = e->idx;
+			break;
 		}
-		return i;
 	}
-	return -1;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (res >= 0)
+		sc_log(ctx, "ATR matched: %s", table[res].atr);
+	return res;
 }
 
 int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
@@ -1071,6 +1940,7 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	sc_atr_index_drop(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -1114,6 +1984,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	sc_atr_index_drop(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -44,6 +44,8 @@ enum {
 	SC_CARDCTL_GET_CHV_REFERENCE_IN_SE,
 	SC_CARDCTL_PKCS11_INIT_TOKEN,
 	SC_CARDCTL_PKCS11_INIT_PIN,
+	SC_CARDCTL_GET_STATS,
+	SC_CARDCTL_RESET_STATS,
 
 	/*
 	 * GPK specific calls
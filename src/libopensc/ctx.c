@@ -50,6 +50,7 @@ int _sc_add_reader(sc_context_t *ctx, sc_reader_t *reader)
 int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
 	assert(reader != NULL);
+	sc_apdu_worker_stop(reader);
 	if (reader->ops->release)
 			reader->ops->release(reader);
 	if (reader->name)
@@ -276,6 +277,11 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	int r = SC_SUCCESS;
+
+	/* the asynchronous writer must not use the file while it is replaced */
+	sc_log_async_lock(ctx);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -290,9 +296,11 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	else {
 		ctx->debug_file = fopen(filename, "a");
 		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
+			r = SC_ERROR_INTERNAL;
 	}
-	return SC_SUCCESS;
+
+	sc_log_async_unlock(ctx);
+	return r;
 }
 
 
@@ -329,6 +337,17 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, val);
 	}
 
+	if (scconf_get_bool(block, "debug_async", 0)) {
+		val = scconf_get_str(block, "debug_async_overflow", "drop");
+		if (sc_log_async_start(ctx, scconf_get_int(block, "debug_async_records", 1024),
+					!strcmp(val, "block")) != SC_SUCCESS)
+			sc_log(ctx, "Cannot start asynchronous logging");
+	}
+
+	val = scconf_get_str(block, "apdu_trace", NULL);
+	if (val)
+		sc_apdu_trace_open(ctx, val);
+
 	if (scconf_get_bool (block, "paranoid-memory",
 				ctx->flags & SC_CTX_FLAG_PARANOID_MEMORY))
 		ctx->flags |= SC_CTX_FLAG_PARANOID_MEMORY;
@@ -337,6 +356,22 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (scconf_get_bool (block, "ef_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_EF_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_EF_CACHE;
+
+	if (scconf_get_bool (block, "select_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_SELECT_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_SELECT_CACHE;
+
+	if (scconf_get_bool (block, "negative_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_NEGATIVE_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_NEGATIVE_CACHE;
+
+	if (scconf_get_bool (block, "driver_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_DRIVER_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_DRIVER_CACHE;
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -732,6 +767,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
+	scconf_block		*conf_block;
 	int			r;
 
 	if (ctx_out == NULL || parm == NULL)
@@ -782,6 +818,12 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block && scconf_get_bool(conf_block, "enable", 0))
+		ctx->reader_driver = sc_get_virtual_driver();
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	if (conf_block && scconf_get_bool(conf_block, "enable", 0))
+		ctx->reader_driver = sc_get_replay_driver();
 
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
@@ -791,6 +833,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_build_atr_index(ctx);
 	if (opts.forced_card_driver) {
 		/* FIXME: check return value? */
 		sc_set_card_driver(ctx, opts.forced_card_driver);
@@ -856,6 +899,7 @@ int sc_release_context(sc_context_t *ctx)
 		if (drv->dll)
 			sc_dlclose(drv->dll);
 	}
+	_sc_free_atr_index(ctx);
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
 	if (ctx->mutex != NULL) {
@@ -867,10 +911,12 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	sc_log_async_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
 		free(ctx->debug_filename);
+	sc_apdu_trace_close(ctx);
 	if (ctx->app_name != NULL)
 		free(ctx->app_name);
 	list_destroy(&ctx->readers);
@@ -89,19 +89,42 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 		unsigned char *out, size_t *out_len)
 {
 	struct sc_context *ctx = card->ctx;
-	struct sc_remote_apdu *rapdu = rdata->data;
-	int rv = SC_SUCCESS, offs = 0;
+	struct sc_remote_apdu *rapdu;
+	struct sc_apdu **apdus = NULL;
+	int *results = NULL;
+	int rv = SC_SUCCESS, offs = 0, count = 0, sent, ii;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "iasecc_sm_transmit_apdus() rdata-length %i", rdata->length);
 
-	while (rapdu)   {
+	for (rapdu = rdata->data; rapdu; rapdu = rapdu->next)
+		count++;
+	if (count)   {
+		apdus = calloc(count, sizeof(*apdus));
+		results = calloc(count, sizeof(*results));
+		if (!apdus || !results)   {
+			free(apdus);
+			free(results);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+	}
+
+	for (ii = 0, rapdu = rdata->data; rapdu; rapdu = rapdu->next, ii++)   {
 		sc_log(ctx, "iasecc_sm_transmit_apdus() rAPDU flags 0x%X", rapdu->apdu.flags);
-		rv = sc_transmit_apdu(card, &rapdu->apdu);
-		LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDU");
-		rv = sc_check_sw(card, rapdu->apdu.sw1, rapdu->apdu.sw2);
+		if (rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL)
+			rapdu->apdu.flags |= SC_APDU_FLAGS_NOT_FATAL;
+		apdus[ii] = &rapdu->apdu;
+	}
+
+	/* All r-APDUs go to the card in one transaction */
+	sent = sc_transmit_apdus(card, apdus, count, SC_TRANSMIT_APDUS_STOP_ON_ERROR, 0, 0, results);
+	if (sent < 0)
+		rv = sent;
+
+	for (ii = 0, rapdu = rdata->data; ii < sent; rapdu = rapdu->next, ii++)   {
+		rv = results[ii];
 		if (rv < 0 && !(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))
-			LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() fatal error %i");
+			break;
 
 		if (out && out_len && (rapdu->flags & SC_REMOTE_APDU_FLAG_RETURN_ANSWER))   {
 			int len = rapdu->apdu.resplen > (*out_len - offs) ? (*out_len - offs) : rapdu->apdu.resplen;
@@ -110,9 +133,10 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 			offs += len;
 			/* TODO: decode and gather data answers */
 		}
-
-		rapdu = rapdu->next;
 	}
+	free(apdus);
+	free(results);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDU");
 
 	if (out_len)
 		*out_len = offs;
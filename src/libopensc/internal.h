@@ -56,6 +56,16 @@ extern "C" {
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
+/* Functions returning a static buffer use one buffer per thread, so that
+ * threads working on different cards do not overwrite each other's result */
+#if defined(_MSC_VER)
+#define SC_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define SC_THREAD_LOCAL __thread
+#else
+#define SC_THREAD_LOCAL
+#endif
+
 struct sc_atr_table {
 	/* The atr fields are required to
 	 * be in aa:bb:cc hex format. */
@@ -116,6 +126,11 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
  * be null terminated. */
 int _sc_match_atr(struct sc_card *card, struct sc_atr_table *table, int *type_out);
 
+/* Builds the binary index of the ATR tables of the loaded card drivers. The
+ * tables of the drivers themselves are indexed on first use. */
+void _sc_build_atr_index(struct sc_context *ctx);
+void _sc_free_atr_index(struct sc_context *ctx);
+
 int _sc_card_add_algorithm(struct sc_card *card, const struct sc_algorithm_info *info);
 int _sc_card_add_rsa_alg(struct sc_card *card, unsigned int key_length,
 			 unsigned long flags, unsigned long exponent);
@@ -160,6 +175,41 @@ int sc_get_encoding_flags(sc_context_t *ctx,
 	unsigned long iflags, unsigned long caps,
 	unsigned long *pflags, unsigned long *salg);
 
+/**
+ * Starts writing the debug log from a background thread.
+ * @param  ctx      sc_context_t object
+ * @param  records  number of log lines which can be queued
+ * @param  block    if non-zero, wait for room in a full queue instead of
+ *                  dropping the line
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_log_async_start(sc_context_t *ctx, size_t records, int block);
+/**
+ * Writes the queued log lines and stops the background log writer.
+ */
+void sc_log_async_stop(sc_context_t *ctx);
+/**
+ * Waits until all queued log lines have been written.
+ */
+void sc_log_async_flush(sc_context_t *ctx);
+/**
+ * Writes the queued log lines and keeps the background writer away from
+ * the debug file until sc_log_async_unlock(), so that it can be replaced.
+ * The caller must not log in between.
+ */
+void sc_log_async_lock(sc_context_t *ctx);
+void sc_log_async_unlock(sc_context_t *ctx);
+
+/**
+ * Returns the wall clock time in microseconds since the epoch.
+ */
+unsigned long long sc_get_time_usec(void);
+
+/**
+ * Drops all content kept in the EF content cache of the card.
+ */
+void sc_invalidate_ef_cache(struct sc_card *card);
+
 /********************************************************************/
 /*             mutex functions                                      */
 /********************************************************************/
@@ -221,6 +271,35 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	size_t *len, unsigned int proto);
+/**
+ * Encodes the APDU into the scratch buffer of the card in the reader,
+ * which is kept from one APDU to the next, and reserves room for the
+ * response behind it. If the buffer is in use by another thread, or no
+ * card is connected yet, a buffer of its own is allocated. The caller has to release the buffer with
+ * sc_apdu_release_scratch_octets() when done.
+ * @param  reader  the reader transmitting the APDU
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  proto   protocol to be used
+ * @param  sbuf    receives the encoded APDU
+ * @param  slen    receives the length of the encoded APDU
+ * @param  rbuf    receives the buffer for the response
+ * @param  rlen    size needed for the response
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_get_scratch_octets(sc_reader_t *reader, const sc_apdu_t *apdu,
+	unsigned int proto, u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen);
+/**
+ * Clears and gives back the buffer of sc_apdu_get_scratch_octets()
+ * @param  reader  the reader transmitting the APDU
+ * @param  sbuf    the encoded APDU, may be NULL
+ * @param  len     number of bytes to clear, APDU and response
+ */
+void sc_apdu_release_scratch_octets(sc_reader_t *reader, u8 *sbuf, size_t len);
+/**
+ * Releases the scratch buffer of a card
+ * @param  card  the card
+ */
+void sc_apdu_free_scratch(sc_card_t *card);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -241,11 +320,63 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
  */
 #define sc_apdu_log(ctx, level, data, len, is_outgoing) \
 	sc_debug_hex(ctx, level, is_outgoing != 0 ? "Outgoing APDU" : "Incoming APDU", data, len)
+/**
+ * Stops the APDU worker thread of a reader once it sent the queued APDUs
+ * @param  reader  the reader, may have no worker
+ */
+void sc_apdu_worker_stop(sc_reader_t *reader);
+
+/*
+ * APDU trace files start with SC_APDU_TRACE_MAGIC followed by records of
+ * the following form (all integers big endian):
+ *
+ *	type      1 byte   SC_APDU_TRACE_ATR or SC_APDU_TRACE_APDU
+ *	time      8 bytes  microseconds since the epoch
+ *	duration  4 bytes  microseconds spent in the reader driver
+ *	len1      2 bytes  length of the ATR or of the encoded command
+ *	data1     len1 bytes
+ *	len2      2 bytes  length of the response, including SW1 SW2
+ *	data2     len2 bytes
+ *
+ * For ATR records data2 is the active protocol (4 bytes). The data field of
+ * VERIFY, CHANGE REFERENCE DATA and RESET RETRY COUNTER commands is zeroed,
+ * see sc_apdu_trace_mask(). Processes sharing a trace file append to it.
+ */
+#define SC_APDU_TRACE_MAGIC		"OSCTRACE"
+#define SC_APDU_TRACE_MAGIC_LEN		8
+#define SC_APDU_TRACE_ATR		0x01
+#define SC_APDU_TRACE_APDU		0x02
+
+/**
+ * Opens the APDU trace file, all APDUs exchanged afterwards are recorded.
+ * @param  ctx       sc_context_t object
+ * @param  filename  trace file to create or append to
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_trace_open(sc_context_t *ctx, const char *filename);
+/**
+ * Closes the APDU trace file, if any.
+ * @param  ctx  sc_context_t object
+ */
+void sc_apdu_trace_close(sc_context_t *ctx);
+/**
+ * Zeroes the data field of an encoded command if it may carry a PIN or PUK.
+ * @param  buf  encoded command APDU
+ * @param  len  length of the command
+ */
+void sc_apdu_trace_mask(u8 *buf, size_t len);
+/**
+ * Records the ATR of a newly connected card in the APDU trace.
+ * @param  reader  sc_reader_t object with the ATR
+ */
+void sc_apdu_trace_atr(sc_reader_t *reader);
 
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
 
 #ifdef __cplusplus
 }
@@ -128,6 +128,78 @@ iso7816_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2)
 }
 
 
+/* READ BINARY with odd INS (B1) for offsets beyond the 15 bits of P1-P2.
+ * The offset is sent in an offset data object '54' and the data comes back
+ * wrapped in a discretionary data object '53' for the current EF. */
+static int
+iso7816_read_binary_odd(struct sc_card *card, unsigned int idx, u8 *buf, size_t count)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_apdu apdu;
+	size_t max_le = sc_get_max_recv_size(card);
+	u8 sbuf[6], *rbuf, *p;
+	size_t len, left, n;
+	int r;
+
+	if (max_le < 8)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OFFSET_TOO_LARGE);
+	/* leave room for the tag and length of the '53' object */
+	if (count + 4 > max_le)
+		count = max_le - 4;
+
+	sbuf[0] = 0x54;
+	for (n = 0; n < 4 && (idx >> (8 * n)) != 0; n++)
+		;
+	sbuf[1] = (u8) n;
+	for (len = 0; len < n; len++)
+		sbuf[2 + len] = (idx >> (8 * (n - 1 - len))) & 0xFF;
+
+	len = count + (count < 0x80 ? 2 : count < 0x100 ? 3 : 4);
+	rbuf = malloc(len);
+	if (rbuf == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, 0x00, 0x00);
+	apdu.lc = apdu.datalen = 2 + n;
+	apdu.data = sbuf;
+	apdu.le = apdu.resplen = len;
+	apdu.resp = rbuf;
+
+	r = sc_transmit_apdu(card, &apdu);
+	if (r < 0)
+		goto out;
+	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	if (apdu.resplen == 0 || (r < 0 && r != SC_ERROR_FILE_END_REACHED))
+		goto out;
+
+	p = rbuf;
+	left = apdu.resplen;
+	r = SC_ERROR_INVALID_DATA;
+	if (left < 2 || *p != 0x53)
+		goto out;
+	len = p[1];
+	p += 2;
+	left -= 2;
+	if (len & 0x80) {
+		n = len & 0x7F;
+		if (n == 0 || n > 3 || n > left)
+			goto out;
+		for (len = 0; n > 0; n--, left--)
+			len = (len << 8) | *p++;
+	}
+	/* the object may be cut short by Le */
+	if (len > left)
+		len = left;
+	if (len > count)
+		len = count;
+	memcpy(buf, p, len);
+	r = (int) len;
+out:
+	free(rbuf);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 static int
 iso7816_read_binary(struct sc_card *card, unsigned int idx, u8 *buf, size_t count, unsigned long flags)
 {
@@ -136,8 +208,16 @@ iso7816_read_binary(struct sc_card *card, unsigned int idx, u8 *buf, size_t coun
 	int r;
 
 	if (idx > 0x7fff) {
-		sc_log(ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
-		return SC_ERROR_OFFSET_TOO_LARGE;
+		sc_log(ctx, "EF offset 0x%X > 0x7FFF, using READ BINARY with odd INS", idx);
+		r = iso7816_read_binary_odd(card, idx, buf, count);
+		if (r > 0 && (size_t) r < count) {
+			int rest = iso7816_read_binary(card, idx + r, buf + r, count - r, flags);
+			if (rest == SC_ERROR_CORRUPTED_DATA)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_CORRUPTED_DATA);
+			else if (rest > 0)
+				r += rest;
+		}
+		LOG_FUNC_RETURN(ctx, r);
 	}
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
@@ -44,6 +44,342 @@
 
 #include "internal.h"
 
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define SC_LOG_ASYNC
+
+/*
+ * Asynchronous logging: threads put formatted lines into a bounded
+ * multi-producer ring buffer (slots carry a sequence number, producers
+ * claim slots with compare-and-swap) and a background thread writes them
+ * to the debug file. When the ring is full, lines are either dropped and
+ * counted or the producer waits for a free slot.
+ */
+struct sc_log_slot {
+	volatile size_t seq;
+	char *line;
+};
+
+struct sc_log_async {
+	sc_context_t *ctx;
+	struct sc_log_slot *slots;
+	size_t mask;
+	volatile size_t head;		/* next slot to fill */
+	volatile size_t tail;		/* next slot to write */
+	volatile unsigned long dropped;
+	int block;
+	/* set in a forked child, which has no writer thread */
+	volatile int orphaned;
+
+	pthread_t thread;
+	/* held while writing; protects the debug file and 'tail' */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* lines queued */
+	pthread_cond_t space;		/* lines written */
+	volatile int waiting;		/* threads waiting for the mutex */
+	volatile int stop;
+
+	struct sc_log_async *next;
+};
+
+/* All writers, for the fork handlers */
+static pthread_mutex_t sc_log_async_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sc_log_async_once = PTHREAD_ONCE_INIT;
+static struct sc_log_async *sc_log_async_list = NULL;
+
+static void sc_log_async_timeout(struct timespec *ts, long usec)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = (tv.tv_usec + usec) * 1000;
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Lets the writer know that it should give up the mutex */
+static void sc_log_async_mutex_lock(struct sc_log_async *async)
+{
+	__sync_fetch_and_add(&async->waiting, 1);
+	pthread_mutex_lock(&async->mutex);
+	__sync_fetch_and_sub(&async->waiting, 1);
+}
+
+static int sc_log_async_put(struct sc_log_async *async, char *line)
+{
+	struct sc_log_slot *slot;
+	struct timespec ts;
+	size_t pos = async->head;
+
+	for (;;) {
+		slot = &async->slots[pos & async->mask];
+		if (slot->seq == pos) {
+			if (__sync_bool_compare_and_swap(&async->head, pos, pos + 1))
+				break;
+		}
+		else if ((long) (slot->seq - pos) < 0) {
+			/* ring is full */
+			if (!async->block) {
+				__sync_fetch_and_add(&async->dropped, 1);
+				return SC_ERROR_BUFFER_TOO_SMALL;
+			}
+			sc_log_async_timeout(&ts, 10000);
+			sc_log_async_mutex_lock(async);
+			pthread_cond_signal(&async->cond);
+			pthread_cond_timedwait(&async->space, &async->mutex, &ts);
+			pthread_mutex_unlock(&async->mutex);
+		}
+		pos = async->head;
+	}
+
+	slot->line = line;
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	pthread_cond_signal(&async->cond);
+	return SC_SUCCESS;
+}
+
+/* Writes all queued lines, returns the number of lines written.
+ * Called with async->mutex held. */
+static size_t sc_log_async_write(struct sc_log_async *async)
+{
+	struct sc_log_slot *slot;
+	FILE *outf = async->ctx->debug_file;
+	unsigned long dropped;
+	size_t n = 0;
+
+	for (;;) {
+		slot = &async->slots[async->tail & async->mask];
+		if (slot->seq != async->tail + 1)
+			break;
+		__sync_synchronize();
+		if (outf != NULL)
+			fputs(slot->line, outf);
+		free(slot->line);
+		slot->line = NULL;
+		__sync_synchronize();
+		slot->seq = async->tail + async->mask + 1;
+		async->tail++;
+		n++;
+	}
+
+	dropped = __sync_fetch_and_and(&async->dropped, 0);
+	if (dropped && outf != NULL)
+		fprintf(outf, "*** %lu log messages dropped ***\n", dropped);
+	if ((n || dropped) && outf != NULL)
+		fflush(outf);
+	if (n)
+		pthread_cond_broadcast(&async->space);
+	return n;
+}
+
+/* Writes the lines queued so far. Called with async->mutex held. */
+static void sc_log_async_drain(struct sc_log_async *async)
+{
+	struct timespec ts;
+	size_t end = async->head;
+
+	while ((long) (end - async->tail) > 0) {
+		if (sc_log_async_write(async))
+			continue;
+		/* a producer has claimed a slot but not filled it yet */
+		sc_log_async_timeout(&ts, 1000);
+		pthread_cond_timedwait(&async->cond, &async->mutex, &ts);
+	}
+}
+
+static void *sc_log_async_thread(void *arg)
+{
+	struct sc_log_async *async = (struct sc_log_async *) arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&async->mutex);
+	for (;;) {
+		if (sc_log_async_write(async) && !async->waiting)
+			continue;
+		if (async->stop && async->tail == async->head)
+			break;
+
+		/* producers signal without holding the mutex, so do not wait
+		 * forever for a wakeup which might have been missed */
+		sc_log_async_timeout(&ts, 10000);
+		pthread_cond_timedwait(&async->cond, &async->mutex, &ts);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+/* Keep the writers' mutexes consistent across fork(): the child would
+ * otherwise inherit a mutex held by a writer thread it does not have */
+static void sc_log_async_prepare(void)
+{
+	struct sc_log_async *async;
+
+	pthread_mutex_lock(&sc_log_async_list_lock);
+	for (async = sc_log_async_list; async != NULL; async = async->next)
+		pthread_mutex_lock(&async->mutex);
+}
+
+static void sc_log_async_parent(void)
+{
+	struct sc_log_async *async;
+
+	for (async = sc_log_async_list; async != NULL; async = async->next)
+		pthread_mutex_unlock(&async->mutex);
+	pthread_mutex_unlock(&sc_log_async_list_lock);
+}
+
+static void sc_log_async_child(void)
+{
+	struct sc_log_async *async;
+	size_t i;
+
+	/* The queued lines are written by the parent. The child logs
+	 * synchronously from now on. */
+	for (async = sc_log_async_list; async != NULL; async = async->next) {
+		for (i = 0; i <= async->mask; i++) {
+			free(async->slots[i].line);
+			async->slots[i].line = NULL;
+			async->slots[i].seq = i;
+		}
+		async->head = async->tail = 0;
+		async->dropped = 0;
+		async->orphaned = 1;
+		pthread_mutex_unlock(&async->mutex);
+	}
+	pthread_mutex_unlock(&sc_log_async_list_lock);
+}
+
+static void sc_log_async_init(void)
+{
+	pthread_atfork(sc_log_async_prepare, sc_log_async_parent, sc_log_async_child);
+}
+#endif
+
+int sc_log_async_start(sc_context_t *ctx, size_t records, int block)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_async *async;
+	size_t size = 16, i;
+
+	if (ctx->debug_async != NULL)
+		return SC_SUCCESS;
+
+	while (size < records)
+		size <<= 1;
+
+	async = calloc(1, sizeof(struct sc_log_async));
+	if (async == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	async->slots = calloc(size, sizeof(struct sc_log_slot));
+	if (async->slots == NULL) {
+		free(async);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (i = 0; i < size; i++)
+		async->slots[i].seq = i;
+	async->ctx = ctx;
+	async->mask = size - 1;
+	async->block = block;
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->cond, NULL);
+	pthread_cond_init(&async->space, NULL);
+
+	pthread_once(&sc_log_async_once, sc_log_async_init);
+	pthread_mutex_lock(&sc_log_async_list_lock);
+	if (pthread_create(&async->thread, NULL, sc_log_async_thread, async) != 0) {
+		pthread_mutex_unlock(&sc_log_async_list_lock);
+		pthread_cond_destroy(&async->space);
+		pthread_cond_destroy(&async->cond);
+		pthread_mutex_destroy(&async->mutex);
+		free(async->slots);
+		free(async);
+		return SC_ERROR_INTERNAL;
+	}
+	async->next = sc_log_async_list;
+	sc_log_async_list = async;
+	pthread_mutex_unlock(&sc_log_async_list_lock);
+	ctx->debug_async = async;
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void sc_log_async_stop(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_async *async = (struct sc_log_async *) ctx->debug_async;
+	struct sc_log_async **pp;
+
+	if (async == NULL)
+		return;
+
+	pthread_mutex_lock(&sc_log_async_list_lock);
+	for (pp = &sc_log_async_list; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == async) {
+			*pp = async->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sc_log_async_list_lock);
+
+	if (async->orphaned) {
+		pthread_mutex_lock(&async->mutex);
+		sc_log_async_drain(async);
+		pthread_mutex_unlock(&async->mutex);
+	} else {
+		/* the writer drains the ring before terminating */
+		async->stop = 1;
+		pthread_cond_signal(&async->cond);
+		pthread_join(async->thread, NULL);
+	}
+	ctx->debug_async = NULL;
+
+	/* in a forked child the conditions may still count waiters of the
+	 * parent and destroying them would block */
+	if (!async->orphaned) {
+		pthread_cond_destroy(&async->space);
+		pthread_cond_destroy(&async->cond);
+	}
+	pthread_mutex_destroy(&async->mutex);
+	free(async->slots);
+	free(async);
+#endif
+}
+
+void sc_log_async_flush(sc_context_t *ctx)
+{
+	sc_log_async_lock(ctx);
+	sc_log_async_unlock(ctx);
+}
+
+void sc_log_async_lock(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_async *async = (struct sc_log_async *) ctx->debug_async;
+
+	if (async == NULL)
+		return;
+
+	sc_log_async_mutex_lock(async);
+	sc_log_async_drain(async);
+#endif
+}
+
+void sc_log_async_unlock(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_async *async = (struct sc_log_async *) ctx->debug_async;
+
+	if (async != NULL)
+		pthread_mutex_unlock(&async->mutex);
+#endif
+}
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -68,7 +404,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 #ifdef _WIN32
 	SYSTEMTIME st;
 #else
-	struct tm *tm;
+	struct tm tm;
 	struct timeval tv;
 	char time_string[40];
 #endif
@@ -89,8 +425,8 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
 	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
+	localtime_r(&tv.tv_sec, &tm);
+	strftime (time_string, sizeof(time_string), "%H:%M:%S", &tm);
 	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, (long)tv.tv_usec / 1000);
 #endif
 	p += r;
@@ -112,6 +448,31 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (r < 0)
 		return;
 
+	/* terminate the line here, so that it is written at once and the
+	 * lines of concurrent threads do not mix */
+	n = strlen(buf);
+	if (n == 0 || buf[n-1] != '\n') {
+		if ((size_t) n == sizeof(buf) - 1)
+			n--;
+		buf[n++] = '\n';
+		buf[n] = '\0';
+	}
+
+#ifdef SC_LOG_ASYNC
+	if (ctx->debug_async != NULL
+			&& !((struct sc_log_async *) ctx->debug_async)->orphaned) {
+		char *line;
+
+		line = malloc(n + 1);
+		if (line == NULL)
+			return;
+		memcpy(line, buf, n + 1);
+		if (sc_log_async_put(ctx->debug_async, line) != SC_SUCCESS)
+			free(line);
+		return;
+	}
+#endif
+
 #ifdef _WIN32
 	if (ctx->debug_filename)   {
 		r = sc_ctx_log_to_file(ctx, ctx->debug_filename);
@@ -124,10 +485,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (outf == NULL)
 		return;
 
-	fprintf(outf, "%s", buf);
-	n = strlen(buf);
-	if (n == 0 || buf[n-1] != '\n')
-		fprintf(outf, "\n");
+	fputs(buf, outf);
 	fflush(outf);
 
 #ifdef _WIN32
@@ -226,7 +584,7 @@ void sc_hex_dump(struct sc_context *ctx, int level, const u8 * in, size_t count,
 char *
 sc_dump_hex(const u8 * in, size_t count)
 {
-	static char dump_buf[0x1000];
+	static SC_THREAD_LOCAL char dump_buf[0x1000];
 	size_t ii, size = sizeof(dump_buf) - 0x10;
 	size_t offs = 0;
 
@@ -259,7 +617,7 @@ sc_dump_hex(const u8 * in, size_t count)
 char *
 sc_dump_oid(const struct sc_object_id *oid)
 {
-	static char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
+	static SC_THREAD_LOCAL char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
         size_t ii;
 
 	memset(dump_buf, 0, sizeof(dump_buf));
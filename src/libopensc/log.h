@@ -44,9 +44,25 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/* Messages above SC_MAX_DEBUG_LEVEL (see configure --with-max-debug-level)
+ * are compiled out */
+#ifndef SC_MAX_DEBUG_LEVEL
+#define SC_MAX_DEBUG_LEVEL	SC_LOG_DEBUG_MATCH
+#endif
+
+/* Checked before the arguments of a log message are evaluated */
+#define SC_LOG_ENABLED(ctx, level) \
+	((level) <= SC_MAX_DEBUG_LEVEL && (ctx) != NULL && (ctx)->debug >= (level))
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) do { \
+	if (SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -66,8 +82,10 @@ void _sc_log(struct sc_context *ctx, const char *format, ...);
  * @param[in] data  Binary data
  * @param[in] len   Length of \a data
  */
-#define sc_debug_hex(ctx, level, label, data, len) \
-    _sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len)
+#define sc_debug_hex(ctx, level, label, data, len) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		_sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len); \
+} while (0)
 /** 
  * @brief Log binary data
  *
@@ -87,13 +105,16 @@ void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len,
 char * sc_dump_hex(const u8 * in, size_t count);
 char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!SC_LOG_ENABLED(ctx, level)) { \
+		/* nothing to log */ \
+	} else if (_ret <= 0) { \
 		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -107,8 +128,9 @@ char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -117,8 +139,9 @@ char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
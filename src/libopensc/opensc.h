@@ -265,6 +265,74 @@ struct sc_card_cache {
 	int valid;
 };
 
+/* APDU statistics kept for every card, see SC_CARDCTL_GET_STATS */
+struct sc_card_stats {
+	unsigned long apdus;		/* APDUs passed to the reader driver */
+	unsigned long long bytes_out;	/* encoded command bytes (before SM wrapping) */
+	unsigned long long bytes_in;	/* response bytes, including SW1 SW2 (after SM unwrapping) */
+	unsigned long long transmit_usec; /* time spent in the reader driver */
+	unsigned long get_response;	/* GET RESPONSE commands issued for 61xx */
+	unsigned long ef_cache_hits;	/* reads answered from the EF content cache */
+	unsigned long selects_elided;	/* SELECTs of the already selected file */
+	unsigned long absent_hits;	/* SELECTs answered from the negative cache */
+	unsigned long se_reused;	/* key operations without SELECT and MSE */
+	unsigned long ins[256];		/* APDUs by instruction byte */
+};
+
+/* EF content cache, enabled with the 'ef_cache' option. Transparent content
+ * is kept as contiguous ranges starting at 'offset', records are kept by
+ * record number. 'complete' is set when the card returned less data than
+ * requested, i.e. the end of the file or record was reached. */
+struct sc_ef_cache_entry {
+	struct sc_path path;
+	unsigned int rec_nr;		/* 0 for transparent content */
+	unsigned long flags;
+	size_t offset, len;
+	int complete;
+	u8 *data;
+	struct sc_ef_cache_entry *next;
+};
+
+/* File information returned by SELECT, kept with the 'select_cache' option */
+struct sc_ef_cache_fci {
+	struct sc_path path;
+	struct sc_file *file;
+	struct sc_ef_cache_fci *next;
+};
+
+/* Files the card reported as not found, kept with the 'negative_cache' option */
+struct sc_ef_cache_absent {
+	struct sc_path path;
+	struct sc_ef_cache_absent *next;
+};
+
+struct sc_ef_cache {
+	int enabled;
+	int select_enabled;
+	int negative_enabled;
+	/* absolute path of the selected file, if known */
+	struct sc_path path;
+	int path_valid;
+	/* 'path' is still selected on the card: cleared when the reader lock
+	 * is released, as other applications may select files meanwhile */
+	int path_on_card;
+	size_t size;
+	struct sc_ef_cache_entry *entries;
+	struct sc_ef_cache_fci *fci;
+	struct sc_ef_cache_absent *absent;
+	size_t absent_count;
+};
+
+/* Security environment set last for a private key operation, see use_key()
+ * in pkcs15-sec.c. Any MANAGE SECURITY ENVIRONMENT, change of the selected
+ * file, logout, reset of the card or release of the reader lock clears
+ * 'valid'. */
+struct sc_security_env_memo {
+	int valid;
+	struct sc_path path;		/* key file selected before MSE */
+	struct sc_security_env env;
+};
+
 #define SC_PROTO_T0		0x00000001
 #define SC_PROTO_T1		0x00000002
 #define SC_PROTO_RAW		0x00001000
@@ -320,6 +388,9 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	void *apdu_worker;	/* see sc_transmit_apdu_async() */
+	struct sc_card *card;	/* the connected card, see sc_connect_card() */
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -487,11 +558,17 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	struct sc_card_stats stats;
+	struct sc_ef_cache ef_cache;
+	struct sc_security_env_memo se_memo;
 
 	struct sc_serial_number serialnr;
 	struct sc_version version;
 
 	void *mutex;
+	u8 *scratch;		/* see sc_apdu_get_scratch_octets() */
+	size_t scratch_len;
+	int scratch_busy;	/* scratch is in use, protected by mutex */
 #ifdef ENABLE_SM
 	struct sm_context sm_ctx;
 #endif
@@ -661,7 +738,34 @@ typedef struct {
 #define SC_CTX_FLAG_PARANOID_MEMORY			0x00000002
 #define SC_CTX_FLAG_DEBUG_MEMORY			0x00000004
 #define SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER	0x00000008
+#define SC_CTX_FLAG_ENABLE_EF_CACHE		0x00000010
+#define SC_CTX_FLAG_ENABLE_SELECT_CACHE		0x00000020
+#define SC_CTX_FLAG_ENABLE_NEGATIVE_CACHE	0x00000040
+#define SC_CTX_FLAG_ENABLE_DRIVER_CACHE		0x00000080
 
+/*
+ * Threads
+ *
+ * With mutex functions in sc_context_param_t, different cards of one
+ * context may be used from different threads at the same time. A card
+ * itself is used by one thread at a time, between sc_lock() and
+ * sc_unlock(). The state shared by all cards is handled as follows:
+ *
+ *  - readers: the list changes only in sc_context_create(),
+ *    sc_ctx_detect_readers() and sc_release_context(). Readers are never
+ *    freed before sc_release_context(). The application must not look
+ *    up readers while sc_ctx_detect_readers() runs in another thread.
+ *  - card_drivers, conf and flags: set up by sc_context_create() and
+ *    read only afterwards.
+ *  - forced_driver, atr_index and the card driver memo file: used with
+ *    ctx->mutex held.
+ *  - debug_file and apdu_trace_file: every log line and trace record is
+ *    written with a single call. Functions returning a static buffer,
+ *    like sc_print_path() and sc_dump_hex(), use one buffer per thread.
+ *
+ * Card drivers keep their state in the card. Drivers with global state
+ * must protect it themselves.
+ */
 typedef struct sc_context {
 	scconf_context *conf;
 	scconf_block *conf_blocks[3];
@@ -671,8 +775,11 @@ typedef struct sc_context {
 
 	FILE *debug_file;
 	char *debug_filename;
+	void *debug_async;
 	char *preferred_language;
 
+	FILE *apdu_trace_file;
+
 	list_t readers;
 
 	struct sc_reader_driver *reader_driver;
@@ -684,6 +791,9 @@ typedef struct sc_context {
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
 
+	/* binary ATR tables, see _sc_match_atr() */
+	struct sc_atr_index *atr_index;
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -696,6 +806,64 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *, struct sc_apdu *);
 
+/* sc_transmit_apdus() stops after an APDU failing sc_check_sw() */
+#define SC_TRANSMIT_APDUS_STOP_ON_ERROR	0x00000001UL
+
+/** Sends a sequence of APDUs while holding the card lock, so that the
+ *  APDUs go to the card in a single reader transaction
+ *  @param  card     struct sc_card object to which the APDUs should be send
+ *  @param  apdus    array of @a count APDUs, sent in this order
+ *  @param  count    number of APDUs
+ *  @param  flags    SC_TRANSMIT_APDUS_STOP_ON_ERROR to stop after the first
+ *                   APDU failing sc_check_sw(), unless the APDU has
+ *                   SC_APDU_FLAGS_NOT_FATAL set
+ *  @param  sw_mask  stop after an APDU with a status word SW for which
+ *                   (SW & sw_mask) == sw_stop; 0 if not used
+ *  @param  sw_stop  see @a sw_mask
+ *  @param  results  receives the result of sc_transmit_apdu() and
+ *                   sc_check_sw() for every APDU sent, may be NULL
+ *  @return the number of APDUs sent or an error code
+ *  @note A transmission error always ends the sequence.
+ */
+int sc_transmit_apdus(struct sc_card *card, struct sc_apdu **apdus, size_t count,
+		unsigned long flags, unsigned int sw_mask, unsigned int sw_stop, int *results);
+
+typedef struct sc_apdu_future sc_apdu_future_t;
+typedef void (*sc_apdu_callback_t)(sc_apdu_future_t *future, void *arg);
+
+/** Queues an APDU to be sent by the worker thread of the card's reader
+ *  @param  card      struct sc_card object to which the APDU should be send
+ *  @param  apdu      sc_apdu_t object of the APDU to be send
+ *  @param  callback  called from the worker thread once the APDU was sent,
+ *                    may be NULL
+ *  @param  arg       passed to @a callback
+ *  @param  future    receives the handle to wait for the result, may be NULL
+ *                    if only the callback is used
+ *  @return SC_SUCCESS if the APDU was queued and an error code otherwise
+ *  @note @a apdu and its buffers must stay valid until the APDU was sent.
+ *  Do not wait for a future while holding the card lock, the worker needs
+ *  the lock to send the APDU. Without thread support the APDU is sent
+ *  before this function returns.
+ */
+int sc_transmit_apdu_async(struct sc_card *card, struct sc_apdu *apdu,
+		sc_apdu_callback_t callback, void *arg, sc_apdu_future_t **future);
+
+/** Checks whether a queued APDU was sent
+ *  @return 1 if the result is available, 0 if not
+ */
+int sc_apdu_future_done(sc_apdu_future_t *future);
+
+/** Waits until a queued APDU was sent
+ *  @param  future   handle from sc_transmit_apdu_async()
+ *  @param  timeout  in milliseconds, -1 to wait forever
+ *  @return the result of sc_transmit_apdu() or SC_ERROR_EVENT_TIMEOUT
+ */
+int sc_apdu_future_wait(sc_apdu_future_t *future, int timeout);
+
+/** Releases a future. If the APDU was not sent yet, the future is
+ *  released once it was. */
+void sc_apdu_future_free(sc_apdu_future_t *future);
+
 void sc_format_apdu(struct sc_card *, struct sc_apdu *, int, int, int, int);
 
 int sc_check_apdu(struct sc_card *, const struct sc_apdu *);
@@ -988,6 +1156,31 @@ int sc_list_files(struct sc_card *card, u8 *buf, size_t buflen);
  */
 int sc_read_binary(struct sc_card *card, unsigned int idx, u8 * buf,
 		   size_t count, unsigned long flags);
+/**
+ * Callback for sc_read_binary_stream(), called with the card locked
+ * for every chunk read from the EF
+ * @param  arg    the cb_arg passed to sc_read_binary_stream()
+ * @param  idx    index within the file of the first byte in data
+ * @param  data   the chunk; only valid for the duration of the call
+ * @param  len    length of the chunk
+ * @return SC_SUCCESS to continue, or an error code to stop reading
+ */
+typedef int (*sc_read_binary_cb_t)(void *arg, unsigned int idx,
+		const u8 *data, size_t len);
+/**
+ * Read data from a binary EF and hand it to a callback as it arrives,
+ * so large files need not be buffered in full. Reading stops early when
+ * the end of the file is reached.
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  idx     index within the file with the data to read
+ * @param  count   number of bytes to read
+ * @param  flags   flags for the READ BINARY command, passed to the card driver
+ * @param  cb      callback receiving each chunk
+ * @param  cb_arg  argument passed to the callback
+ * @return number of bytes read or an error code
+ */
+int sc_read_binary_stream(struct sc_card *card, unsigned int idx, size_t count,
+		unsigned long flags, sc_read_binary_cb_t cb, void *cb_arg);
 /**
  * Write data to a binary EF
  * @param  card   struct sc_card object on which to issue the command
@@ -29,26 +29,95 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
 
 #include "internal.h"
 #include "pkcs15.h"
 
+/*
+ * All cached files of a token are kept in one container file in the cache
+ * directory, named after the serial number and the last update time of the
+ * token. The container is mapped into memory and looked up in place:
+ *
+ *	magic		8 bytes, SC_PKCS15_CACHE_MAGIC
+ *	count		4 bytes, number of index entries
+ *	index		'count' entries:
+ *			  key length	1 byte
+ *			  key		'key length' bytes, AID and path in hex
+ *			  offset	4 bytes, from the start of the container
+ *			  length	4 bytes
+ *			  hash		4 bytes, FNV-1a of the content
+ *	content
+ *
+ * All numbers are big endian. The container is rewritten to a temporary
+ * file and renamed, so readers never see a partial update.
+ */
+
+#define SC_PKCS15_CACHE_MAGIC		"OSCP15C1"
+#define SC_PKCS15_CACHE_MAGIC_LEN	8
+#define SC_PKCS15_CACHE_HEADER_LEN	(SC_PKCS15_CACHE_MAGIC_LEN + 4)
+#define SC_PKCS15_CACHE_KEY_MAX		(2 * (SC_MAX_AID_SIZE + SC_MAX_PATH_SIZE) + 2)
+
+#ifndef O_BINARY
+#define O_BINARY	0
+#endif
+
+struct sc_pkcs15_file_cache {
+	char filename[PATH_MAX];
+	u8 *data;
+	size_t size;
+	int mapped;
+
+	/* shared memory segment of the bind snapshot */
+	char shm_name[256];
+	u8 *shm_data;
+	size_t shm_size;
+};
+
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SYS_MMAN_H)
+#define SC_PKCS15_SHM_SNAPSHOT
+#endif
+
+static unsigned long cache_get4(const u8 *p)
+{
+	return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+		| ((unsigned long) p[2] << 8) | p[3];
+}
+
+static void cache_put4(u8 *p, unsigned long val)
+{
+	p[0] = (u8) (val >> 24);
+	p[1] = (u8) (val >> 16);
+	p[2] = (u8) (val >> 8);
+	p[3] = (u8) val;
+}
+
+static unsigned long cache_hash(const u8 *data, size_t len)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (len-- > 0)
+		hash = ((hash ^ *data++) * 16777619UL) & 0xFFFFFFFFUL;
+	return hash;
+}
+
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
 	char *last_update = NULL;
 	int  r;
-	unsigned u;
 
 	if (p15card->tokeninfo->serial_number == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	assert(path->len <= SC_MAX_PATH_SIZE);
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
@@ -59,13 +128,28 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 		last_update = "NODATE";
 
 	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-			"%s_%s", p15card->tokeninfo->serial_number, last_update);
+			"%s_%s.cache", p15card->tokeninfo->serial_number, last_update);
+
+	if (!buf || bufsize <= strlen(dir))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcpy(buf, dir);
+
+	return SC_SUCCESS;
+}
+
+/* The key of a cached file inside the container */
+static int generate_cache_key(const sc_path_t *path, char *buf, size_t bufsize)
+{
+	char key[SC_PKCS15_CACHE_KEY_MAX + 1];
+	unsigned u;
+
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	key[0] = '\0';
 
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
 		for (u = 0; u < path->aid.len; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->aid.value[u]);
 	}
 	else if (path->type != SC_PATH_TYPE_PATH)  {
@@ -77,29 +161,194 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 
 		if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
 			offs = 2;
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(key + strlen(key), sizeof(key) - strlen(key), "_");
 		for (u = 0; u < path->len - offs; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->value[u + offs]);
 	}
 
-	if (!buf || bufsize < strlen(dir))
+	if (!buf || bufsize <= strlen(key))
 		return SC_ERROR_BUFFER_TOO_SMALL;
-	strcpy(buf, dir);
+	strcpy(buf, key);
 
 	return SC_SUCCESS;
 }
 
-int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
-				const sc_path_t *path,
-				u8 **buf, size_t *bufsize)
+static void cache_unload(struct sc_pkcs15_file_cache *cache)
+{
+	if (cache->data != NULL) {
+#ifdef HAVE_SYS_MMAN_H
+		if (cache->mapped)
+			munmap(cache->data, cache->size);
+		else
+#endif
+			free(cache->data);
+	}
+	cache->data = NULL;
+	cache->size = 0;
+	cache->mapped = 0;
+	cache->filename[0] = '\0';
+}
+
+/* Checks that the index and all content are within the container */
+static int cache_check(const u8 *data, size_t size)
 {
+	size_t pos = SC_PKCS15_CACHE_HEADER_LEN;
+	unsigned long i, count;
+
+	if (size < SC_PKCS15_CACHE_HEADER_LEN
+			|| memcmp(data, SC_PKCS15_CACHE_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN) != 0)
+		return SC_ERROR_INVALID_DATA;
+
+	count = cache_get4(data + SC_PKCS15_CACHE_MAGIC_LEN);
+	for (i = 0; i < count; i++) {
+		size_t keylen, offset, length;
+
+		if (size - pos < 1 || size - pos - 1 < (size_t) data[pos] + 12)
+			return SC_ERROR_INVALID_DATA;
+		keylen = data[pos];
+		offset = cache_get4(data + pos + 1 + keylen);
+		length = cache_get4(data + pos + 1 + keylen + 4);
+		if (offset > size || length > size - offset)
+			return SC_ERROR_INVALID_DATA;
+		pos += 1 + keylen + 12;
+	}
+	return SC_SUCCESS;
+}
+
+/* Makes the container of the token available in memory */
+static int cache_load(struct sc_pkcs15_card *p15card, struct sc_pkcs15_file_cache **out)
+{
+	struct sc_pkcs15_file_cache *cache = p15card->file_cache;
 	char fname[PATH_MAX];
-	int rv;
-	FILE *f;
-	size_t count;
 	struct stat stbuf;
-	u8 *data = NULL;
+	int fd, r;
+
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct sc_pkcs15_file_cache));
+		if (cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_cache = cache;
+	}
+	if (cache->data != NULL && strcmp(cache->filename, fname) == 0) {
+		*out = cache;
+		return SC_SUCCESS;
+	}
+	cache_unload(cache);
+
+	fd = open(fname, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) != 0 || stbuf.st_size < SC_PKCS15_CACHE_HEADER_LEN) {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cache->size = (size_t) stbuf.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	cache->data = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->data == MAP_FAILED)
+		cache->data = NULL;
+	else
+		cache->mapped = 1;
+#endif
+	if (cache->data == NULL) {
+		cache->data = malloc(cache->size);
+		if (cache->data == NULL
+				|| read(fd, cache->data, cache->size) != (int) cache->size) {
+			free(cache->data);
+			cache->data = NULL;
+		}
+	}
+	close(fd);
+
+	if (cache->data == NULL || cache_check(cache->data, cache->size) != SC_SUCCESS) {
+		sc_log(p15card->card->ctx, "cannot use cache file %s", fname);
+		cache_unload(cache);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	strcpy(cache->filename, fname);
+
+	*out = cache;
+	return SC_SUCCESS;
+}
+
+/* Returns the index entry of 'key', or NULL */
+static const u8 *cache_find(const u8 *data, const char *key)
+{
+	size_t pos = SC_PKCS15_CACHE_HEADER_LEN, keylen = strlen(key);
+	unsigned long i, count = cache_get4(data + SC_PKCS15_CACHE_MAGIC_LEN);
+
+	for (i = 0; i < count; i++) {
+		if (data[pos] == keylen && memcmp(data + pos + 1, key, keylen) == 0)
+			return data + pos;
+		pos += 1 + data[pos] + 12;
+	}
+	return NULL;
+}
+
+static void shm_unload(struct sc_pkcs15_file_cache *cache)
+{
+#ifdef SC_PKCS15_SHM_SNAPSHOT
+	if (cache->shm_data != NULL)
+		munmap(cache->shm_data, cache->shm_size);
+#endif
+	cache->shm_data = NULL;
+	cache->shm_size = 0;
+	cache->shm_name[0] = '\0';
+}
+
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->file_cache == NULL)
+		return;
+	cache_unload(p15card->file_cache);
+	shm_unload(p15card->file_cache);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
+}
+
+/* Looks up 'key' in the container of the token */
+static int cache_get(struct sc_pkcs15_card *p15card, const char *key,
+		const u8 **data, size_t *datalen)
+{
+	struct sc_pkcs15_file_cache *cache;
+	const u8 *entry, *content;
+	size_t length;
+	int rv;
+
+	rv = cache_load(p15card, &cache);
+	if (rv != SC_SUCCESS)
+		return rv;
+
+	entry = cache_find(cache->data, key);
+	if (entry == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	content = cache->data + cache_get4(entry + 1 + entry[0]);
+	length = cache_get4(entry + 1 + entry[0] + 4);
+	if (cache_hash(content, length) != cache_get4(entry + 1 + entry[0] + 8)) {
+		sc_log(p15card->card->ctx, "cached file %s in %s is corrupted", key, cache->filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	sc_log(p15card->card->ctx, "read cached file %s from %s", key, cache->filename);
+
+	*data = content;
+	*datalen = length;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_get_cached_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				const u8 **data, size_t *datalen)
+{
+	char key[SC_PKCS15_CACHE_KEY_MAX + 1];
+	const u8 *content;
+	size_t length;
+	int rv;
 
 	if (path->len < 2)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -109,98 +358,385 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	rv = generate_cache_key(path, key, sizeof(key));
+	if (rv != SC_SUCCESS)
+		return rv;
+	rv = cache_get(p15card, key, &content, &length);
 	if (rv != SC_SUCCESS)
 		return rv;
-	sc_log(p15card->card->ctx, "read cached file %s", fname);
 
-	f = fopen(fname, "rb");
-	if (!f)
-		return SC_ERROR_FILE_NOT_FOUND;
-	if (fstat(fileno(f), &stbuf))   {
-		fclose(f);
-		return  SC_ERROR_FILE_NOT_FOUND;
+	if (path->count >= 0) {
+		if (path->index + (size_t) path->count > length)
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+		content += path->index;
+		length = path->count;
+	}
+
+	*data = content;
+	*datalen = length;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				u8 **buf, size_t *bufsize)
+{
+	const u8 *data;
+	size_t count;
+	int rv;
+
+	rv = sc_pkcs15_get_cached_file(p15card, path, &data, &count);
+	if (rv != SC_SUCCESS)
+		return rv;
+
+	if (*buf == NULL) {
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
 	}
+	else if (count > *bufsize)  {
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(*buf, data, count);
+	*bufsize = count;
+
+	return SC_SUCCESS;
+}
+
+/* Writes the container to a temporary file and renames it into place */
+static int cache_write(struct sc_pkcs15_card *p15card, const char *fname,
+		const u8 *data, size_t size)
+{
+	char tmpname[PATH_MAX];
+	FILE *f = NULL;
+	size_t c;
+#ifndef _WIN32
+	int fd;
+#endif
 
-	if (path->count < 0) {
-		count = stbuf.st_size;
+	if (strlen(fname) + 8 > sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+#ifdef _WIN32
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	f = fopen(tmpname, "wb");
+	/* If the open failed because the cache directory does
+	 * not exist, create it and a re-try the fopen() call.
+	 */
+	if (f == NULL && errno == ENOENT) {
+		int r = sc_make_cache_dir(p15card->card->ctx);
+		if (r < 0)
+			return r;
+		f = fopen(tmpname, "wb");
+	}
+#else
+	snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT) {
+		int r = sc_make_cache_dir(p15card->card->ctx);
+		if (r < 0)
+			return r;
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+		fd = mkstemp(tmpname);
 	}
-	else {
-		count = path->count;
-		if (path->index + count > (size_t)stbuf.st_size)   {
-			rv = SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
-			goto err;
+	if (fd >= 0) {
+		f = fdopen(fd, "wb");
+		if (f == NULL) {
+			close(fd);
+			unlink(tmpname);
 		}
+	}
+#endif
+	if (f == NULL)
+		return 0;
 
-		if (0 != fseek(f, (long)path->index, SEEK_SET)) {
-			rv = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
-		}
+	c = fwrite(data, 1, size, f);
+	if (fclose(f) != 0 || c != size) {
+		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
 	}
+#ifdef _WIN32
+	if (!MoveFileExA(tmpname, fname, MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (rename(tmpname, fname) != 0) {
+#endif
+		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "cannot rename %s", tmpname);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	return 0;
+}
 
-	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)   {
-			rv = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
-		}
+/* Stores 'key' in the container of the token */
+static int cache_put(struct sc_pkcs15_card *p15card, const char *key,
+		const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_file_cache *cache = NULL;
+	char fname[PATH_MAX];
+	const u8 *old = NULL;
+	u8 *data, *p, *content;
+	size_t keylen = strlen(key), pos, size, index_size, content_size;
+	unsigned long i, count = 0, n;
+	int r;
+
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != 0)
+		return r;
+
+	/* Start from the latest container, other processes may have added to it */
+	if (p15card->file_cache != NULL)
+		cache_unload(p15card->file_cache);
+	if (cache_load(p15card, &cache) == SC_SUCCESS) {
+		old = cache->data;
+		count = cache_get4(old + SC_PKCS15_CACHE_MAGIC_LEN);
 	}
-	else if (count > *bufsize)  {
-		rv =  SC_ERROR_BUFFER_TOO_SMALL;
-		goto err;
+
+	/* Size the new container: all old entries except 'key', plus 'key' */
+	index_size = 1 + keylen + 12;
+	content_size = bufsize;
+	for (i = 0, pos = SC_PKCS15_CACHE_HEADER_LEN; i < count; i++) {
+		size_t len = old[pos];
+
+		if (len != keylen || memcmp(old + pos + 1, key, keylen) != 0) {
+			index_size += 1 + len + 12;
+			content_size += cache_get4(old + pos + 1 + len + 4);
+		}
+		pos += 1 + len + 12;
 	}
+	size = SC_PKCS15_CACHE_HEADER_LEN + index_size + content_size;
+	data = malloc(size);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	memcpy(data, SC_PKCS15_CACHE_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN);
+	p = data + SC_PKCS15_CACHE_HEADER_LEN;
+	content = p + index_size;
+	n = 0;
 
-	if (data)
-		*buf = data;
+	for (i = 0, pos = SC_PKCS15_CACHE_HEADER_LEN; i < count; i++) {
+		size_t len = old[pos];
 
-	if (count != fread(*buf, 1, count, f)) {
-		rv = SC_ERROR_BUFFER_TOO_SMALL;
-		goto err;
+		if (len != keylen || memcmp(old + pos + 1, key, keylen) != 0) {
+			size_t length = cache_get4(old + pos + 1 + len + 4);
+
+			memcpy(p, old + pos, 1 + len);
+			cache_put4(p + 1 + len, (unsigned long) (content - data));
+			memcpy(p + 1 + len + 4, old + pos + 1 + len + 4, 8);
+			memcpy(content, old + cache_get4(old + pos + 1 + len), length);
+			p += 1 + len + 12;
+			content += length;
+			n++;
+		}
+		pos += 1 + len + 12;
 	}
-	*bufsize = count;
 
-	rv = SC_SUCCESS;
+	p[0] = (u8) keylen;
+	memcpy(p + 1, key, keylen);
+	cache_put4(p + 1 + keylen, (unsigned long) (content - data));
+	cache_put4(p + 1 + keylen + 4, (unsigned long) bufsize);
+	cache_put4(p + 1 + keylen + 8, cache_hash(buf, bufsize));
+	memcpy(content, buf, bufsize);
+	cache_put4(data + SC_PKCS15_CACHE_MAGIC_LEN, n + 1);
 
-err:
-	if (rv != SC_SUCCESS)
-		if (data)
-			free(data);
+	/* the old mapping is not needed any more, the next read maps the new container */
+	if (cache != NULL)
+		cache_unload(cache);
 
-	fclose(f);
-	return rv;
+	r = cache_write(p15card, fname, data, size);
+	free(data);
+	return r;
 }
 
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
+	char key[SC_PKCS15_CACHE_KEY_MAX + 1];
 	int r;
-	FILE *f;
-	size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	r = generate_cache_key(path, key, sizeof(key));
 	if (r != 0)
 		return r;
+	return cache_put(p15card, key, buf, bufsize);
+}
 
-	f = fopen(fname, "wb");
-	/* If the open failed because the cache directory does
-	 * not exist, create it and a re-try the fopen() call.
-	 */
-	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
-			return r;
-		f = fopen(fname, "wb");
+/* The bind snapshot is stored under a key that is no valid path key */
+#define SC_PKCS15_CACHE_SNAPSHOT_KEY	"SNAPSHOT"
+
+#ifdef SC_PKCS15_SHM_SNAPSHOT
+/*
+ * With 'use_shm_snapshot' the bind snapshot is published in a POSIX shared
+ * memory segment, so that processes started later skip the bind without
+ * touching the disk. The segment is named after the user and the serial
+ * number of the token, so a new snapshot replaces the one of an older
+ * last update instead of leaving it behind, and holds:
+ *
+ *	magic		8 bytes, SC_PKCS15_SHM_MAGIC
+ *	length		4 bytes
+ *	hash		4 bytes, FNV-1a of the snapshot
+ *	last update	32 bytes, the last update time, padded with zeros
+ *	snapshot
+ *
+ * A segment that is being written fails the hash check and is ignored.
+ */
+#define SC_PKCS15_SHM_MAGIC		"OSCSHM02"
+#define SC_PKCS15_SHM_UPDATE_LEN	32
+#define SC_PKCS15_SHM_HEADER_LEN	(SC_PKCS15_CACHE_MAGIC_LEN + 8 + SC_PKCS15_SHM_UPDATE_LEN)
+
+static int generate_shm_name(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize,
+		char *update)
+{
+	char *last_update, *p;
+	int r;
+
+	if (p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	if (!last_update)
+		last_update = "NODATE";
+	if (strlen(last_update) >= SC_PKCS15_SHM_UPDATE_LEN)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	memset(update, 0, SC_PKCS15_SHM_UPDATE_LEN);
+	strcpy(update, last_update);
+
+	r = snprintf(buf, bufsize, "/opensc-%lu-%s", (unsigned long) getuid(),
+			p15card->tokeninfo->serial_number);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	/* only one leading slash is allowed in the name */
+	for (p = buf + 1; *p; p++)
+		if (!isalnum((unsigned char) *p) && *p != '-')
+			*p = '_';
+	return SC_SUCCESS;
+}
+
+static int shm_get(struct sc_pkcs15_card *p15card, const u8 **data, size_t *datalen)
+{
+	struct sc_pkcs15_file_cache *cache = p15card->file_cache;
+	char name[sizeof(cache->shm_name)];
+	char update[SC_PKCS15_SHM_UPDATE_LEN];
+	struct stat stbuf;
+	void *map;
+	size_t length;
+	int fd, r;
+
+	r = generate_shm_name(p15card, name, sizeof(name), update);
+	if (r != SC_SUCCESS)
+		return r;
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct sc_pkcs15_file_cache));
+		if (cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_cache = cache;
+	}
+	/* a mapping of a replaced segment still shows the old snapshot */
+	if (cache->shm_data != NULL && (strcmp(cache->shm_name, name) != 0
+			|| memcmp(cache->shm_data + SC_PKCS15_SHM_HEADER_LEN - SC_PKCS15_SHM_UPDATE_LEN,
+				update, SC_PKCS15_SHM_UPDATE_LEN) != 0))
+		shm_unload(cache);
+	if (cache->shm_data == NULL) {
+		fd = shm_open(name, O_RDONLY, 0);
+		if (fd < 0)
+			return SC_ERROR_FILE_NOT_FOUND;
+		/* do not trust segments other users could have written */
+		if (fstat(fd, &stbuf) != 0 || stbuf.st_uid != getuid()
+				|| (stbuf.st_mode & (S_IWGRP | S_IWOTH))
+				|| stbuf.st_size < SC_PKCS15_SHM_HEADER_LEN) {
+			close(fd);
+			return SC_ERROR_FILE_NOT_FOUND;
+		}
+		map = mmap(NULL, (size_t) stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return SC_ERROR_FILE_NOT_FOUND;
+		cache->shm_data = map;
+		cache->shm_size = (size_t) stbuf.st_size;
+		strcpy(cache->shm_name, name);
 	}
-	if (f == NULL)
-		return 0;
 
-	c = fwrite(buf, 1, bufsize, f);
-	fclose(f);
-	if (c != bufsize) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
-		unlink(fname);
+	length = cache_get4(cache->shm_data + SC_PKCS15_CACHE_MAGIC_LEN);
+	if (memcmp(cache->shm_data, SC_PKCS15_SHM_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN) != 0
+			|| memcmp(cache->shm_data + SC_PKCS15_SHM_HEADER_LEN - SC_PKCS15_SHM_UPDATE_LEN,
+				update, SC_PKCS15_SHM_UPDATE_LEN) != 0
+			|| length > cache->shm_size - SC_PKCS15_SHM_HEADER_LEN
+			|| cache_hash(cache->shm_data + SC_PKCS15_SHM_HEADER_LEN, length)
+				!= cache_get4(cache->shm_data + SC_PKCS15_CACHE_MAGIC_LEN + 4)) {
+		sc_log(p15card->card->ctx, "shared snapshot %s is outdated or not complete", name);
+		shm_unload(cache);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	sc_log(p15card->card->ctx, "using shared snapshot %s", name);
+
+	*data = cache->shm_data + SC_PKCS15_SHM_HEADER_LEN;
+	*datalen = length;
+	return SC_SUCCESS;
+}
+
+static int shm_put(struct sc_pkcs15_card *p15card, const u8 *data, size_t datalen)
+{
+	char name[256];
+	char update[SC_PKCS15_SHM_UPDATE_LEN];
+	u8 *map;
+	size_t size = SC_PKCS15_SHM_HEADER_LEN + datalen;
+	int fd, r;
+
+	r = generate_shm_name(p15card, name, sizeof(name), update);
+	if (r != SC_SUCCESS)
+		return r;
+	if (p15card->file_cache != NULL)
+		shm_unload(p15card->file_cache);
+
+	/* Replace the segment of an older snapshot. Processes using it keep
+	 * their mapping until they see the new last update. */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		/* another process has just published it */
+		sc_log(p15card->card->ctx, "cannot create shared snapshot %s", name);
+		return SC_SUCCESS;
+	}
+	if (ftruncate(fd, (off_t) size) != 0) {
+		close(fd);
+		shm_unlink(name);
 		return SC_ERROR_INTERNAL;
 	}
-	return 0;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return SC_ERROR_INTERNAL;
+	}
+
+	memcpy(map + SC_PKCS15_SHM_HEADER_LEN, data, datalen);
+	cache_put4(map + SC_PKCS15_CACHE_MAGIC_LEN, (unsigned long) datalen);
+	cache_put4(map + SC_PKCS15_CACHE_MAGIC_LEN + 4, cache_hash(data, datalen));
+	memcpy(map + SC_PKCS15_CACHE_MAGIC_LEN + 8, update, SC_PKCS15_SHM_UPDATE_LEN);
+	memcpy(map, SC_PKCS15_SHM_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN);
+	munmap(map, size);
+
+	sc_log(p15card->card->ctx, "published shared snapshot %s", name);
+	return SC_SUCCESS;
+}
+#endif
+
+int sc_pkcs15_get_cached_snapshot(struct sc_pkcs15_card *p15card,
+				  const u8 **data, size_t *datalen)
+{
+#ifdef SC_PKCS15_SHM_SNAPSHOT
+	if (p15card->opts.use_shm_snapshot)
+		return shm_get(p15card, data, datalen);
+#endif
+	return cache_get(p15card, SC_PKCS15_CACHE_SNAPSHOT_KEY, data, datalen);
+}
+
+int sc_pkcs15_cache_snapshot(struct sc_pkcs15_card *p15card,
+			     const u8 *data, size_t datalen)
+{
+#ifdef SC_PKCS15_SHM_SNAPSHOT
+	if (p15card->opts.use_shm_snapshot)
+		return shm_put(p15card, data, datalen);
+#endif
+	return cache_put(p15card, SC_PKCS15_CACHE_SNAPSHOT_KEY, data, datalen);
 }
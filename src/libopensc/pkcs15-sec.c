@@ -33,15 +33,12 @@
 #include "internal.h"
 #include "pkcs15.h"
 
-static int select_key_file(struct sc_pkcs15_card *p15card,
+static int get_key_file_path(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_prkey_info *prkey,
-		sc_security_env_t *senv)
+		sc_security_env_t *senv, sc_path_t *key_path)
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	sc_path_t path, file_id;
-	int r;
-
-	LOG_FUNC_CALLED(ctx);
 
 	memset(&path, 0, sizeof(sc_path_t));
 	memset(&file_id, 0, sizeof(sc_path_t));
@@ -74,12 +71,79 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "invalid private key path");
 	}
 
-	r = sc_select_file(p15card->card, &path, NULL);
+	*key_path = path;
+	return SC_SUCCESS;
+}
+
+static int select_key_file(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	r = sc_select_file(p15card->card, path, NULL);
 	LOG_TEST_RET(ctx, r, "sc_select_file() failed");
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+/* Compares the fields of two environments that are set by format_senv(),
+ * the structures themselves have padding and unused array tails. */
+static int security_env_equal(const sc_security_env_t *a, const sc_security_env_t *b)
+{
+	int i;
+
+	if (a->flags != b->flags || a->operation != b->operation
+			|| a->algorithm != b->algorithm
+			|| a->algorithm_flags != b->algorithm_flags)
+		return 0;
+	if ((a->flags & SC_SEC_ENV_ALG_REF_PRESENT)
+			&& a->algorithm_ref != b->algorithm_ref)
+		return 0;
+	if ((a->flags & SC_SEC_ENV_FILE_REF_PRESENT)
+			&& !sc_compare_path(&a->file_ref, &b->file_ref))
+		return 0;
+	if ((a->flags & SC_SEC_ENV_KEY_REF_PRESENT)
+			&& (a->key_ref_len != b->key_ref_len
+				|| a->key_ref_len > sizeof(a->key_ref)
+				|| memcmp(a->key_ref, b->key_ref, a->key_ref_len)))
+		return 0;
+
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++) {
+		const struct sc_supported_algo_info *x = &a->supported_algos[i];
+		const struct sc_supported_algo_info *y = &b->supported_algos[i];
+
+		if (x->reference != y->reference)
+			return 0;
+		if (x->reference == 0)
+			break;
+		if (x->mechanism != y->mechanism || x->operations != y->operations
+				|| x->algo_ref != y->algo_ref
+				|| !sc_compare_oid(&x->algo_id, &y->algo_id))
+			return 0;
+	}
+	return 1;
+}
+
+/* With 'reuse_security_env' the SELECT of the key file and the MSE are
+ * skipped while the card still has the environment of the previous
+ * operation. The memo in the card is cleared by everything that may
+ * change it, including the release of the reader lock, so with PC/SC
+ * it only survives from one operation to the next with 'lock_login'. */
+static int security_env_in_effect(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path, const sc_security_env_t *senv)
+{
+	const struct sc_security_env_memo *memo = &p15card->card->se_memo;
+
+	return p15card->opts.reuse_security_env && memo->valid
+		&& sc_compare_path(&memo->path, path)
+		&& memo->path.aid.len == path->aid.len
+		&& !memcmp(memo->path.aid.value, path->aid.value, path->aid.len)
+		&& security_env_equal(&memo->env, senv);
+}
+
 static int use_key(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		sc_security_env_t *senv,
@@ -91,23 +155,43 @@ static int use_key(struct sc_pkcs15_card *p15card,
 	int r = SC_SUCCESS;
 	int revalidated_cached_pin = 0;
 	const struct sc_pkcs15_prkey_info *prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
+	struct sc_security_env_memo *memo = &p15card->card->se_memo;
+	sc_path_t path;
+
+	memset(&path, 0, sizeof(path));
+	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
+		r = get_key_file_path(p15card, prkey, senv, &path);
+		LOG_TEST_RET(p15card->card->ctx, r, "Invalid private key path");
+	}
 
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(p15card->card->ctx, r, "sc_lock() failed");
 
 	do {
-		if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-			r = select_key_file(p15card, prkey, senv);
-			if (r < 0) {
-				sc_log(p15card->card->ctx,
-						"Unable to select private key file");
+		if (security_env_in_effect(p15card, &path, senv)) {
+			sc_log(p15card->card->ctx, "security environment still set");
+			p15card->card->stats.se_reused++;
+		} else {
+			if (path.len != 0 || path.aid.len != 0) {
+				r = select_key_file(p15card, &path);
+				if (r < 0) {
+					sc_log(p15card->card->ctx,
+							"Unable to select private key file");
+				}
+			}
+			if (r == SC_SUCCESS)
+				r = sc_set_security_env(p15card->card, senv, 0);
+			if (r == SC_SUCCESS && p15card->opts.reuse_security_env) {
+				memo->path = path;
+				memo->env = *senv;
+				memo->valid = 1;
 			}
 		}
-		if (r == SC_SUCCESS)
-			r = sc_set_security_env(p15card->card, senv, 0);
 
 		if (r == SC_SUCCESS)
 			r = card_command(p15card->card, in, inlen, out, outlen);
+		if (r < 0)
+			memo->valid = 0;
 
 		if (revalidated_cached_pin)
 			/* only re-validate once */
@@ -114,6 +114,11 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *);
+typedef int (* sc_pkcs15_df_entry_decoder)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 **nbuf, size_t *nbufsize);
+static sc_pkcs15_df_entry_decoder sc_pkcs15_get_df_decoder(unsigned int);
+static int sc_pkcs15_parse_df_content(struct sc_pkcs15_card *, struct sc_pkcs15_df *,
+		const unsigned char *, size_t);
 static int sc_pkcs15_aux_get_md_guid(struct sc_pkcs15_card *, const struct sc_pkcs15_object *,
 		unsigned, unsigned char *, size_t *);
 
@@ -729,30 +734,39 @@ sc_pkcs15_card_new(void)
 }
 
 
+static void
+sc_pkcs15_clear_tokeninfo(struct sc_pkcs15_tokeninfo *tokeninfo)
+{
+	if (tokeninfo->label != NULL)
+		free(tokeninfo->label);
+	if (tokeninfo->serial_number != NULL)
+		free(tokeninfo->serial_number);
+	if (tokeninfo->manufacturer_id != NULL)
+		free(tokeninfo->manufacturer_id);
+	if (tokeninfo->last_update.gtime != NULL)
+		free(tokeninfo->last_update.gtime);
+	if (tokeninfo->preferred_language != NULL)
+		free(tokeninfo->preferred_language);
+	if (tokeninfo->profile_indication.name != NULL)
+		free(tokeninfo->profile_indication.name);
+	if (tokeninfo->seInfo != NULL) {
+		unsigned i;
+		for (i = 0; i < tokeninfo->num_seInfo; i++)
+			free(tokeninfo->seInfo[i]);
+		free(tokeninfo->seInfo);
+	}
+	memset(tokeninfo, 0, sizeof(*tokeninfo));
+	sc_init_oid(&tokeninfo->profile_indication.oid);
+}
+
+
 void
 sc_pkcs15_free_tokeninfo(struct sc_pkcs15_card *p15card)
 {
 	if (!p15card || !p15card->tokeninfo)
 		return;
 
-	if (p15card->tokeninfo->label != NULL)
-		free(p15card->tokeninfo->label);
-	if (p15card->tokeninfo->serial_number != NULL)
-		free(p15card->tokeninfo->serial_number);
-	if (p15card->tokeninfo->manufacturer_id != NULL)
-		free(p15card->tokeninfo->manufacturer_id);
-	if (p15card->tokeninfo->last_update.gtime != NULL)
-		free(p15card->tokeninfo->last_update.gtime);
-	if (p15card->tokeninfo->preferred_language != NULL)
-		free(p15card->tokeninfo->preferred_language);
-	if (p15card->tokeninfo->profile_indication.name != NULL)
-		free(p15card->tokeninfo->profile_indication.name);
-	if (p15card->tokeninfo->seInfo != NULL) {
-		unsigned i;
-		for (i = 0; i < p15card->tokeninfo->num_seInfo; i++)
-			free(p15card->tokeninfo->seInfo[i]);
-		free(p15card->tokeninfo->seInfo);
-	}
+	sc_pkcs15_clear_tokeninfo(p15card->tokeninfo);
 	free(p15card->tokeninfo);
 
 	p15card->tokeninfo = NULL;
@@ -803,6 +817,8 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->file_unusedspace != NULL)
 		sc_file_free(p15card->file_unusedspace);
 
+	sc_pkcs15_cache_release(p15card);
+
 	p15card->magic = 0;
 	sc_pkcs15_free_tokeninfo(p15card);
 	sc_pkcs15_free_app(p15card);
@@ -975,6 +991,314 @@ sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 }
 
 
+/* Use the card serial number if TokenInfo has none */
+static void
+sc_pkcs15_serial_from_card(struct sc_pkcs15_card *p15card)
+{
+	struct sc_card *card = p15card->card;
+
+	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
+		char *serial = calloc(1, card->serialnr.len*2 + 1);
+		size_t ii;
+
+		if (serial == NULL)
+			return;
+		for(ii=0;ii<card->serialnr.len;ii++)
+			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
+
+		p15card->tokeninfo->serial_number = serial;
+		sc_log(card->ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+	}
+}
+
+
+/*
+ * Bind snapshot, enabled with 'use_bind_snapshot'. After a full bind the
+ * content of TokenInfo, ODF and all DFs is stored in the file cache of the
+ * token. A later bind reads only EF(TokenInfo) from the card; if it is
+ * unchanged, ODF and DFs are decoded from the snapshot.
+ *
+ * The snapshot is a sequence of items:
+ *	tag		1 byte, SC_PKCS15_SNAPSHOT_*
+ *	length		4 bytes, big endian
+ *	value		TokenInfo: content
+ *			ODF, DF: path, file size (4 bytes), content
+ * A path is encoded as type, length, value, AID length, AID, index and
+ * count (4 bytes each).
+ */
+#define SC_PKCS15_SNAPSHOT_TOKENINFO	0x01
+#define SC_PKCS15_SNAPSHOT_ODF		0x02
+#define SC_PKCS15_SNAPSHOT_DF		0x03
+
+static void
+snapshot_put4(unsigned char *p, size_t val)
+{
+	p[0] = (unsigned char) (val >> 24);
+	p[1] = (unsigned char) (val >> 16);
+	p[2] = (unsigned char) (val >> 8);
+	p[3] = (unsigned char) val;
+}
+
+static size_t
+snapshot_get4(const unsigned char *p)
+{
+	return ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+}
+
+static int
+snapshot_add(unsigned char **snap, size_t *snaplen, int tag, const struct sc_path *path,
+		size_t size, const unsigned char *data, size_t datalen)
+{
+	unsigned char *p;
+	size_t len = datalen;
+
+	if (path)
+		len += 2 + path->len + 1 + path->aid.len + 8 + 4;
+	p = realloc(*snap, *snaplen + 5 + len);
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*snap = p;
+	p += *snaplen;
+	*snaplen += 5 + len;
+
+	*p++ = (unsigned char) tag;
+	snapshot_put4(p, len);
+	p += 4;
+	if (path) {
+		*p++ = (unsigned char) path->type;
+		*p++ = (unsigned char) path->len;
+		memcpy(p, path->value, path->len);
+		p += path->len;
+		*p++ = (unsigned char) path->aid.len;
+		memcpy(p, path->aid.value, path->aid.len);
+		p += path->aid.len;
+		snapshot_put4(p, (size_t) path->index);
+		snapshot_put4(p + 4, (size_t) (unsigned int) path->count);
+		snapshot_put4(p + 8, size);
+		p += 12;
+	}
+	memcpy(p, data, datalen);
+	return SC_SUCCESS;
+}
+
+/* Decodes path and file size at the start of an item value */
+static int
+snapshot_get_path(const unsigned char **p, size_t *left, struct sc_path *path, size_t *size)
+{
+	const unsigned char *in = *p;
+
+	memset(path, 0, sizeof(*path));
+	if (*left < 2 || in[1] > SC_MAX_PATH_SIZE || *left < 3 + (size_t) in[1])
+		return SC_ERROR_INVALID_DATA;
+	path->type = in[0];
+	path->len = in[1];
+	memcpy(path->value, in + 2, path->len);
+	in += 2 + path->len;
+	if (in[0] > SC_MAX_AID_SIZE || *left < 2 + path->len + 1 + (size_t) in[0] + 12)
+		return SC_ERROR_INVALID_DATA;
+	path->aid.len = in[0];
+	memcpy(path->aid.value, in + 1, path->aid.len);
+	in += 1 + path->aid.len;
+	path->index = (int) snapshot_get4(in);
+	path->count = (int) (unsigned int) snapshot_get4(in + 4);
+	*size = snapshot_get4(in + 8);
+	in += 12;
+
+	*left -= in - *p;
+	*p = in;
+	return SC_SUCCESS;
+}
+
+static int
+snapshot_same_path(const struct sc_path *p1, const struct sc_path *p2)
+{
+	return sc_compare_path(p1, p2) && p1->index == p2->index && p1->count == p2->count
+		&& p1->aid.len == p2->aid.len && !memcmp(p1->aid.value, p2->aid.value, p1->aid.len);
+}
+
+/* Restores ODF and DFs if the snapshot was taken with the same TokenInfo */
+static int
+sc_pkcs15_restore_snapshot(struct sc_pkcs15_card *p15card,
+		const unsigned char *tokeninfo, size_t tokeninfo_len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	const unsigned char *snap, *p;
+	size_t snaplen, left, len, size;
+	struct sc_path path;
+	struct sc_pkcs15_df *df;
+	int r, tag, pass, match = 0;
+
+	r = sc_pkcs15_get_cached_snapshot(p15card, &snap, &snaplen);
+	if (r != SC_SUCCESS)
+		return r;
+
+	/* the first pass validates and restores the ODF, the second the DFs */
+	for (pass = 0; pass < 2; pass++) {
+		for (p = snap, left = snaplen; left > 0; p += len, left -= len) {
+			if (left < 5 || left - 5 < snapshot_get4(p + 1)) {
+				r = SC_ERROR_INVALID_DATA;
+				goto err;
+			}
+			tag = p[0];
+			len = snapshot_get4(p + 1);
+			p += 5;
+			left -= 5;
+
+			if (pass == 0 && tag == SC_PKCS15_SNAPSHOT_TOKENINFO) {
+				match = len == tokeninfo_len && !memcmp(p, tokeninfo, len);
+				if (!match) {
+					sc_log(ctx, "EF(TokenInfo) changed since the bind snapshot was taken");
+					return SC_ERROR_FILE_NOT_FOUND;
+				}
+			}
+			else if (tag == SC_PKCS15_SNAPSHOT_ODF || tag == SC_PKCS15_SNAPSHOT_DF) {
+				const unsigned char *content = p;
+				size_t content_len = len;
+
+				r = snapshot_get_path(&content, &content_len, &path, &size);
+				if (r != SC_SUCCESS)
+					goto err;
+
+				if (pass == 0 && tag == SC_PKCS15_SNAPSHOT_ODF) {
+					if (!match || p15card->file_odf != NULL) {
+						r = SC_ERROR_INVALID_DATA;
+						goto err;
+					}
+					p15card->file_odf = sc_file_new();
+					if (p15card->file_odf == NULL) {
+						r = SC_ERROR_OUT_OF_MEMORY;
+						goto err;
+					}
+					p15card->file_odf->path = path;
+					p15card->file_odf->size = size;
+					r = parse_odf(content, content_len, p15card);
+					if (r != SC_SUCCESS)
+						goto err;
+				}
+				else if (pass == 1 && tag == SC_PKCS15_SNAPSHOT_DF) {
+					for (df = p15card->df_list; df; df = df->next)
+						if (!df->enumerated && snapshot_same_path(&df->path, &path))
+							break;
+					if (df == NULL) {
+						r = SC_ERROR_INVALID_DATA;
+						goto err;
+					}
+					r = sc_pkcs15_parse_df_content(p15card, df, content, content_len);
+					if (r != SC_SUCCESS)
+						goto err;
+				}
+			}
+		}
+		if (p15card->file_odf == NULL) {
+			r = SC_ERROR_INVALID_DATA;
+			goto err;
+		}
+	}
+
+	sc_log(ctx, "ODF and DFs restored from the bind snapshot");
+	return SC_SUCCESS;
+err:
+	sc_log(ctx, "cannot use the bind snapshot: %s", sc_strerror(r));
+	sc_pkcs15_remove_objects(p15card);
+	sc_pkcs15_remove_dfs(p15card);
+	if (p15card->file_odf != NULL) {
+		sc_file_free(p15card->file_odf);
+		p15card->file_odf = NULL;
+	}
+	return r;
+}
+
+/* Decodes all DFs and stores them with TokenInfo and ODF as bind snapshot */
+static int
+sc_pkcs15_save_snapshot(struct sc_pkcs15_card *p15card,
+		const unsigned char *tokeninfo, size_t tokeninfo_len,
+		const unsigned char *odf, size_t odf_len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	unsigned char *snap = NULL, *buf;
+	size_t snaplen = 0, len;
+	int r;
+
+	r = snapshot_add(&snap, &snaplen, SC_PKCS15_SNAPSHOT_TOKENINFO, NULL, 0,
+			tokeninfo, tokeninfo_len);
+	if (r == SC_SUCCESS)
+		r = snapshot_add(&snap, &snaplen, SC_PKCS15_SNAPSHOT_ODF, &p15card->file_odf->path,
+				p15card->file_odf->size, odf, odf_len);
+
+	for (df = p15card->df_list; r == SC_SUCCESS && df; df = df->next) {
+		if (df->enumerated || sc_pkcs15_get_df_decoder(df->type) == NULL)
+			continue;
+		r = sc_pkcs15_read_file(p15card, &df->path, &buf, &len);
+		if (r != SC_SUCCESS)
+			break;
+		r = sc_pkcs15_parse_df_content(p15card, df, buf, len);
+		if (r == SC_SUCCESS)
+			r = snapshot_add(&snap, &snaplen, SC_PKCS15_SNAPSHOT_DF, &df->path, 0, buf, len);
+		free(buf);
+	}
+
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_cache_snapshot(p15card, snap, snaplen);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "cannot store the bind snapshot: %s", sc_strerror(r));
+	free(snap);
+	return r;
+}
+
+/* Reads EF(TokenInfo) and binds from the snapshot taken with it */
+static int
+sc_pkcs15_bind_snapshot(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_path path;
+	unsigned char *buf = NULL;
+	size_t len;
+	int r;
+
+	sc_format_path("5032", &path);
+	r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &path);
+	if (r == SC_SUCCESS)
+		r = sc_select_file(p15card->card, &path, &p15card->file_tokeninfo);
+	if (r != SC_SUCCESS)
+		goto out;
+
+	len = p15card->file_tokeninfo->size;
+	if (!len) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	buf = malloc(len);
+	if (buf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	r = sc_read_binary(p15card->card, 0, buf, len, 0);
+	if (r <= 2) {
+		r = r < 0 ? r : SC_ERROR_PKCS15_APP_NOT_FOUND;
+		goto out;
+	}
+	len = r;
+
+	r = sc_pkcs15_parse_tokeninfo(ctx, p15card->tokeninfo, buf, len);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_pkcs15_serial_from_card(p15card);
+
+	r = sc_pkcs15_restore_snapshot(p15card, buf, len);
+out:
+	if (r != SC_SUCCESS) {
+		sc_pkcs15_clear_tokeninfo(p15card->tokeninfo);
+		if (p15card->file_tokeninfo != NULL) {
+			sc_file_free(p15card->file_tokeninfo);
+			p15card->file_tokeninfo = NULL;
+		}
+	}
+	free(buf);
+	return r;
+}
+
+
 int
 sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 {
@@ -984,8 +1308,8 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	struct sc_pkcs15_tokeninfo tokeninfo;
 	struct sc_pkcs15_df *df;
 	const struct sc_app_info *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
+	unsigned char *buf = NULL, *odf_buf = NULL;
+	size_t len, odf_len = 0, tokeninfo_len;
 	int    err, ok = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -1042,6 +1366,13 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		goto end;
 	}
 
+	if (p15card->opts.use_bind_snapshot && p15card->file_odf == NULL
+			&& p15card->file_tokeninfo == NULL
+			&& sc_pkcs15_bind_snapshot(p15card) == SC_SUCCESS) {
+		ok = 1;
+		goto end;
+	}
+
 	if (p15card->file_odf == NULL) {
 		/* check if an ODF is present; we don't know yet whether we have a pkcs15 card */
 		sc_format_path("5031", &tmppath);
@@ -1091,7 +1422,9 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		sc_log(ctx, "Unable to parse ODF");
 		goto end;
 	}
-	free(buf);
+	/* kept for the bind snapshot */
+	odf_buf = buf;
+	odf_len = len;
 	buf = NULL;
 
 	sc_log(ctx, "The following DFs were found:");
@@ -1140,8 +1473,9 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		goto end;
 	}
 
+	tokeninfo_len = err;
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, tokeninfo_len);
 	if (err != SC_SUCCESS)   {
 		sc_log(ctx, "cannot parse TokenInfo content: %s", sc_strerror(err));
 		goto end;
@@ -1149,21 +1483,17 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 
 	*(p15card->tokeninfo) = tokeninfo;
 
-	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
-		char *serial = calloc(1, card->serialnr.len*2 + 1);
-		size_t ii;
-
-		for(ii=0;ii<card->serialnr.len;ii++)
-			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
-
-		p15card->tokeninfo->serial_number = serial;
-		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
-	}
+	sc_pkcs15_serial_from_card(p15card);
 
 	ok = 1;
+
+	if (p15card->opts.use_bind_snapshot)
+		sc_pkcs15_save_snapshot(p15card, buf, tokeninfo_len, odf_buf, odf_len);
 end:
 	if(buf != NULL)
 		free(buf);
+	if (odf_buf != NULL)
+		free(odf_buf);
 	if (!ok) {
 		sc_pkcs15_card_clear(p15card);
 		if (err == SC_ERROR_FILE_NOT_FOUND)
@@ -1194,6 +1524,9 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.use_bind_snapshot = 0;
+	p15card->opts.use_shm_snapshot = 0;
+	p15card->opts.reuse_security_env = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
@@ -1202,13 +1535,19 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.use_bind_snapshot = scconf_get_bool(conf_block, "use_bind_snapshot", p15card->opts.use_bind_snapshot);
+		p15card->opts.use_shm_snapshot = scconf_get_bool(conf_block, "use_shm_snapshot", p15card->opts.use_shm_snapshot);
+		if (p15card->opts.use_shm_snapshot)
+			p15card->opts.use_bind_snapshot = 1;
+		p15card->opts.reuse_security_env = scconf_get_bool(conf_block, "reuse_security_env", p15card->opts.reuse_security_env);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_bind_snapshot=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
+			p15card->opts.use_file_cache, p15card->opts.use_bind_snapshot,
+			p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
 			p15card->opts.pin_cache_ignore_user_consent);
 
 	r = sc_lock(card);
@@ -2012,52 +2351,69 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 }
 
 
+static sc_pkcs15_df_entry_decoder
+sc_pkcs15_get_df_decoder(unsigned int type)
+{
+	switch (type) {
+	case SC_PKCS15_PRKDF:
+		return sc_pkcs15_decode_prkdf_entry;
+	case SC_PKCS15_PUKDF:
+		return sc_pkcs15_decode_pukdf_entry;
+	case SC_PKCS15_SKDF:
+		return sc_pkcs15_decode_skdf_entry;
+	case SC_PKCS15_CDF:
+	case SC_PKCS15_CDF_TRUSTED:
+	case SC_PKCS15_CDF_USEFUL:
+		return sc_pkcs15_decode_cdf_entry;
+	case SC_PKCS15_DODF:
+		return sc_pkcs15_decode_dodf_entry;
+	case SC_PKCS15_AODF:
+		return sc_pkcs15_decode_aodf_entry;
+	}
+	return NULL;
+}
+
+
 int
 sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	unsigned char *buf;
-	const unsigned char *p;
 	size_t bufsize;
 	int r;
-	struct sc_pkcs15_object *obj = NULL;
-	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
-		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
 	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
 
 	if (df->enumerated)
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
-	switch (df->type) {
-	case SC_PKCS15_PRKDF:
-		func = sc_pkcs15_decode_prkdf_entry;
-		break;
-	case SC_PKCS15_PUKDF:
-		func = sc_pkcs15_decode_pukdf_entry;
-		break;
-	case SC_PKCS15_SKDF:
-		func = sc_pkcs15_decode_skdf_entry;
-		break;
-	case SC_PKCS15_CDF:
-	case SC_PKCS15_CDF_TRUSTED:
-	case SC_PKCS15_CDF_USEFUL:
-		func = sc_pkcs15_decode_cdf_entry;
-		break;
-	case SC_PKCS15_DODF:
-		func = sc_pkcs15_decode_dodf_entry;
-		break;
-	case SC_PKCS15_AODF:
-		func = sc_pkcs15_decode_aodf_entry;
-		break;
-	}
-	if (func == NULL) {
+	if (sc_pkcs15_get_df_decoder(df->type) == NULL) {
 		sc_log(ctx, "unknown DF type: %d", df->type);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
+	r = sc_pkcs15_parse_df_content(p15card, df, buf, bufsize);
+	free(buf);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+/* Decodes the objects of 'df' from its content */
+static int
+sc_pkcs15_parse_df_content(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		const unsigned char *buf, size_t bufsize)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	const unsigned char *p;
+	int r = 0;
+	struct sc_pkcs15_object *obj = NULL;
+	sc_pkcs15_df_entry_decoder func = sc_pkcs15_get_df_decoder(df->type);
+
+	if (func == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
@@ -2092,8 +2448,7 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
-	LOG_FUNC_RETURN(ctx, r);
+	return r;
 }
 
 
@@ -2313,7 +2668,16 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 
 	r = -1; /* file state: not in cache */
 	if (p15card->opts.use_file_cache) {
-		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+		const unsigned char *cached;
+
+		r = sc_pkcs15_get_cached_file(p15card, in_path, &cached, &len);
+		if (!r) {
+			/* the caller owns the returned buffer */
+			data = malloc(len ? len : 1);
+			if (data == NULL)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			memcpy(data, cached, len);
+		}
 
 		if (!r && in_path->aid.len > 0 && in_path->len >= 2)   {
 			struct sc_path parent = *in_path;
@@ -2321,6 +2685,10 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 			parent.len -= 2;
 			parent.type = SC_PATH_TYPE_PATH;
 			r = sc_select_file(p15card->card, &parent, NULL);
+			if (r) {
+				free(data);
+				data = NULL;
+			}
 		}
 	}
 
@@ -2440,7 +2808,7 @@ sc_pkcs15_format_id(const char *str, struct sc_pkcs15_id *id)
 const char *
 sc_pkcs15_print_id(const struct sc_pkcs15_id *id)
 {
-	static char buffer[256];
+	static SC_THREAD_LOCAL char buffer[256];
 
 	sc_bin_to_hex(id->value, id->len, buffer, sizeof(buffer), '\0');
 	return buffer;
@@ -587,6 +587,9 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int use_bind_snapshot;
+		int use_shm_snapshot;
+		int reuse_security_env;
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
@@ -599,6 +602,7 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_file_cache *file_cache;	/* see pkcs15-cache.c */
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -672,7 +676,7 @@ int sc_pkcs15_decode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, const u8 *, size_t);
 int sc_pkcs15_encode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
-int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
+int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
 void sc_pkcs15_erase_pubkey(struct sc_pkcs15_pubkey *);
 void sc_pkcs15_free_pubkey(struct sc_pkcs15_pubkey *);
@@ -870,6 +874,17 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+/* Returns a pointer to the cached content, valid until the next call of a
+ * caching function or sc_pkcs15_card_free() */
+int sc_pkcs15_get_cached_file(struct sc_pkcs15_card *p15card,
+			      const struct sc_path *path,
+			      const u8 **data, size_t *datalen);
+/* Serialized result of sc_pkcs15_bind_internal(), see 'use_bind_snapshot' */
+int sc_pkcs15_get_cached_snapshot(struct sc_pkcs15_card *p15card,
+				  const u8 **data, size_t *datalen);
+int sc_pkcs15_cache_snapshot(struct sc_pkcs15_card *p15card,
+			     const u8 *data, size_t datalen);
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -96,6 +96,9 @@ struct pcsc_global_private_data {
 struct pcsc_private_data {
 	struct pcsc_global_private_data *gpriv;
 	SCARDHANDLE pcsc_card;
+	/* context the card is connected with, see pcsc_card_context() */
+	SCARDCONTEXT pcsc_card_ctx;
+	int has_card_ctx;
 	SCARD_READERSTATE reader_state;
 	DWORD verify_ioctl;
 	DWORD verify_ioctl_start;
@@ -246,7 +249,7 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t ssize, rsize, rbuflen = 0;
+	size_t ssize = 0, rsize, rbuflen;
 	u8 *sbuf = NULL, *rbuf = NULL;
 	int r;
 
@@ -256,15 +259,11 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
-	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	/* encode and log the APDU, the buffers are kept for the next APDU */
+	r = sc_apdu_get_scratch_octets(reader, apdu, reader->active_protocol,
+			&sbuf, &ssize, &rbuf, rbuflen);
 	if (r != SC_SUCCESS)
-		goto out;
+		return r;
 	if (reader->name)
 		sc_log(reader->ctx, "reader '%s'", reader->name);
 	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
@@ -280,14 +279,7 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	sc_apdu_release_scratch_octets(reader, sbuf, ssize + rbuflen);
 
 	return r;
 }
@@ -468,9 +460,29 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 	return pcsc_to_opensc_error(rv);
 }
 
+/* PC/SC serializes all calls made through one context. Every reader gets
+ * a context of its own for its card, so that cards in different readers
+ * can be used from different threads at the same time. */
+static SCARDCONTEXT pcsc_card_context(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	LONG rv;
+
+	if (!priv->has_card_ctx) {
+		rv = priv->gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &priv->pcsc_card_ctx);
+		if (rv != SCARD_S_SUCCESS) {
+			PCSC_TRACE(reader, "SCardEstablishContext failed", rv);
+			return priv->gpriv->pcsc_ctx;
+		}
+		priv->has_card_ctx = 1;
+	}
+	return priv->pcsc_card_ctx;
+}
+
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+	SCARDCONTEXT card_ctx;
 	SCARDHANDLE card_handle;
 	LONG rv;
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
@@ -486,17 +498,28 @@ static int pcsc_connect(sc_reader_t *reader)
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_CARD_NOT_PRESENT);
 
 
-	rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+	card_ctx = pcsc_card_context(reader);
+	rv = priv->gpriv->SCardConnect(card_ctx, reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 #ifdef __APPLE__
 	if (rv == (LONG)SCARD_E_SHARING_VIOLATION) {
 		sleep(1); /* Try again to compete with Tokend probes */
-		rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+		rv = priv->gpriv->SCardConnect(card_ctx, reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 	}
 #endif
+	if ((rv == (LONG)SCARD_E_INVALID_HANDLE || rv == (LONG)SCARD_E_NO_SERVICE)
+			&& priv->has_card_ctx) {
+		/* the resource manager was restarted, get a new context */
+		priv->gpriv->SCardReleaseContext(priv->pcsc_card_ctx);
+		priv->has_card_ctx = 0;
+		card_ctx = pcsc_card_context(reader);
+		rv = priv->gpriv->SCardConnect(card_ctx, reader->name,
+			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
+			  protocol, &card_handle, &active_proto);
+	}
 	if (rv != SCARD_S_SUCCESS) {
 		PCSC_TRACE(reader, "SCardConnect failed", rv);
 		return pcsc_to_opensc_error(rv);
@@ -603,6 +626,8 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	if (priv->has_card_ctx && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE))
+		priv->gpriv->SCardReleaseContext(priv->pcsc_card_ctx);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -0,0 +1,376 @@
+/*
+ * reader-replay.c: Reader driver answering from recorded APDU traces
+ *
+ * Copyright (C) 2016  OpenSC Project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every trace recorded with the 'apdu_trace' option becomes one reader with
+ * the recorded card inserted. Commands are answered with the response
+ * recorded for the same command bytes. The trace is searched starting after
+ * the last matched record, so a patched build sending fewer APDUs still
+ * follows the recorded conversation. The number of recorded APDUs that were
+ * not needed is logged when the reader is released.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "internal.h"
+
+#define GET_PRIV_DATA(r) ((struct replay_private_data *) (r)->drv_data)
+
+struct replay_record {
+	int type;
+	unsigned long long time;
+	unsigned long duration;
+	const u8 *data1, *data2;
+	size_t len1, len2;
+};
+
+struct replay_trace {
+	u8 *buf;
+	struct replay_record *records;
+	size_t nrecords;
+};
+
+/* Reader specific private data */
+struct replay_private_data {
+	struct replay_trace trace;
+	struct sc_atr atr;
+	unsigned int protocol;
+	int realtime;
+
+	/* index of the record following the last matched one */
+	size_t pos;
+	size_t replayed, missing;
+};
+
+static unsigned long long replay_get(const u8 *p, size_t len)
+{
+	unsigned long long val = 0;
+
+	while (len-- > 0)
+		val = (val << 8) | *p++;
+	return val;
+}
+
+static int replay_parse_trace(const u8 *buf, size_t len, struct replay_trace *trace)
+{
+	struct replay_record *rec;
+	size_t pos = SC_APDU_TRACE_MAGIC_LEN;
+
+	if (len < SC_APDU_TRACE_MAGIC_LEN
+			|| memcmp(buf, SC_APDU_TRACE_MAGIC, SC_APDU_TRACE_MAGIC_LEN) != 0)
+		return SC_ERROR_INVALID_DATA;
+
+	while (pos < len) {
+		if (len - pos < 15)
+			return SC_ERROR_INVALID_DATA;
+
+		rec = realloc(trace->records, (trace->nrecords + 1) * sizeof(struct replay_record));
+		if (rec == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		trace->records = rec;
+		rec = &trace->records[trace->nrecords];
+
+		rec->type = buf[pos];
+		rec->time = replay_get(buf + pos + 1, 8);
+		rec->duration = (unsigned long) replay_get(buf + pos + 9, 4);
+		rec->len1 = (size_t) replay_get(buf + pos + 13, 2);
+		pos += 15;
+		if (len - pos < rec->len1 + 2)
+			return SC_ERROR_INVALID_DATA;
+		rec->data1 = buf + pos;
+		pos += rec->len1;
+		rec->len2 = (size_t) replay_get(buf + pos, 2);
+		pos += 2;
+		if (len - pos < rec->len2)
+			return SC_ERROR_INVALID_DATA;
+		rec->data2 = buf + pos;
+		pos += rec->len2;
+
+		trace->nrecords++;
+	}
+
+	return SC_SUCCESS;
+}
+
+static int replay_load_trace(sc_context_t *ctx, const char *filename,
+		struct replay_trace *trace)
+{
+	FILE *f;
+	long len;
+	int r = SC_ERROR_INTERNAL;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		sc_log(ctx, "Cannot open APDU trace '%s'", filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0
+			|| fseek(f, 0, SEEK_SET) != 0)
+		goto out;
+	trace->buf = malloc(len ? len : 1);
+	if (trace->buf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	if (fread(trace->buf, 1, len, f) != (size_t) len)
+		goto out;
+
+	r = replay_parse_trace(trace->buf, len, trace);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "Invalid APDU trace '%s'", filename);
+out:
+	fclose(f);
+	return r;
+}
+
+static void replay_free_trace(struct replay_trace *trace)
+{
+	free(trace->records);
+	free(trace->buf);
+	trace->records = NULL;
+	trace->buf = NULL;
+	trace->nrecords = 0;
+}
+
+static const struct replay_record *
+replay_find(struct replay_private_data *priv, const u8 *cmd, size_t cmdlen)
+{
+	const struct replay_trace *trace = &priv->trace;
+	size_t i, n;
+
+	/* search forward from the current position, wrapping around once */
+	for (n = 0; n < trace->nrecords; n++) {
+		const struct replay_record *rec;
+
+		i = (priv->pos + n) % trace->nrecords;
+		rec = &trace->records[i];
+		if (rec->type == SC_APDU_TRACE_APDU && rec->len1 == cmdlen
+				&& memcmp(rec->data1, cmd, cmdlen) == 0) {
+			if (i >= priv->pos)
+				priv->missing += i - priv->pos;
+			priv->pos = i + 1;
+			return rec;
+		}
+	}
+	return NULL;
+}
+
+static int replay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct replay_private_data *priv = GET_PRIV_DATA(reader);
+	const struct replay_record *rec;
+	size_t ssize;
+	u8 *sbuf = NULL;
+	int r;
+
+	/* encode and log the APDU */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, priv->protocol);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	/* PINs are not recorded in the trace */
+	sc_apdu_trace_mask(sbuf, ssize);
+	rec = replay_find(priv, sbuf, ssize);
+	if (rec == NULL) {
+		sc_log(reader->ctx, "Command not found in the APDU trace");
+		r = SC_ERROR_TRANSMIT_FAILED;
+		goto out;
+	}
+	priv->replayed++;
+	if (priv->realtime && rec->duration) {
+#ifdef _WIN32
+		Sleep((rec->duration + 999) / 1000);
+#else
+		usleep(rec->duration);
+#endif
+	}
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rec->data2, rec->len2, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, rec->data2, rec->len2);
+out:
+	sc_mem_clear(sbuf, ssize);
+	free(sbuf);
+	return r;
+}
+
+static int replay_detect_card_presence(sc_reader_t *reader)
+{
+	return reader->flags;
+}
+
+static int replay_connect(sc_reader_t *reader)
+{
+	struct replay_private_data *priv = GET_PRIV_DATA(reader);
+
+	memcpy(&reader->atr, &priv->atr, sizeof(reader->atr));
+	reader->active_protocol = priv->protocol;
+	_sc_parse_atr(reader);
+
+	return SC_SUCCESS;
+}
+
+static int replay_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_release(sc_reader_t *reader)
+{
+	struct replay_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv->pos < priv->trace.nrecords)
+		priv->missing += priv->trace.nrecords - priv->pos;
+	sc_log(reader->ctx, "%s: replayed %lu APDUs, %lu recorded records not needed",
+			reader->name, (unsigned long) priv->replayed, (unsigned long) priv->missing);
+
+	replay_free_trace(&priv->trace);
+	free(priv);
+	return SC_SUCCESS;
+}
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_drv = {
+	"APDU trace replay reader",
+	"replay",
+	&replay_ops,
+	NULL
+};
+
+static int replay_add_reader(sc_context_t *ctx, scconf_block *conf_block,
+		const char *filename)
+{
+	struct replay_private_data *priv;
+	sc_reader_t *reader;
+	char namebuf[128];
+	size_t i;
+	int r;
+
+	priv = calloc(1, sizeof(struct replay_private_data));
+	if (priv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = replay_load_trace(ctx, filename, &priv->trace);
+	if (r != SC_SUCCESS)
+		goto err;
+
+	/* the card is the one connected first in the trace */
+	r = SC_ERROR_INVALID_DATA;
+	for (i = 0; i < priv->trace.nrecords; i++) {
+		const struct replay_record *rec = &priv->trace.records[i];
+
+		if (rec->type == SC_APDU_TRACE_ATR && rec->len1 <= SC_MAX_ATR_SIZE) {
+			memcpy(priv->atr.value, rec->data1, rec->len1);
+			priv->atr.len = rec->len1;
+			priv->protocol = rec->len2 == 4 ? (unsigned int) replay_get(rec->data2, 4) : SC_PROTO_T1;
+			r = SC_SUCCESS;
+			break;
+		}
+	}
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "No ATR in APDU trace '%s'", filename);
+		goto err;
+	}
+	priv->realtime = scconf_get_bool(conf_block, "realtime", 0);
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	if (reader == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	reader->drv_data = priv;
+	reader->ops = &replay_ops;
+	reader->driver = &replay_drv;
+	snprintf(namebuf, sizeof(namebuf), "Replay reader %u (%s)",
+			sc_ctx_get_reader_count(ctx), filename);
+	reader->name = strdup(namebuf);
+	reader->flags = SC_READER_CARD_PRESENT;
+	reader->supported_protocols = SC_PROTO_T0 | SC_PROTO_T1;
+	reader->max_send_size = scconf_get_int(conf_block, "max_send_size", SC_READER_SHORT_APDU_MAX_SEND_SIZE);
+	reader->max_recv_size = scconf_get_int(conf_block, "max_recv_size", SC_READER_SHORT_APDU_MAX_RECV_SIZE);
+
+	r = _sc_add_reader(ctx, reader);
+	if (r) {
+		free(reader->name);
+		free(reader);
+		goto err;
+	}
+	return SC_SUCCESS;
+err:
+	replay_free_trace(&priv->trace);
+	free(priv);
+	return r;
+}
+
+static int replay_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const scconf_list *list;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	if (conf_block == NULL)
+		return SC_SUCCESS;
+
+	for (list = scconf_find_list(conf_block, "traces"); list != NULL; list = list->next)
+		replay_add_reader(ctx, conf_block, list->data);
+
+	return SC_SUCCESS;
+}
+
+static int replay_finish(sc_context_t *ctx)
+{
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver * sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_init;
+	replay_ops.finish = replay_finish;
+	replay_ops.transmit = replay_transmit;
+	replay_ops.detect_card_presence = replay_detect_card_presence;
+	replay_ops.lock = replay_lock;
+	replay_ops.unlock = replay_unlock;
+	replay_ops.release = replay_release;
+	replay_ops.connect = replay_connect;
+	replay_ops.disconnect = replay_disconnect;
+
+	return &replay_drv;
+}
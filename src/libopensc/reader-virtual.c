@@ -0,0 +1,1012 @@
+/*
+ * reader-virtual.c: Reader driver emulating ISO 7816 cards in memory
+ *
+ * Copyright (C) 2016  OpenSC Project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The virtual reader serves a card filesystem described by an image file
+ * in scconf syntax, for example:
+ *
+ *	atr = "3B:02:14:50";
+ *	file 3F005015 { aid = "A0:00:00:00:63:50:4B:43:53:2D:31:35"; }
+ *	file 3F0050155032 { content = "30:1A:02:01:00:..."; }
+ *	file 3F0050154401 { content_file = "/tmp/aodf.bin"; }
+ *	file 3F000010 { records = "01:02:03", "04:05:06"; }
+ *
+ * Files with 'content' or 'content_file' are transparent EFs, files with
+ * 'records' are linear EFs and everything else is a DF. Missing parent DFs
+ * (including the MF) are created implicitly.
+ *
+ * Supported commands: SELECT, READ BINARY (also with odd INS for the
+ * current EF), READ RECORD, GET RESPONSE,
+ * VERIFY, MANAGE SECURITY ENVIRONMENT and PERFORM SECURITY OPERATION.
+ * The cryptographic operations do not use any key: they return
+ * deterministic data of the requested length, which is enough to drive
+ * the upper layers for performance measurements.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "internal.h"
+#include "iso7816.h"
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+#define VIRTUAL_FILE_DF			0
+#define VIRTUAL_FILE_TRANSPARENT	1
+#define VIRTUAL_FILE_LINEAR		2
+
+struct virtual_record {
+	u8 *value;
+	size_t len;
+};
+
+struct virtual_file {
+	u8 path[SC_MAX_PATH_SIZE];
+	size_t pathlen;
+	int type;
+
+	u8 aid[SC_MAX_AID_SIZE];
+	size_t aidlen;
+
+	u8 *content;
+	size_t size;
+
+	struct virtual_record *records;
+	size_t nrecords;
+};
+
+struct virtual_image {
+	char *filename;
+	struct sc_atr atr;
+
+	struct virtual_file *files;
+	size_t nfiles;
+
+	struct virtual_image *next;
+};
+
+struct virtual_global_private_data {
+	struct virtual_image *images;
+};
+
+/* Reader specific private data, i.e. the state of the emulated card */
+struct virtual_private_data {
+	struct virtual_image *image;
+	unsigned int latency;
+	unsigned int protocol;
+
+	const struct virtual_file *current_df;
+	const struct virtual_file *current_ef;
+	int se_set;
+
+	/* response data waiting for GET RESPONSE */
+	u8 *pending;
+	size_t pending_len;
+};
+
+static void virtual_delay(unsigned int usec)
+{
+	if (usec == 0)
+		return;
+#ifdef _WIN32
+	Sleep((usec + 999) / 1000);
+#else
+	usleep(usec);
+#endif
+}
+
+static void virtual_free_image(struct virtual_image *image)
+{
+	size_t i, j;
+
+	for (i = 0; i < image->nfiles; i++) {
+		struct virtual_file *file = &image->files[i];
+
+		free(file->content);
+		for (j = 0; j < file->nrecords; j++)
+			free(file->records[j].value);
+		free(file->records);
+	}
+	free(image->files);
+	free(image->filename);
+	free(image);
+}
+
+static int virtual_find_file(const struct virtual_image *image,
+		const u8 *path, size_t pathlen)
+{
+	size_t i;
+
+	for (i = 0; i < image->nfiles; i++)
+		if (image->files[i].pathlen == pathlen
+				&& memcmp(image->files[i].path, path, pathlen) == 0)
+			return (int) i;
+	return -1;
+}
+
+/* Returns the index of the file with the given path, creating it and any
+ * missing parent DF if necessary */
+static int virtual_add_file(struct virtual_image *image, const u8 *path, size_t pathlen)
+{
+	struct virtual_file *files, *file;
+	int idx;
+
+	if (pathlen < 2 || pathlen > SC_MAX_PATH_SIZE || (pathlen & 1))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	idx = virtual_find_file(image, path, pathlen);
+	if (idx >= 0)
+		return idx;
+
+	if (pathlen > 2) {
+		idx = virtual_add_file(image, path, pathlen - 2);
+		if (idx < 0)
+			return idx;
+	}
+
+	files = realloc(image->files, (image->nfiles + 1) * sizeof(struct virtual_file));
+	if (files == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	image->files = files;
+
+	file = &image->files[image->nfiles];
+	memset(file, 0, sizeof(*file));
+	memcpy(file->path, path, pathlen);
+	file->pathlen = pathlen;
+	file->type = VIRTUAL_FILE_DF;
+
+	return (int) image->nfiles++;
+}
+
+static int virtual_hex_value(const char *hex, u8 **out, size_t *outlen)
+{
+	size_t len = strlen(hex) / 2 + 1;
+	u8 *buf;
+	int r;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_hex_to_bin(hex, buf, &len);
+	if (r != SC_SUCCESS) {
+		free(buf);
+		return r;
+	}
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+static int virtual_read_content_file(const char *filename, u8 **out, size_t *outlen)
+{
+	FILE *f;
+	u8 *buf = NULL;
+	long len;
+
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0
+			|| fseek(f, 0, SEEK_SET) != 0)
+		goto err;
+	buf = malloc(len ? len : 1);
+	if (buf == NULL)
+		goto err;
+	if (fread(buf, 1, len, f) != (size_t) len)
+		goto err;
+	fclose(f);
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+err:
+	free(buf);
+	fclose(f);
+	return SC_ERROR_INTERNAL;
+}
+
+static int virtual_load_file(sc_context_t *ctx, struct virtual_image *image, scconf_block *blk)
+{
+	struct virtual_file *file;
+	const scconf_list *list;
+	const char *val;
+	u8 path[SC_MAX_PATH_SIZE + 2];
+	size_t pathlen = sizeof(path) - 2;
+	int r, idx;
+
+	if (blk->name == NULL || blk->name->data == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	/* Paths are always absolute, the leading MF is optional */
+	r = sc_hex_to_bin(blk->name->data, path + 2, &pathlen);
+	if (r != SC_SUCCESS)
+		return r;
+	if (pathlen >= 2 && memcmp(path + 2, "\x3F\x00", 2) == 0) {
+		idx = virtual_add_file(image, path + 2, pathlen);
+	}
+	else {
+		path[0] = 0x3F;
+		path[1] = 0x00;
+		idx = virtual_add_file(image, path, pathlen + 2);
+	}
+	if (idx < 0)
+		return idx;
+	file = &image->files[idx];
+
+	val = scconf_get_str(blk, "aid", NULL);
+	if (val != NULL) {
+		file->aidlen = sizeof(file->aid);
+		r = sc_hex_to_bin(val, file->aid, &file->aidlen);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	val = scconf_get_str(blk, "content", NULL);
+	if (val != NULL) {
+		r = virtual_hex_value(val, &file->content, &file->size);
+		if (r != SC_SUCCESS)
+			return r;
+		file->type = VIRTUAL_FILE_TRANSPARENT;
+	}
+
+	val = scconf_get_str(blk, "content_file", NULL);
+	if (val != NULL && file->content == NULL) {
+		r = virtual_read_content_file(val, &file->content, &file->size);
+		if (r != SC_SUCCESS) {
+			sc_log(ctx, "Cannot read content file '%s'", val);
+			return r;
+		}
+		file->type = VIRTUAL_FILE_TRANSPARENT;
+	}
+
+	for (list = scconf_find_list(blk, "records"); list != NULL; list = list->next) {
+		struct virtual_record *records;
+
+		records = realloc(file->records, (file->nrecords + 1) * sizeof(struct virtual_record));
+		if (records == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		file->records = records;
+		r = virtual_hex_value(list->data, &records[file->nrecords].value,
+				&records[file->nrecords].len);
+		if (r != SC_SUCCESS)
+			return r;
+		file->nrecords++;
+		file->type = VIRTUAL_FILE_LINEAR;
+	}
+
+	return SC_SUCCESS;
+}
+
+static int virtual_load_image(sc_context_t *ctx, const char *filename,
+		struct virtual_image **image_out)
+{
+	struct virtual_image *image;
+	scconf_context *conf;
+	scconf_block **blocks;
+	const char *atr;
+	int i, r;
+
+	image = calloc(1, sizeof(struct virtual_image));
+	if (image == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	image->filename = strdup(filename);
+	conf = scconf_new(filename);
+	if (image->filename == NULL || conf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	if (scconf_parse(conf) < 1) {
+		sc_log(ctx, "Cannot parse card image '%s': %s", filename, conf->errmsg);
+		r = SC_ERROR_INCONSISTENT_CONFIGURATION;
+		goto out;
+	}
+
+	atr = scconf_get_str(conf->root, "atr", NULL);
+	if (atr == NULL) {
+		sc_log(ctx, "Card image '%s' has no ATR", filename);
+		r = SC_ERROR_INCONSISTENT_CONFIGURATION;
+		goto out;
+	}
+	image->atr.len = sizeof(image->atr.value);
+	r = sc_hex_to_bin(atr, image->atr.value, &image->atr.len);
+	if (r != SC_SUCCESS)
+		goto out;
+
+	/* The MF is always present */
+	r = virtual_add_file(image, (const u8 *) "\x3F\x00", 2);
+	if (r < 0)
+		goto out;
+
+	r = SC_SUCCESS;
+	blocks = scconf_find_blocks(conf, NULL, "file", NULL);
+	for (i = 0; blocks != NULL && blocks[i] != NULL; i++) {
+		r = virtual_load_file(ctx, image, blocks[i]);
+		if (r != SC_SUCCESS) {
+			sc_log(ctx, "Invalid file '%s' in card image '%s'",
+					blocks[i]->name ? blocks[i]->name->data : "", filename);
+			break;
+		}
+	}
+	free(blocks);
+	if (r == SC_SUCCESS)
+		sc_log(ctx, "Loaded card image '%s' with %lu files",
+				filename, (unsigned long) image->nfiles);
+out:
+	if (conf != NULL)
+		scconf_free(conf);
+	if (r != SC_SUCCESS) {
+		virtual_free_image(image);
+		return r;
+	}
+	*image_out = image;
+	return SC_SUCCESS;
+}
+
+static void virtual_set_sw(u8 *rbuf, size_t *rlen, size_t datalen, unsigned int sw)
+{
+	rbuf[datalen] = (u8) (sw >> 8);
+	rbuf[datalen + 1] = (u8) sw;
+	*rlen = datalen + 2;
+}
+
+/* Copies response data to the receive buffer. If the command carried no Le
+ * (case 4 APDU with T=0), the data is kept for GET RESPONSE instead */
+static void virtual_respond(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		const u8 *data, size_t len, unsigned int sw, u8 *rbuf, size_t *rlen)
+{
+	size_t n = len;
+
+	free(priv->pending);
+	priv->pending = NULL;
+	priv->pending_len = 0;
+
+	if (len != 0 && cmd->le == 0) {
+		priv->pending = malloc(len);
+		if (priv->pending == NULL) {
+			virtual_set_sw(rbuf, rlen, 0, 0x6581);
+			return;
+		}
+		memcpy(priv->pending, data, len);
+		priv->pending_len = len;
+		virtual_set_sw(rbuf, rlen, 0, 0x6100 | (len > 0xFF ? 0 : len));
+		return;
+	}
+
+	if (n > cmd->le)
+		n = cmd->le;
+	if (n > *rlen - 2)
+		n = *rlen - 2;
+	memcpy(rbuf, data, n);
+	virtual_set_sw(rbuf, rlen, n, sw);
+}
+
+static size_t virtual_build_fci(const struct virtual_file *file, u8 tag, u8 *buf)
+{
+	u8 *p = buf + 2;
+
+	*p++ = ISO7816_TAG_FCP_FID;
+	*p++ = 2;
+	*p++ = file->path[file->pathlen - 2];
+	*p++ = file->path[file->pathlen - 1];
+
+	if (file->type != VIRTUAL_FILE_DF) {
+		*p++ = ISO7816_TAG_FCP_SIZE;
+		if (file->size > 0xFFFF) {
+			*p++ = 4;
+			*p++ = (u8) (file->size >> 24);
+			*p++ = (u8) (file->size >> 16);
+		}
+		else {
+			*p++ = 2;
+		}
+		*p++ = (u8) (file->size >> 8);
+		*p++ = (u8) file->size;
+	}
+
+	*p++ = ISO7816_TAG_FCP_TYPE;
+	*p++ = 1;
+	if (file->type == VIRTUAL_FILE_DF)
+		*p++ = ISO7816_FILE_TYPE_DF;
+	else if (file->type == VIRTUAL_FILE_LINEAR)
+		*p++ = 0x02;
+	else
+		*p++ = ISO7816_FILE_TYPE_TRANSPARENT_EF;
+
+	if (file->aidlen) {
+		*p++ = ISO7816_TAG_FCP_DF_NAME;
+		*p++ = (u8) file->aidlen;
+		memcpy(p, file->aid, file->aidlen);
+		p += file->aidlen;
+	}
+
+	buf[0] = tag;
+	buf[1] = (u8) (p - buf - 2);
+	return p - buf;
+}
+
+static const struct virtual_file *
+virtual_find_child(const struct virtual_image *image, const struct virtual_file *df,
+		const u8 *id, size_t idlen)
+{
+	u8 path[SC_MAX_PATH_SIZE];
+	int idx;
+
+	if (df == NULL || df->pathlen + idlen > sizeof(path))
+		return NULL;
+	memcpy(path, df->path, df->pathlen);
+	memcpy(path + df->pathlen, id, idlen);
+	idx = virtual_find_file(image, path, df->pathlen + idlen);
+	return idx < 0 ? NULL : &image->files[idx];
+}
+
+static const struct virtual_file *
+virtual_find_parent(const struct virtual_image *image, const struct virtual_file *file)
+{
+	int idx;
+
+	if (file->pathlen <= 2)
+		return file;
+	idx = virtual_find_file(image, file->path, file->pathlen - 2);
+	return idx < 0 ? NULL : &image->files[idx];
+}
+
+static void virtual_select(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	const struct virtual_image *image = priv->image;
+	const struct virtual_file *mf = &image->files[0];
+	const struct virtual_file *file = NULL;
+	u8 fci[64];
+	size_t i;
+
+	switch (cmd->p1) {
+	case 0x00:
+		if (cmd->datalen == 0 || (cmd->datalen == 2 && memcmp(cmd->data, "\x3F\x00", 2) == 0)) {
+			file = mf;
+			break;
+		}
+		if (cmd->datalen != 2)
+			break;
+		file = virtual_find_child(image, priv->current_df, cmd->data, 2);
+		if (file == NULL && priv->current_df != NULL) {
+			const struct virtual_file *df = priv->current_df;
+
+			if (memcmp(df->path + df->pathlen - 2, cmd->data, 2) == 0)
+				file = df;
+			else
+				file = virtual_find_child(image, virtual_find_parent(image, df), cmd->data, 2);
+		}
+		break;
+	case 0x01:
+	case 0x02:
+		if (cmd->datalen != 2)
+			break;
+		file = virtual_find_child(image, priv->current_df, cmd->data, 2);
+		if (file != NULL && (file->type == VIRTUAL_FILE_DF) != (cmd->p1 == 0x01))
+			file = NULL;
+		break;
+	case 0x03:
+		if (priv->current_df != NULL)
+			file = virtual_find_parent(image, priv->current_df);
+		break;
+	case 0x04:
+		for (i = 0; i < image->nfiles; i++) {
+			const struct virtual_file *df = &image->files[i];
+
+			if (df->aidlen != 0 && cmd->datalen <= df->aidlen
+					&& memcmp(df->aid, cmd->data, cmd->datalen) == 0) {
+				file = df;
+				break;
+			}
+		}
+		break;
+	case 0x08:
+	case 0x09:
+		if (cmd->datalen == 0 || (cmd->datalen & 1) != 0)
+			break;
+		file = virtual_find_child(image, cmd->p1 == 0x08 ? mf : priv->current_df,
+				cmd->data, cmd->datalen);
+		break;
+	default:
+		virtual_set_sw(rbuf, rlen, 0, 0x6A86);
+		return;
+	}
+
+	if (file == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6A82);
+		return;
+	}
+
+	if (file->type == VIRTUAL_FILE_DF) {
+		priv->current_df = file;
+		priv->current_ef = NULL;
+	}
+	else {
+		priv->current_df = virtual_find_parent(image, file);
+		priv->current_ef = file;
+	}
+
+	if ((cmd->p2 & 0x0C) == 0x0C) {
+		virtual_respond(priv, cmd, NULL, 0, 0x9000, rbuf, rlen);
+		return;
+	}
+	i = virtual_build_fci(file, (cmd->p2 & 0x0C) == 0x04 ? ISO7816_TAG_FCP : ISO7816_TAG_FCI, fci);
+	virtual_respond(priv, cmd, fci, i, 0x9000, rbuf, rlen);
+}
+
+static void virtual_read_binary(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	const struct virtual_file *ef = priv->current_ef;
+	size_t offset, count;
+
+	if (cmd->p1 & 0x80) {
+		/* Short EF identifiers are not supported */
+		virtual_set_sw(rbuf, rlen, 0, 0x6A81);
+		return;
+	}
+	if (ef == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6986);
+		return;
+	}
+	if (ef->type != VIRTUAL_FILE_TRANSPARENT) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6981);
+		return;
+	}
+
+	offset = (cmd->p1 << 8) | cmd->p2;
+	if (offset > ef->size) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6B00);
+		return;
+	}
+	count = ef->size - offset;
+	virtual_respond(priv, cmd, ef->content + offset, count,
+			count < cmd->le ? 0x6282 : 0x9000, rbuf, rlen);
+}
+
+static void virtual_read_binary_odd(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	const struct virtual_file *ef = priv->current_ef;
+	size_t offset, count, hlen, i;
+	u8 *out;
+
+	if (cmd->p1 != 0 || cmd->p2 != 0) {
+		/* Only the current EF is supported */
+		virtual_set_sw(rbuf, rlen, 0, 0x6A81);
+		return;
+	}
+	if (cmd->datalen < 2 || cmd->data[0] != 0x54 || cmd->data[1] > 4
+			|| cmd->datalen != 2 + (size_t) cmd->data[1]) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6A80);
+		return;
+	}
+	if (ef == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6986);
+		return;
+	}
+	if (ef->type != VIRTUAL_FILE_TRANSPARENT) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6981);
+		return;
+	}
+
+	for (offset = 0, i = 0; i < cmd->data[1]; i++)
+		offset = (offset << 8) | cmd->data[2 + i];
+	if (offset > ef->size) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6B00);
+		return;
+	}
+
+	/* Return as much as fits into Le together with the '53' header */
+	count = ef->size - offset;
+	if (cmd->le != 0 && count + 4 > cmd->le) {
+		count = cmd->le > 2 ? cmd->le - 2 : 0;
+		if (count >= 0x80)
+			count--;
+		if (count >= 0x100)
+			count--;
+	}
+	if (count > 0xFFFF)
+		count = 0xFFFF;
+	hlen = count < 0x80 ? 2 : count < 0x100 ? 3 : 4;
+	out = malloc(count + hlen);
+	if (out == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6581);
+		return;
+	}
+	out[0] = 0x53;
+	if (hlen == 2) {
+		out[1] = (u8) count;
+	} else if (hlen == 3) {
+		out[1] = 0x81;
+		out[2] = (u8) count;
+	} else {
+		out[1] = 0x82;
+		out[2] = (u8) (count >> 8);
+		out[3] = (u8) count;
+	}
+	memcpy(out + hlen, ef->content + offset, count);
+	virtual_respond(priv, cmd, out, count + hlen,
+			offset + count == ef->size && count + hlen < cmd->le ? 0x6282 : 0x9000,
+			rbuf, rlen);
+	free(out);
+}
+
+static void virtual_read_record(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	const struct virtual_file *ef = priv->current_ef;
+	const struct virtual_record *rec;
+
+	if ((cmd->p2 & 0x07) != 0x04 || (cmd->p2 >> 3) != 0) {
+		/* Only 'read record P1' in the current EF is supported */
+		virtual_set_sw(rbuf, rlen, 0, 0x6A81);
+		return;
+	}
+	if (ef == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6986);
+		return;
+	}
+	if (ef->type != VIRTUAL_FILE_LINEAR) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6981);
+		return;
+	}
+	if (cmd->p1 == 0 || cmd->p1 > ef->nrecords) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6A83);
+		return;
+	}
+
+	rec = &ef->records[cmd->p1 - 1];
+	virtual_respond(priv, cmd, rec->value, rec->len, 0x9000, rbuf, rlen);
+}
+
+static void virtual_get_response(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	size_t n = priv->pending_len;
+
+	if (priv->pending == NULL) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6985);
+		return;
+	}
+
+	if (n > cmd->le)
+		n = cmd->le;
+	if (n > *rlen - 2)
+		n = *rlen - 2;
+	memcpy(rbuf, priv->pending, n);
+	priv->pending_len -= n;
+	if (priv->pending_len == 0) {
+		free(priv->pending);
+		priv->pending = NULL;
+		virtual_set_sw(rbuf, rlen, n, 0x9000);
+		return;
+	}
+
+	memmove(priv->pending, priv->pending + n, priv->pending_len);
+	virtual_set_sw(rbuf, rlen, n, 0x6100 | (priv->pending_len > 0xFF ? 0 : priv->pending_len));
+}
+
+static void virtual_pso(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	u8 *out;
+	size_t i, len;
+
+	if (!priv->se_set) {
+		virtual_set_sw(rbuf, rlen, 0, 0x6985);
+		return;
+	}
+
+	if (cmd->p1 == 0x9E && cmd->p2 == 0x9A && cmd->datalen != 0) {
+		/* Compute digital signature: derive the requested amount of
+		 * data from the input */
+		len = cmd->le ? cmd->le : 256;
+		out = malloc(len);
+		if (out == NULL) {
+			virtual_set_sw(rbuf, rlen, 0, 0x6581);
+			return;
+		}
+		for (i = 0; i < len; i++)
+			out[i] = cmd->data[i % cmd->datalen] ^ (u8) i;
+		virtual_respond(priv, cmd, out, len, 0x9000, rbuf, rlen);
+		free(out);
+	}
+	else if (cmd->p1 == 0x80 && cmd->p2 == 0x86 && cmd->datalen > 1) {
+		/* Decipher: return the cryptogram without the padding indicator */
+		virtual_respond(priv, cmd, cmd->data + 1, cmd->datalen - 1, 0x9000, rbuf, rlen);
+	}
+	else {
+		virtual_set_sw(rbuf, rlen, 0, 0x6A86);
+	}
+}
+
+static void virtual_process(struct virtual_private_data *priv, const sc_apdu_t *cmd,
+		u8 *rbuf, size_t *rlen)
+{
+	/* Anything but GET RESPONSE discards the pending response data */
+	if (cmd->ins != 0xC0 && priv->pending != NULL) {
+		free(priv->pending);
+		priv->pending = NULL;
+		priv->pending_len = 0;
+	}
+
+	switch (cmd->ins) {
+	case 0xA4:
+		virtual_select(priv, cmd, rbuf, rlen);
+		break;
+	case 0xB0:
+		virtual_read_binary(priv, cmd, rbuf, rlen);
+		break;
+	case 0xB1:
+		virtual_read_binary_odd(priv, cmd, rbuf, rlen);
+		break;
+	case 0xB2:
+		virtual_read_record(priv, cmd, rbuf, rlen);
+		break;
+	case 0xC0:
+		virtual_get_response(priv, cmd, rbuf, rlen);
+		break;
+	case 0x20:
+		/* The emulated card accepts any PIN */
+		virtual_set_sw(rbuf, rlen, 0, 0x9000);
+		break;
+	case 0x22:
+		priv->se_set = 1;
+		virtual_set_sw(rbuf, rlen, 0, 0x9000);
+		break;
+	case 0x2A:
+		virtual_pso(priv, cmd, rbuf, rlen);
+		break;
+	default:
+		virtual_set_sw(rbuf, rlen, 0, 0x6D00);
+		break;
+	}
+}
+
+static void virtual_reset_state(struct virtual_private_data *priv)
+{
+	priv->current_df = &priv->image->files[0];
+	priv->current_ef = NULL;
+	priv->se_set = 0;
+	free(priv->pending);
+	priv->pending = NULL;
+	priv->pending_len = 0;
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	struct sc_apdu cmd;
+	size_t ssize = 0, rsize;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	int r;
+
+	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
+		return SC_ERROR_NOT_ALLOWED;
+
+	rsize = apdu->resplen + 2;
+	/* encode and log the APDU */
+	r = sc_apdu_get_scratch_octets(reader, apdu, priv->protocol,
+			&sbuf, &ssize, &rbuf, rsize);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	/* the card sees the encoded command exactly as a physical one would */
+	r = sc_bytes2apdu(reader->ctx, sbuf, ssize, &cmd);
+	if (r != SC_SUCCESS) {
+		sc_log(reader->ctx, "unable to transmit");
+		r = SC_ERROR_TRANSMIT_FAILED;
+		goto out;
+	}
+	virtual_delay(priv->latency);
+	virtual_process(priv, &cmd, rbuf, &rsize);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	sc_apdu_release_scratch_octets(reader, sbuf, ssize + rsize);
+
+	return r;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	return reader->flags;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
+		return SC_ERROR_NOT_ALLOWED;
+
+	virtual_reset_state(priv);
+	memcpy(&reader->atr, &priv->image->atr, sizeof(reader->atr));
+	reader->active_protocol = priv->protocol;
+	_sc_parse_atr(reader);
+
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	virtual_reset_state(GET_PRIV_DATA(reader));
+	return SC_SUCCESS;
+}
+
+static int virtual_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	free(priv->pending);
+	free(priv);
+	return SC_SUCCESS;
+}
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_drv = {
+	"Virtual card reader",
+	"virtual",
+	&virtual_ops,
+	NULL
+};
+
+static int virtual_add_reader(sc_context_t *ctx, scconf_block *conf_block,
+		struct virtual_image *image)
+{
+	struct virtual_private_data *priv;
+	sc_reader_t *reader;
+	const char *protocol;
+	char namebuf[128];
+	int latency, r;
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	priv = calloc(1, sizeof(struct virtual_private_data));
+	if (!priv || !reader) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	reader->drv_data = priv;
+	reader->ops = &virtual_ops;
+	reader->driver = &virtual_drv;
+	snprintf(namebuf, sizeof(namebuf), "Virtual reader %u (%s)",
+			sc_ctx_get_reader_count(ctx), image->filename);
+	reader->name = strdup(namebuf);
+	reader->flags = SC_READER_CARD_PRESENT;
+	reader->supported_protocols = SC_PROTO_T0 | SC_PROTO_T1;
+
+	priv->image = image;
+	latency = scconf_get_int(conf_block, "latency", 0);
+	priv->latency = latency > 0 ? (unsigned int) latency : 0;
+	protocol = scconf_get_str(conf_block, "protocol", "t1");
+	priv->protocol = strcasecmp(protocol, "t0") ? SC_PROTO_T1 : SC_PROTO_T0;
+
+	reader->max_send_size = scconf_get_int(conf_block, "max_send_size", SC_READER_SHORT_APDU_MAX_SEND_SIZE);
+	reader->max_recv_size = scconf_get_int(conf_block, "max_recv_size", SC_READER_SHORT_APDU_MAX_RECV_SIZE);
+
+	r = _sc_add_reader(ctx, reader);
+	if (r) {
+		free(priv);
+		free(reader->name);
+		free(reader);
+	}
+	return r;
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv;
+	scconf_block *conf_block = NULL;
+	const scconf_list *list;
+	int i, count, r;
+
+	gpriv = calloc(1, sizeof(struct virtual_global_private_data));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	ctx->reader_drv_data = gpriv;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block == NULL)
+		return SC_SUCCESS;
+
+	/* Every image is inserted into 'readers' readers */
+	count = scconf_get_int(conf_block, "readers", 1);
+	for (list = scconf_find_list(conf_block, "images"); list != NULL; list = list->next) {
+		struct virtual_image *image = NULL;
+
+		r = virtual_load_image(ctx, list->data, &image);
+		if (r != SC_SUCCESS) {
+			sc_log(ctx, "cannot load card image '%s': %s", list->data, sc_strerror(r));
+			continue;
+		}
+		image->next = gpriv->images;
+		gpriv->images = image;
+
+		for (i = 0; i < count; i++) {
+			r = virtual_add_reader(ctx, conf_block, image);
+			if (r != SC_SUCCESS)
+				return r;
+		}
+	}
+
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv = (struct virtual_global_private_data *) ctx->reader_drv_data;
+
+	if (gpriv) {
+		while (gpriv->images != NULL) {
+			struct virtual_image *image = gpriv->images;
+
+			gpriv->images = image->next;
+			virtual_free_image(image);
+		}
+		free(gpriv);
+	}
+
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver * sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.release = virtual_release;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.reset = virtual_reset;
+
+	return &virtual_drv;
+}
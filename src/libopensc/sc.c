@@ -30,6 +30,9 @@
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/crypto.h>     /* for OPENSSL_cleanse */
 #endif
@@ -351,7 +354,7 @@ int sc_concatenate_path(sc_path_t *d, const sc_path_t *p1, const sc_path_t *p2)
 
 const char *sc_print_path(const sc_path_t *path)
 {
-	static char buffer[SC_MAX_PATH_STRING_SIZE + SC_MAX_AID_STRING_SIZE];
+	static SC_THREAD_LOCAL char buffer[SC_MAX_PATH_STRING_SIZE + SC_MAX_AID_STRING_SIZE];
 
 	if (sc_path_print(buffer, sizeof(buffer), path) != SC_SUCCESS)
 		buffer[0] = '\0';
@@ -859,6 +862,26 @@ int sc_mem_reverse(unsigned char *buf, size_t len)
 	return SC_SUCCESS;
 }
 
+unsigned long long sc_get_time_usec(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	unsigned long long t;
+
+	/* 100 ns intervals since January 1, 1601 */
+	GetSystemTimeAsFileTime(&ft);
+	t = ((unsigned long long) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return t / 10 - 11644473600000000ULL;
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (unsigned long long) time(NULL) * 1000000;
+#endif
+}
+
 static int
 sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 		struct sc_remote_apdu **new_rapdu)
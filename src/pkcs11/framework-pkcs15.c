@@ -466,6 +466,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
 	struct sc_pin_cmd_data data;
@@ -486,6 +487,15 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	if (slot->p11card == NULL)   {
+		rv = CKR_TOKEN_NOT_PRESENT;
+		goto out;
+	}
+	rv = sc_pkcs11_lock_card(slot->p11card);
+	if (rv != CKR_OK)
+		goto out;
+	p11card = slot->p11card;
+
 	/* User PIN flags are cleared before re-calculation */
 	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
 	auth = slot_data_auth(slot->fw_data);
@@ -504,7 +514,9 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		data.pin_type = SC_AC_CHV;
 		data.pin_reference = pin_info->attrs.pin.reference;
 
-		r = sc_pin_cmd(slot->p11card->card, &data, NULL);
+		sc_pkcs11_card_io_begin();
+		r = sc_pin_cmd(p11card->card, &data, NULL);
+		sc_pkcs11_card_io_end();
 		if (r == SC_SUCCESS) {
 			if (data.pin1.max_tries > 0)
 				pin_info->max_tries = data.pin1.max_tries;
@@ -523,6 +535,8 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	sc_log(context, "C_GetTokenInfo(%lx) returns 0x%lX", slotID, rv);
 	return rv;
@@ -893,15 +907,17 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_get_object(slot, (CK_OBJECT_HANDLE)obj) == (struct sc_pkcs11_object *)obj)
+		return;
+
+	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
+	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	if (slot_add_object(slot, (struct sc_pkcs11_object *)obj) != CKR_OK)
 		return;
 
 	if (pHandle != NULL)
 		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 
-	list_append(&slot->objects, obj);
-	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
-	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -1244,6 +1260,69 @@ _add_public_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data)
 }
 
 
+/* Returns the private key of a token with the same ID as a key of
+ * another token of the pool */
+static struct pkcs15_prkey_object *
+pkcs15_pool_prkey(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *prkey)
+{
+	unsigned int i;
+
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+
+		if (is_privkey(obj) && !(obj->base.flags & SC_PKCS11_OBJECT_HIDDEN)
+				&& sc_pkcs15_compare_id(&((struct pkcs15_prkey_object *) obj)->prv_info->id,
+					&prkey->prv_info->id))
+			return (struct pkcs15_prkey_object *) obj;
+	}
+	return NULL;
+}
+
+
+/* Adds the token to the token pool if it holds all keys listed in
+ * 'pool_key_ids' */
+static void
+pkcs15_pool_join(struct sc_pkcs11_card *p11card, struct pkcs15_fw_data *fw_data)
+{
+	struct sc_pkcs15_object *p15obj;
+	struct pkcs15_any_object *key = NULL;
+	unsigned int i, j;
+
+	if (sc_pkcs11_conf.num_pool_key_ids == 0)
+		return;
+	for (i = 0; i < sc_pkcs11_conf.num_pool_key_ids; i++)
+		if (sc_pkcs15_find_prkey_by_id(fw_data->p15_card, &sc_pkcs11_conf.pool_key_ids[i], &p15obj) != SC_SUCCESS)
+			return;
+
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+
+		if (!is_privkey(obj) || (obj->base.flags & SC_PKCS11_OBJECT_HIDDEN))
+			continue;
+		for (j = 0; j < sc_pkcs11_conf.num_pool_key_ids; j++) {
+			if (sc_pkcs15_compare_id(&((struct pkcs15_prkey_object *) obj)->prv_info->id,
+						&sc_pkcs11_conf.pool_key_ids[j])) {
+				obj->base.flags |= SC_PKCS11_OBJECT_POOLED;
+				if (key == NULL)
+					key = obj;
+			}
+		}
+	}
+	if (key == NULL)
+		return;
+
+	/* The slot showing the keys represents the token */
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i);
+
+		if (slot->p11card == p11card && slot_get_object(slot, key->base.handle) == &key->base) {
+			slot_pool_join(slot);
+			break;
+		}
+	}
+}
+
+
 static CK_RV
 pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 {
@@ -1353,6 +1432,8 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		_add_public_objects(slot, fw_data);
 	}
 
+	pkcs15_pool_join(p11card, fw_data);
+
 	sc_log(context, "All tokens created");
 	return CKR_OK;
 }
@@ -2855,7 +2936,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, (struct sc_pkcs11_object *)any_obj);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2911,7 +2992,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		struct pkcs15_pubkey_object *pubkey = any_obj->related_pubkey;
 
 		/* Check if key is not removed in between */
-		if (list_locate(&session->slot->objects, ao_pubkey) > 0) {
+		if (slot_get_object(session->slot, (CK_OBJECT_HANDLE)ao_pubkey) == (struct sc_pkcs11_object *)ao_pubkey) {
 			sc_log(context, "Found related pubkey %p", any_obj->related_pubkey);
 
 			/* Delete reference to related certificate of the public key PKCS#11 object */
@@ -2921,7 +3002,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, (struct sc_pkcs11_object *)ao_pubkey);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -2939,7 +3020,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, (struct sc_pkcs11_object *)any_obj);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3485,17 +3566,22 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 			CK_ULONG_PTR pulDataLen)
 {
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
-	struct sc_pkcs11_card *p11card = session->slot->p11card;
+	struct sc_pkcs11_slot *slot = session_slot(session);
+	struct sc_pkcs11_card *p11card = slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	int rv, flags = 0, prkey_has_path = 0;
 	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
 			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
 
 	sc_log(context, "Initiating signing operation, mechanism 0x%x.",pMechanism->mechanism);
-	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Sign");
 
+	/* Use the same key of the token chosen from the pool */
+	if (slot != session->slot)
+		prkey = pkcs15_pool_prkey(fw_data, prkey);
+
 	/* See which of the alternative keys supports signing */
 	while (prkey && !(prkey->prv_info->usage & sign_flags))
 		prkey = prkey->prv_next;
@@ -3586,7 +3672,8 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
 		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
-	struct sc_pkcs11_card *p11card = session->slot->p11card;
+	struct sc_pkcs11_slot *slot = session_slot(session);
+	struct sc_pkcs11_card *p11card = slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	struct pkcs15_prkey_object *prkey;
 	unsigned char decrypted[256]; /* FIXME: Will not work for keys above 2048 bits */
@@ -3594,12 +3681,14 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 
 	sc_log(context, "Initiating decryption.");
 
-	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Decrypt");
 
 	/* See which of the alternative keys supports decrypt */
 	prkey = (struct pkcs15_prkey_object *) obj;
+	if (slot != session->slot)
+		prkey = pkcs15_pool_prkey(fw_data, prkey);
 	while (prkey  && !(prkey->prv_info->usage & (SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP)))
 		prkey = prkey->prv_next;
 	if (prkey == NULL)
@@ -775,6 +775,19 @@ sc_pkcs11_decr(struct sc_pkcs11_session *session,
 	return rv;
 }
 
+/* Returns the key of an active sign or decrypt operation */
+struct sc_pkcs11_object *
+sc_pkcs11_operation_key(struct sc_pkcs11_session *session, int type)
+{
+	sc_pkcs11_operation_t *op;
+
+	if (type != SC_PKCS11_OPERATION_SIGN && type != SC_PKCS11_OPERATION_DECRYPT)
+		return NULL;
+	if (session_get_operation(session, type, &op) != CKR_OK || op->priv_data == NULL)
+		return NULL;
+	return ((struct signature_data *) op->priv_data)->key;
+}
+
 /* Derive one key from another, and return results in created object */
 CK_RV
 sc_pkcs11_deri(struct sc_pkcs11_session *session,
@@ -56,6 +56,120 @@ void strcpy_bp(u8 * dst, const char *src, size_t dstsize)
 }
 
 
+/*
+ * Handle tables use open addressing with linear probing. Removed entries
+ * are filled by moving the following entries of the probe sequence back,
+ * so lookups never need to skip deleted entries.
+ */
+static unsigned int handle_table_hash(CK_ULONG handle)
+{
+	unsigned long h = (unsigned long) handle;
+
+	/* handles are often pointers, mix in the high bits */
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return (unsigned int) h;
+}
+
+static CK_RV handle_table_grow(struct sc_pkcs11_handle_table *table)
+{
+	struct sc_pkcs11_handle_entry *old = table->entries;
+	unsigned int old_size = table->size, size, i, j;
+
+	size = old_size ? old_size * 2 : 16;
+	table->entries = calloc(size, sizeof(struct sc_pkcs11_handle_entry));
+	if (table->entries == NULL) {
+		table->entries = old;
+		return CKR_HOST_MEMORY;
+	}
+	table->size = size;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].ptr == NULL)
+			continue;
+		for (j = handle_table_hash(old[i].handle) & (size - 1); table->entries[j].ptr != NULL;
+				j = (j + 1) & (size - 1))
+			;
+		table->entries[j] = old[i];
+	}
+	free(old);
+	return CKR_OK;
+}
+
+CK_RV handle_table_add(struct sc_pkcs11_handle_table *table, CK_ULONG handle, void *ptr)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if (ptr == NULL)
+		return CKR_ARGUMENTS_BAD;
+	/* keep the table at most half full */
+	if (2 * (table->count + 1) > table->size) {
+		rv = handle_table_grow(table);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	for (i = handle_table_hash(handle) & (table->size - 1); table->entries[i].ptr != NULL;
+			i = (i + 1) & (table->size - 1)) {
+		if (table->entries[i].handle == handle) {
+			table->entries[i].ptr = ptr;
+			return CKR_OK;
+		}
+	}
+	table->entries[i].handle = handle;
+	table->entries[i].ptr = ptr;
+	table->count++;
+	return CKR_OK;
+}
+
+void *handle_table_get(const struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	unsigned int i;
+
+	if (table->size == 0)
+		return NULL;
+	for (i = handle_table_hash(handle) & (table->size - 1); table->entries[i].ptr != NULL;
+			i = (i + 1) & (table->size - 1)) {
+		if (table->entries[i].handle == handle)
+			return table->entries[i].ptr;
+	}
+	return NULL;
+}
+
+void handle_table_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	unsigned int i, j, k, mask = table->size - 1;
+
+	if (table->size == 0)
+		return;
+	for (i = handle_table_hash(handle) & mask; table->entries[i].ptr != NULL; i = (i + 1) & mask)
+		if (table->entries[i].handle == handle)
+			break;
+	if (table->entries[i].ptr == NULL)
+		return;
+	table->count--;
+
+	/* move back the entries that would not be found after the gap */
+	for (j = (i + 1) & mask; table->entries[j].ptr != NULL; j = (j + 1) & mask) {
+		k = handle_table_hash(table->entries[j].handle) & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			table->entries[i] = table->entries[j];
+			i = j;
+		}
+	}
+	table->entries[i].handle = 0;
+	table->entries[i].ptr = NULL;
+}
+
+void handle_table_clear(struct sc_pkcs11_handle_table *table)
+{
+	free(table->entries);
+	table->entries = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
 static CK_RV sc_to_cryptoki_error_common(int rc)
 {
 	sc_log(context, "libopensc return value: %d (%s)\n", rc, sc_strerror(rc));
@@ -211,6 +325,30 @@ err:
 	return r;
 }
 
+/* Gives a slot the login states of another slot */
+CK_RV copy_login_states(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *from)
+{
+	CK_RV r = CKR_OK;
+
+	if (sc_pkcs11_conf.atomic && slot && from) {
+		if (list_iterator_start(&from->logins)) {
+			struct sc_pkcs11_login *login = list_iterator_next(&from->logins);
+			while (login) {
+				r = push_login_state(slot, login->userType,
+						login->pPin, login->ulPinLen);
+				if (r != CKR_OK)
+					break;
+				login = list_iterator_next(&from->logins);
+			}
+			list_iterator_stop(&from->logins);
+		}
+		if (r != CKR_OK)
+			pop_all_login_states(slot);
+	}
+
+	return r;
+}
+
 void pop_login_state(struct sc_pkcs11_slot *slot)
 {
 	if (slot) {
@@ -428,6 +566,7 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	scconf_block *conf_block = NULL;
 	char *unblock_style = NULL;
 	char *create_slots_for_pins = NULL, *op, *tmp;
+	const scconf_list *list;
 
 	/* Set defaults */
 	conf->max_virtual_slots = 16;
@@ -444,6 +583,7 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->num_pool_key_ids = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -485,10 +625,16 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	}
         free(tmp);
 
+	for (list = scconf_find_list(conf_block, "pool_key_ids"); list != NULL; list = list->next) {
+		if (conf->num_pool_key_ids == SC_PKCS11_MAX_POOL_KEYS)
+			break;
+		sc_pkcs15_format_id(list->data, &conf->pool_key_ids[conf->num_pool_key_ids++]);
+	}
+
 	sc_log(ctx, "PKCS#11 options: max_virtual_slots=%d slots_per_card=%d "
 		 "hide_empty_tokens=%d lock_login=%d atomic=%d pin_unblock_style=%d "
-		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X",
+		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X pool_key_ids=%u",
 		 conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->atomic, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags);
+		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags, conf->num_pool_key_ids);
 }
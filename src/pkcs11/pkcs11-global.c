@@ -34,6 +34,7 @@
 #endif
 #endif /* PKCS11_THREAD_LOCKING */
 
+#include "libopensc/cardctl.h"
 #include "sc-pkcs11.h"
 
 #ifndef MODULE_APP_NAME
@@ -43,7 +44,9 @@
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
 list_t sessions;
+struct sc_pkcs11_handle_table session_table;
 list_t virtual_slots;
+struct sc_pkcs11_handle_table slot_table;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
 #endif
@@ -138,6 +141,8 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *global_lock = NULL;
+/* C_Initialize() allowed threads of our own */
+static int global_threads = 0;
 #ifdef HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
 #else
@@ -224,6 +229,7 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 #if !defined(_WIN32)
 	/* Handle fork() exception */
 	if (current_pid != initialized_pid) {
+		slot_monitor_forget();
 		if (context)
 			context->flags |= SC_CTX_FLAG_TERMINATE;
 		C_Finalize(NULL_PTR);
@@ -284,6 +290,46 @@ out:
 	return rv;
 }
 
+/* Logs the APDU statistics of the cards still connected */
+static void dump_card_stats(void)
+{
+	struct sc_card_stats stats;
+	sc_pkcs11_slot_t *slot;
+	unsigned int i, j;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot == NULL || slot->p11card == NULL || slot->p11card->card == NULL)
+			continue;
+
+		/* several slots may share a card */
+		for (j = 0; j < i; j++) {
+			sc_pkcs11_slot_t *prev = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, j);
+
+			if (prev && prev->p11card == slot->p11card)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		if (sc_card_ctl(slot->p11card->card, SC_CARDCTL_GET_STATS, &stats) != SC_SUCCESS)
+			continue;
+
+		sc_log(context, "APDU statistics of card in reader '%s':", slot->reader->name);
+		sc_log(context, "  %lu APDUs, %llu bytes sent, %llu bytes received",
+				stats.apdus, stats.bytes_out, stats.bytes_in);
+		sc_log(context, "  %llu us in reader driver, %lu GET RESPONSE",
+				stats.transmit_usec, stats.get_response);
+		sc_log(context, "  %lu EF cache hits, %lu SELECTs elided, %lu absent files",
+				stats.ef_cache_hits, stats.selects_elided, stats.absent_hits);
+		sc_log(context, "  %lu key operations reused the security environment",
+				stats.se_reused);
+		for (j = 0; j < 256; j++)
+			if (stats.ins[j])
+				sc_log(context, "  INS %02X: %lu", j, stats.ins[j]);
+	}
+}
+
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
 	int i;
@@ -303,9 +349,12 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 
 	sc_log(context, "C_Finalize()");
 
+	dump_card_stats();
+
 	/* cancel pending calls */
 	in_finalize = 1;
 	sc_cancel(context);
+	slot_monitor_stop();
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
@@ -313,14 +362,17 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	while ((p = list_fetch(&sessions)))
 		free(p);
 	list_destroy(&sessions);
+	handle_table_clear(&session_table);
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
+		handle_table_clear(&slot->object_table);
 		pop_all_login_states(slot);
 		list_destroy(&slot->logins);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	handle_table_clear(&slot_table);
 
 	sc_release_context(context);
 	context = NULL;
@@ -369,6 +421,16 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 	return CKR_OK;
 }
 
+static int reader_removed(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++)
+		if (sc_ctx_get_reader(context, i)->flags & SC_READER_REMOVED)
+			return 1;
+	return 0;
+}
+
 CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token present */
 		    CK_SLOT_ID_PTR pSlotList,     /* receives the array of slot IDs */
 		    CK_ULONG_PTR   pulCount)      /* receives the number of slots */
@@ -378,6 +440,7 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	CK_ULONG numMatches;
 	sc_pkcs11_slot_t *slot;
 	sc_reader_t *prev_reader = NULL;
+	unsigned int nreaders;
 	CK_RV rv;
 
 	if (pulCount == NULL_PTR)
@@ -390,11 +453,23 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	sc_log(context, "C_GetSlotList(token=%d, %s)", tokenPresent,
 			pSlotList==NULL_PTR? "plug-n-play":"refresh");
 
-	/* Slot list can only change in v2.20 */
-	if (pSlotList == NULL_PTR)
-		sc_ctx_detect_readers(context);
+	if (slot_update_state() == CKR_OK) {
+		/* Readers are watched, answer from the slot state. Readers may
+		 * come and go without notification on some platforms, so check
+		 * the reader list, which does not involve the cards. */
+		if (pSlotList == NULL_PTR) {
+			nreaders = sc_ctx_get_reader_count(context);
+			sc_ctx_detect_readers(context);
+			if (nreaders != sc_ctx_get_reader_count(context) || reader_removed())
+				card_detect_all();
+		}
+	} else {
+		/* Slot list can only change in v2.20 */
+		if (pSlotList == NULL_PTR)
+			sc_ctx_detect_readers(context);
 
-	card_detect_all();
+		card_detect_all();
+	}
 
 	found = calloc(list_size(&virtual_slots), sizeof(CK_SLOT_ID));
 
@@ -411,7 +486,12 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 		 * - if present, virtual hotplug slot;
 		 * - any slot with token;
 		 * - without token(s), one empty slot per reader;
+		 * but not the other tokens of a token pool.
 		 */
+		if (slot->pool && slot->pool != slot) {
+			prev_reader = slot->reader;
+			continue;
+		}
 	        if ((!tokenPresent && !slot->reader)
 				|| (!tokenPresent && slot->reader != prev_reader)
 				|| (slot->slot_info.flags & CKF_TOKEN_PRESENT))
@@ -496,7 +576,8 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 		 * before C_GetSlotInfo, as required by PKCS#11.  Initialize
 		 * virtual_slots to make things work and hope the caller knows what
 		 * it's doing... */
-		card_detect_all();
+		if (slot_update_state() != CKR_OK)
+			card_detect_all();
 	}
 
 	rv = slot_get_slot(slotID, &slot);
@@ -505,6 +586,11 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 		if (slot->reader == NULL)   {
 			rv = CKR_TOKEN_NOT_PRESENT;
 		}
+		else if (slot_update_state() == CKR_OK) {
+			/* Up to date with the reader events */
+			if (!(slot->slot_info.flags & CKF_TOKEN_PRESENT))
+				rv = CKR_TOKEN_NOT_PRESENT;
+		}
 		else {
 			now = get_current_time();
 			if (now >= slot->slot_state_expires || now == 0) {
@@ -605,6 +691,14 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		goto out;
 	}
 
+	/* Let operations still using the card finish. The global lock is held
+	 * from now on, so the card is not used by other threads
+	 * while it is initialized. */
+	rv = sc_pkcs11_lock_card(slot->p11card);
+	if (rv != CKR_OK)
+		goto out;
+	sc_pkcs11_unlock_card(slot->p11card);
+
 	/* Make sure there's no open session for this token */
 	for (i=0; i<list_size(&sessions); i++) {
 		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
@@ -630,72 +724,64 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_SLOT_ID_PTR pSlot,  /* location that receives the slot ID */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
 {
-	sc_reader_t *found;
-	unsigned int mask, events;
-	void *reader_states = NULL;
+	unsigned int mask, events = 0, nslots;
+	unsigned long generation = 0;
+	sc_pkcs11_slot_t *slot;
 	CK_SLOT_ID slot_id;
 	CK_RV rv;
-	int r;
 
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	mask = SC_EVENT_CARD_EVENTS | SC_EVENT_READER_EVENTS;
-	/* Detect and add new slots for added readers v2.20 */
-
-	rv = slot_find_changed(&slot_id, mask);
-	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
-		goto out;
-
-again:
-	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
-	sc_pkcs11_unlock();
-	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (events & SC_EVENT_READER_ATTACHED) {
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
 
-		goto out;
-	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	for (;;) {
+		/* Take the event count before looking at the slots, so an event
+		 * arriving in between wakes us up again */
+		if (!(flags & CKF_DONT_BLOCK)) {
+			rv = slot_monitor_start(&generation);
+			if (rv != CKR_OK)
+				goto out;
+		}
 
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
+		/* Detect and add new slots for added readers v2.20 */
+		nslots = list_size(&virtual_slots);
+		if (events & SC_EVENT_READER_ATTACHED)
+			sc_ctx_detect_readers(context);
+
+		rv = slot_find_changed(&slot_id, mask);
+		if (rv != CKR_OK && list_size(&virtual_slots) > nslots) {
+			/* report the slot of the new reader */
+			slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, list_size(&virtual_slots) - 1);
+			slot_id = slot->id;
+			rv = CKR_OK;
+		}
+		if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
+			goto out;
 
-	if (r != SC_SUCCESS) {
-		sc_log(context, "sc_wait_for_event() returned %d\n",  r);
-		rv = sc_to_cryptoki_error(r, "C_WaitForSlotEvent");
-		goto out;
+		/* If no changed slot was found (maybe an unsupported card
+		 * was inserted/removed) then go waiting again */
+		sc_pkcs11_unlock();
+		rv = slot_monitor_wait(generation, &events);
+		/* Was C_Finalize called ? */
+		if (rv == CKR_CRYPTOKI_NOT_INITIALIZED || in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if (sc_pkcs11_lock() != CKR_OK)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if (rv != CKR_OK)
+			goto out;
+		sc_log(context, "C_WaitForSlotEvent() reader event 0x%02X", events);
 	}
 
-	/* If no changed slot was found (maybe an unsupported card
-	 * was inserted/removed) then go waiting again */
-	rv = slot_find_changed(&slot_id, mask);
-	if (rv != CKR_OK)
-		goto again;
-
 out:
-	if (pSlot)
+	if (pSlot && rv == CKR_OK)
 		*pSlot = slot_id;
 
-	/* Free allocated readers states holder */
-	if (reader_states)   {
-		sc_log(context, "free reader states");
-		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
-	}
-
 	sc_log(context, "C_WaitForSlotEvent() = %s", lookup_enum (RV_T, rv));
 	sc_pkcs11_unlock();
 	return rv;
@@ -715,6 +801,8 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_lock)
 		return CKR_OK;
 
+	global_threads = 0;
+
 	/* No CK_C_INITIALIZE_ARGS pointer, no locking */
 	if (!args)
 		return CKR_OK;
@@ -754,9 +842,22 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 		rv = global_locking->CreateMutex(&global_lock);
 	}
 
+	/* A thread of our own needs the global lock, and the mutexes of the
+	 * app may not work in a thread the app does not know about */
+	if (rv == CKR_OK && global_lock != NULL
+			&& !(args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)
+			&& (oslock || !applock))
+		global_threads = 1;
+
 	return rv;
 }
 
+/* Returns 1 if the library may start threads of its own */
+int sc_pkcs11_threads_allowed(void)
+{
+	return global_threads;
+}
+
 CK_RV sc_pkcs11_lock(void)
 {
 	if (context == NULL)
@@ -788,6 +889,87 @@ void sc_pkcs11_unlock(void)
 	__sc_pkcs11_unlock(global_lock);
 }
 
+/*
+ * Card locks
+ *
+ * The global lock protects the slot, session and object lists and is only
+ * held for short periods. Every card has a lock of its own that is held
+ * while the card and its objects are used, so operations on cards in
+ * different readers run in parallel.
+ *
+ * The global lock is always taken first. A thread never waits for a card
+ * lock while holding the global lock: if the card is in use, the global
+ * lock is released while waiting for the card and taken again afterwards.
+ * Callers have to look up their session again after sc_pkcs11_lock_card().
+ */
+static void
+__sc_pkcs11_lock(void *lock)
+{
+	if (!lock)
+		return;
+	if (global_locking) {
+		while (global_locking->LockMutex(lock) != CKR_OK)
+			;
+	}
+}
+
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *p11card)
+{
+	p11card->lock = NULL;
+	if (global_locking == NULL)
+		return CKR_OK;
+	return global_locking->CreateMutex(&p11card->lock);
+}
+
+/* Called with the global lock held. Returns with the global lock and the
+ * card lock held, or CKR_DEVICE_REMOVED with only the global lock held */
+CK_RV sc_pkcs11_lock_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->users++ == 0) {
+		/* nobody uses the card, so this does not block */
+		__sc_pkcs11_lock(p11card->lock);
+		return CKR_OK;
+	}
+
+	__sc_pkcs11_unlock(global_lock);
+	__sc_pkcs11_lock(p11card->lock);
+	__sc_pkcs11_lock(global_lock);
+
+	if (p11card->removed) {
+		sc_pkcs11_unlock_card(p11card);
+		return CKR_DEVICE_REMOVED;
+	}
+	return CKR_OK;
+}
+
+/* Called with the global lock held. The last user of a removed card
+ * releases its memory */
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *p11card)
+{
+	void *lock = p11card->lock;
+
+	p11card->users--;
+	__sc_pkcs11_unlock(lock);
+
+	if (p11card->removed && p11card->users == 0) {
+		if (lock && global_locking)
+			global_locking->DestroyMutex(lock);
+		free(p11card);
+	}
+}
+
+/* Release the global lock while the card lock is held for a card
+ * operation that may take long */
+void sc_pkcs11_card_io_begin(void)
+{
+	__sc_pkcs11_unlock(global_lock);
+}
+
+void sc_pkcs11_card_io_end(void)
+{
+	__sc_pkcs11_lock(global_lock);
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
@@ -802,6 +984,7 @@ void sc_pkcs11_free_lock(void)
 	/* Clear the global lock pointer - once we've
 	 * unlocked the mutex it's as good as gone */
 	global_lock = NULL;
+	global_threads = 0;
 
 	/* Now unlock. On SMP machines the synchronization
 	 * primitives should take care of flushing out
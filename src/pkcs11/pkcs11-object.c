@@ -64,27 +64,39 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 }
 
 
+/* Looks up the object and, unless p11card is NULL, takes the lock
+ * of its card */
 static CK_RV
 get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object,
+		struct sc_pkcs11_card **p11card)
 {
 	struct sc_pkcs11_session *sess;
+	struct sc_pkcs11_card *card = NULL;
 	CK_RV rv;
 
-	rv = get_session(hSession, &sess);
+	if (p11card)
+		rv = get_session_card(hSession, &sess, &card);
+	else
+		rv = get_session(hSession, &sess);
 	if (rv != CKR_OK)
 		return rv;
 
-	*object = list_seek(&sess->slot->objects, &hObject);
-	if (!*object)
+	*object = slot_get_object(sess->slot, hObject);
+	if (!*object) {
+		if (card)
+			sc_pkcs11_unlock_card(card);
 		return CKR_OBJECT_HANDLE_INVALID;
+	}
 	*session = sess;
+	if (p11card)
+		*p11card = card;
 	return CKR_OK;
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
- * So dont get the lock again. */
+ * which is holding the sc_pkcs11_lock and the card lock
+ * So dont get the locks again. */
 static
 CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
@@ -94,7 +106,8 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 {
 	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_card *card;
+	struct sc_pkcs11_card *card = NULL;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	LOG_FUNC_CALLED(context);
 	if (pTemplate == NULL_PTR || ulCount == 0)
@@ -108,11 +121,12 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	if (use_lock)
+		rv = get_session_card(hSession, &session, &p11card);
+	else
+		rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	card = session->slot->p11card;
 	if (card->framework->create_object == NULL)
@@ -121,6 +135,8 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	if (use_lock)
 		sc_pkcs11_unlock();
 	LOG_FUNC_RETURN(context, rv);
@@ -154,6 +170,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
@@ -163,7 +180,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -179,6 +196,8 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -210,6 +229,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	int j;
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	int res, res_type;
 	unsigned int i;
@@ -221,7 +241,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -257,6 +277,8 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -271,6 +293,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	unsigned int i;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pTemplate == NULL_PTR || ulCount == 0)
@@ -282,7 +305,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -302,6 +325,8 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -318,6 +343,7 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	int match, hide_private;
 	unsigned int i, j;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
@@ -329,7 +355,7 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -406,6 +432,8 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -420,6 +448,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	CK_ULONG to_return;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_find_operation *operation;
 
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
@@ -429,7 +458,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -447,7 +476,10 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
+	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -457,12 +489,13 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -470,7 +503,10 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
+	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -484,6 +520,7 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -493,11 +530,13 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -512,6 +551,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG  ulBuflen = 0;
 
 	rv = sc_pkcs11_lock();
@@ -519,7 +559,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -543,6 +583,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -555,16 +597,19 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -585,16 +630,19 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -610,6 +658,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -620,7 +669,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -647,6 +696,8 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -661,13 +712,14 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_pool_card(hSession, SC_PKCS11_OPERATION_SIGN, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -687,14 +739,18 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
 	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
+		sc_pkcs11_card_io_begin();
+		rv = restore_login_state(session_slot(session));
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
-		rv = reset_login_state(session->slot, rv);
+		rv = reset_login_state(session_slot(session), rv);
+		sc_pkcs11_card_io_end();
 	}
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		release_session_card(session, p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -707,16 +763,19 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -728,6 +787,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
 	CK_RV rv;
 
@@ -735,7 +795,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_pool_card(hSession, SC_PKCS11_OPERATION_SIGN, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -751,14 +811,18 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		*pulSignatureLen = length;
 		rv = pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
 	} else {
-		rv = restore_login_state(session->slot);
+		sc_pkcs11_card_io_begin();
+		rv = restore_login_state(session_slot(session));
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
-		rv = reset_login_state(session->slot, rv);
+		rv = reset_login_state(session_slot(session), rv);
+		sc_pkcs11_card_io_end();
 	}
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		release_session_card(session, p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -828,6 +892,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP,	&can_unwrap,	sizeof(can_unwrap) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -838,7 +903,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -869,6 +934,8 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -881,22 +948,27 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives decrypted byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_pool_card(hSession, SC_PKCS11_OPERATION_DECRYPT, &session, &p11card);
 	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
+		sc_pkcs11_card_io_begin();
+		rv = restore_login_state(session_slot(session));
 		if (rv == CKR_OK) {
 			rv = sc_pkcs11_decr(session, pEncryptedData,
 					ulEncryptedDataLen, pData, pulDataLen);
 		}
-		rv = reset_login_state(session->slot, rv);
+		rv = reset_login_state(session_slot(session), rv);
+		sc_pkcs11_card_io_end();
 	}
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		release_session_card(session, p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -973,6 +1045,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* gets priv. key handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	if (pMechanism == NULL_PTR
@@ -987,7 +1060,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1000,6 +1073,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->p11card->framework->gen_keypair == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else {
+		sc_pkcs11_card_io_begin();
 		rv = restore_login_state(slot);
 		if (rv == CKR_OK)
 			rv = slot->p11card->framework->gen_keypair(slot, pMechanism,
@@ -1007,9 +1081,12 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 					pPrivateKeyTemplate, ulPrivateKeyAttributeCount,
 					phPublicKey, phPrivateKey);
 		rv = reset_login_state(session->slot, rv);
+		sc_pkcs11_card_io_end();
 	}
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1052,6 +1129,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE derive_attribute = { CKA_DERIVE, &can_derive, sizeof(can_derive) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1062,7 +1140,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(hSession, hBaseKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1095,19 +1173,21 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object_from_session(hSession, *phKey, &session, &key_object, NULL);
 		if (rv != CKR_OK) {
 			if (rv == CKR_OBJECT_HANDLE_INVALID)
 				rv = CKR_KEY_HANDLE_INVALID;
 			goto out;
 		}
 
+		sc_pkcs11_card_io_begin();
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_deri(session, pMechanism, object, key_type,
 					hSession, *phKey, key_object);
 		/* TODO if (rv != CK_OK) need to destroy the object */
 		rv = reset_login_state(session->slot, rv);
+		sc_pkcs11_card_io_end();
 
 		break;
 	    default:
@@ -1115,6 +1195,8 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1132,21 +1214,27 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* number of bytes to be generated */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot->p11card->framework->get_random == NULL)
 			rv = CKR_RANDOM_NO_RNG;
-		else
+		else {
+			sc_pkcs11_card_io_begin();
 			rv = slot->p11card->framework->get_random(slot, RandomData, ulRandomLen);
+			sc_pkcs11_card_io_end();
+		}
 	}
 
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1172,6 +1260,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pMechanism == NULL_PTR)
@@ -1182,7 +1271,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1198,6 +1287,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 #endif
@@ -1214,12 +1305,13 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1233,6 +1325,8 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 #endif
@@ -1247,16 +1341,19 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 #endif
@@ -1271,12 +1368,13 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = get_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -1285,6 +1383,8 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 #endif
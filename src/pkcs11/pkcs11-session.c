@@ -28,12 +28,171 @@
 
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = handle_table_get(&session_table, hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
 }
 
+/* The slot whose token carries out the current operation of the session:
+ * another token of the pool or the slot of the session itself */
+struct sc_pkcs11_slot *session_slot(struct sc_pkcs11_session *session)
+{
+	return session->pool_slot ? session->pool_slot : session->slot;
+}
+
+/* Looks up the session and takes the lock of its card. On success both the
+ * global lock and the card lock are held. */
+CK_RV get_session_card(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		struct sc_pkcs11_card **p11card)
+{
+	struct sc_pkcs11_session *sess;
+	struct sc_pkcs11_card *card;
+	CK_RV rv;
+
+	rv = get_session(hSession, &sess);
+	if (rv != CKR_OK)
+		return rv;
+	card = sess->slot->p11card;
+	if (card == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	rv = sc_pkcs11_lock_card(card);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* The global lock may have been released while waiting for the card */
+	rv = get_session(hSession, &sess);
+	if (rv == CKR_OK && sess->slot->p11card != card)
+		rv = CKR_DEVICE_REMOVED;
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock_card(card);
+		return rv;
+	}
+
+	*session = sess;
+	*p11card = card;
+	return CKR_OK;
+}
+
+/* Like get_session_card(), but for a sign or decrypt operation with a key
+ * of a token pool the least used token of the pool is locked instead.
+ * session->pool_slot is set to the slot of that token. */
+CK_RV get_session_pool_card(CK_SESSION_HANDLE hSession, int type,
+		struct sc_pkcs11_session **session, struct sc_pkcs11_card **p11card)
+{
+	struct sc_pkcs11_session *sess;
+	struct sc_pkcs11_slot *head, *slot;
+	struct sc_pkcs11_object *key;
+	struct sc_pkcs11_card *card;
+	CK_RV rv;
+
+	rv = get_session(hSession, &sess);
+	if (rv != CKR_OK)
+		return rv;
+	head = sess->slot;
+	key = sc_pkcs11_operation_key(sess, type);
+	if (head->pool != head || key == NULL || !(key->flags & SC_PKCS11_OBJECT_POOLED))
+		return get_session_card(hSession, session, p11card);
+	slot = slot_pool_select(head);
+	if (slot == head)
+		return get_session_card(hSession, session, p11card);
+
+	/* Keeps the first token and its sessions from going away */
+	slot_pool_op_begin(head);
+	card = slot->p11card;
+	rv = sc_pkcs11_lock_card(card);
+	if (rv == CKR_OK) {
+		/* The global lock may have been released while waiting for the card */
+		if (get_session(hSession, &sess) == CKR_OK && sess->slot == head
+				&& slot->pool == head && slot->p11card == card) {
+			sc_log(context, "Session 0x%lx uses the token in slot 0x%lx", hSession, slot->id);
+			sess->pool_slot = slot;
+			*session = sess;
+			*p11card = card;
+			return CKR_OK;
+		}
+		sc_pkcs11_unlock_card(card);
+	}
+	slot_pool_op_end(head);
+	return get_session_card(hSession, session, p11card);
+}
+
+/* Releases the card locked by get_session_card() or get_session_pool_card() */
+void release_session_card(struct sc_pkcs11_session *session, struct sc_pkcs11_card *p11card)
+{
+	if (session && session->pool_slot) {
+		session->pool_slot = NULL;
+		slot_pool_op_end(session->slot);
+	}
+	sc_pkcs11_unlock_card(p11card);
+}
+
+/* Returns the next card of the pool to log in or out, skipping the
+ * cards tried before */
+static struct sc_pkcs11_slot *pool_next_slot(struct sc_pkcs11_slot *head, int logged_in,
+		struct sc_pkcs11_card **tried, unsigned int ntried)
+{
+	struct sc_pkcs11_slot *slot;
+	unsigned int i;
+
+	for (slot = head->pool_next; slot; slot = slot->pool_next) {
+		if (slot->p11card == NULL || (slot->login_user >= 0) != logged_in)
+			continue;
+		for (i = 0; i < ntried && tried[i] != slot->p11card; i++)
+			;
+		if (i == ntried)
+			return slot;
+	}
+	return NULL;
+}
+
+/* Logs the other tokens of a pool in or out like its first token. Called
+ * with the card of the first token locked. */
+static void pool_login(struct sc_pkcs11_slot *head, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen, int logout)
+{
+	struct sc_pkcs11_card **tried, *card;
+	struct sc_pkcs11_slot *slot;
+	unsigned int ntried = 0, max = list_size(&virtual_slots);
+	CK_RV rv;
+
+	tried = calloc(max, sizeof(*tried));
+	if (tried == NULL)
+		return;
+	while (ntried < max && (slot = pool_next_slot(head, logout, tried, ntried)) != NULL) {
+		card = slot->p11card;
+		tried[ntried++] = card;
+		if (sc_pkcs11_lock_card(card) != CKR_OK)
+			continue;
+		if (slot->pool == head && slot->p11card == card && (slot->login_user >= 0) == logout) {
+			if (logout) {
+				slot->login_user = -1;
+				if (sc_pkcs11_conf.atomic)
+					pop_all_login_states(slot);
+				else
+					card->framework->logout(slot);
+			} else {
+				rv = restore_login_state(slot);
+				if (rv == CKR_OK) {
+					sc_pkcs11_card_io_begin();
+					rv = card->framework->login(slot, userType, pPin, ulPinLen);
+					sc_pkcs11_card_io_end();
+				}
+				if (rv == CKR_OK)
+					rv = push_login_state(slot, userType, pPin, ulPinLen);
+				if (rv == CKR_OK)
+					slot->login_user = userType;
+				rv = reset_login_state(slot, rv);
+				sc_log(context, "Login to the pool token in slot 0x%lx: %s",
+						slot->id, lookup_enum(RV_T, rv));
+			}
+		}
+		sc_pkcs11_unlock_card(card);
+	}
+	free(tried);
+}
+
 CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_FLAGS flags,	/* defined in CK_SESSION_INFO */
 		    CK_VOID_PTR pApplication,	/* pointer passed to callback */
@@ -76,8 +235,13 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
-	slot->nsessions++;
 	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
+	rv = handle_table_add(&session_table, session->handle, session);
+	if (rv != CKR_OK) {
+		free(session);
+		goto out;
+	}
+	slot->nsessions++;
 	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
@@ -97,7 +261,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = handle_table_get(&session_table, hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -113,12 +277,35 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 			slot->p11card->framework->logout(slot);
 	}
 
+	handle_table_remove(&session_table, hSession);
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
 	free(session);
 	return CKR_OK;
 }
 
+/* Hands the sessions of a token leaving a pool over to the token that
+ * presents the pool now. Operations in progress are cancelled, since
+ * they use the objects of the old token. Called with the global lock held */
+void sc_pkcs11_move_sessions(struct sc_pkcs11_slot *from, struct sc_pkcs11_slot *to)
+{
+	struct sc_pkcs11_session *session;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < list_size(&sessions); i++) {
+		session = list_get_at(&sessions, i);
+		if (session->slot != from)
+			continue;
+		for (j = 0; j < SC_PKCS11_OPERATION_MAX; j++)
+			session_stop_operation(session, j);
+		session->slot = to;
+		from->nsessions--;
+		to->nsessions++;
+		sc_log(context, "Session 0x%lx moved to slot 0x%lx", session->handle, to->id);
+	}
+}
+
 /* Internal version of C_CloseAllSessions that gets called with
  * the global lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
@@ -139,6 +326,8 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -146,7 +335,11 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+	rv = get_session_card(hSession, &session, &p11card);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_close_session(hSession);
+		sc_pkcs11_unlock_card(p11card);
+	}
 
 	sc_pkcs11_unlock();
 	return rv;
@@ -156,6 +349,7 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -167,7 +361,16 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = slot->p11card;
+	if (p11card == NULL) {
+		rv = sc_pkcs11_close_all_sessions(slotID);
+		goto out;
+	}
+	rv = sc_pkcs11_lock_card(p11card);
+	if (rv != CKR_OK)
+		goto out;
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_unlock_card(p11card);
 
 out:
 	sc_pkcs11_unlock();
@@ -190,7 +393,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = handle_table_get(&session_table, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -242,6 +445,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
@@ -254,11 +458,9 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
@@ -276,8 +478,11 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		}
 		else   {
 			rv = restore_login_state(slot);
-			if (rv == CKR_OK)
+			if (rv == CKR_OK) {
+				sc_pkcs11_card_io_begin();
 				rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
+				sc_pkcs11_card_io_end();
+			}
 			rv = reset_login_state(slot, rv);
 		}
 	}
@@ -294,7 +499,9 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = restore_login_state(slot);
 		if (rv == CKR_OK) {
 			sc_log(context, "C_Login() userType %li", userType);
+			sc_pkcs11_card_io_begin();
 			rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
+			sc_pkcs11_card_io_end();
 			sc_log(context, "fLogin() rv %li", rv);
 		}
 		if (rv == CKR_OK)
@@ -303,9 +510,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			slot->login_user = userType;
 		}
 		rv = reset_login_state(slot, rv);
+		if (rv == CKR_OK && slot->pool == slot)
+			pool_login(slot, userType, pPin, ulPinLen, 0);
 	}
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -315,16 +526,15 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
@@ -336,10 +546,14 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 			pop_all_login_states(slot);
 		else
 			rv = slot->p11card->framework->logout(slot);
+		if (slot->pool == slot)
+			pool_login(slot, 0, NULL, 0, 1);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -349,6 +563,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	sc_log(context, "C_InitPIN() called, pin '%s'", pPin ? (char *) pPin : "<null>");
 	if (pPin == NULL_PTR && ulPinLen > 0)
@@ -358,11 +573,9 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
@@ -384,6 +597,8 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -394,6 +609,7 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
@@ -402,11 +618,9 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
@@ -422,6 +636,8 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	rv = reset_login_state(slot, rv);
 
 out:
+	if (p11card)
+		sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
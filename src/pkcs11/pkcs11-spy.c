@@ -30,6 +30,11 @@
 #include <sys/time.h>
 #include <time.h>
 #endif
+#include <stddef.h>
+#include <string.h>
+#ifdef HAVE_SIGACTION
+#include <signal.h>
+#endif
 
 #define CRYPTOKI_EXPORTS
 #include "pkcs11-display.h"
@@ -50,6 +55,12 @@ static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
 
+static void init_spy_timing(void);
+static CK_RV timed_C_Initialize(CK_VOID_PTR pInitArgs);
+static CK_RV timed_C_Finalize(CK_VOID_PTR pReserved);
+static int spy_timing_enabled;
+static CK_FUNCTION_LIST spy_timing_list;
+
 /* Inits the spy. If successfull, po != NULL */
 static CK_RV
 init_spy(void)
@@ -224,6 +235,8 @@ init_spy(void)
 	modhandle = C_LoadModule(module, &po);
 	if (modhandle && po) {
 		fprintf(spy_output, "Loaded: \"%s\"\n", module);
+		if (getenv("PKCS11SPY_TIMING"))
+			init_spy_timing();
 	}
 	else {
 		po = NULL;
@@ -347,6 +360,11 @@ CK_RV C_GetFunctionList
 			return rv;
 	}
 
+	if (spy_timing_enabled) {
+		*ppFunctionList = &spy_timing_list;
+		return CKR_OK;
+	}
+
 	enter("C_GetFunctionList");
 	*ppFunctionList = pkcs11_spy;
 	return retne(CKR_OK);
@@ -363,6 +381,9 @@ C_Initialize(CK_VOID_PTR pInitArgs)
 			return rv;
 	}
 
+	if (spy_timing_enabled)
+		return timed_C_Initialize(pInitArgs);
+
 	enter("C_Initialize");
 	print_ptr_in("pInitArgs", pInitArgs);
 
@@ -384,6 +405,9 @@ C_Finalize(CK_VOID_PTR pReserved)
 {
 	CK_RV rv;
 
+	if (spy_timing_enabled)
+		return timed_C_Finalize(pReserved);
+
 	enter("C_Finalize");
 	rv = po->C_Finalize(pReserved);
 	return retne(rv);
@@ -1346,3 +1370,389 @@ C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved)
 	rv = po->C_WaitForSlotEvent(flags, pSlot, pRserved);
 	return retne(rv);
 }
+
+/*
+ * Timing mode
+ *
+ * With PKCS11SPY_TIMING set, the function list handed out by
+ * C_GetFunctionList() times every call to the real module instead of
+ * dumping it. The latencies are collected in per-function histograms
+ * updated with atomic operations only, and the summary is written at
+ * C_Finalize() or, on Unix, at the first call after SIGUSR1.
+ */
+
+/* Histogram buckets: exact below 8 us, then 8 buckets per power of two */
+#define SPY_BUCKETS		(((sizeof(unsigned long) * 8) - 2) * 8)
+#define SPY_FUNCTIONS		(sizeof(CK_FUNCTION_LIST) / sizeof(CK_C_Initialize))
+#define SPY_INDEX(name)		(offsetof(CK_FUNCTION_LIST, name) / sizeof(CK_C_Initialize))
+
+#if defined(_WIN32)
+#define spy_atomic_inc(p)	InterlockedIncrement((LONG volatile *)(p))
+#define spy_atomic_cas(p, o, n)	(InterlockedCompareExchange((LONG volatile *)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#elif defined(__GNUC__)
+#define spy_atomic_inc(p)	__sync_fetch_and_add((p), 1)
+#define spy_atomic_cas(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#else
+#define spy_atomic_inc(p)	(++*(p))
+#define spy_atomic_cas(p, o, n)	(*(p) == (o) ? (*(p) = (n), 1) : 0)
+#endif
+
+struct spy_timing {
+	const char *name;
+	volatile unsigned long count;
+	volatile unsigned long max;
+	volatile unsigned long buckets[SPY_BUCKETS];
+};
+
+static struct spy_timing spy_timings[SPY_FUNCTIONS];
+static volatile unsigned long spy_timing_requested = 0;
+
+static unsigned long
+spy_time_usec(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long) (now.QuadPart / freq.QuadPart * 1000000
+			+ now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	/* durations must not jump when the wall clock is adjusted */
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned int
+spy_bucket(unsigned long usec)
+{
+	unsigned int shift = 0;
+
+	if (usec < 8)
+		return usec;
+	while ((usec >> shift) > 15)
+		shift++;
+	return (shift + 1) * 8 + ((usec >> shift) & 7);
+}
+
+/* Returns the largest value falling into the bucket */
+static unsigned long
+spy_bucket_value(unsigned int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+	return ((8UL + bucket % 8 + 1) << (bucket / 8 - 1)) - 1;
+}
+
+static unsigned long
+spy_percentile(const struct spy_timing *t, unsigned long count, unsigned int percent)
+{
+	unsigned long seen = 0, rank = (count * percent + 99) / 100;
+	unsigned int i;
+
+	for (i = 0; i < SPY_BUCKETS; i++) {
+		seen += t->buckets[i];
+		if (seen >= rank)
+			return spy_bucket_value(i) < t->max ? spy_bucket_value(i) : t->max;
+	}
+	return t->max;
+}
+
+static void
+spy_timing_report(void)
+{
+	unsigned int i;
+
+	fprintf(spy_output, "\n%-24s %10s %10s %10s %10s %10s\n",
+			"Function (usec)", "calls", "p50", "p90", "p99", "max");
+	for (i = 0; i < SPY_FUNCTIONS; i++) {
+		const struct spy_timing *t = &spy_timings[i];
+		unsigned long count = t->count;
+
+		if (count == 0)
+			continue;
+		fprintf(spy_output, "%-24s %10lu %10lu %10lu %10lu %10lu\n", t->name, count,
+				spy_percentile(t, count, 50), spy_percentile(t, count, 90),
+				spy_percentile(t, count, 99), t->max);
+	}
+	fflush(spy_output);
+}
+
+static void
+spy_timing_record(unsigned int idx, const char *name, unsigned long start)
+{
+	struct spy_timing *t = &spy_timings[idx];
+	unsigned long usec = spy_time_usec() - start;
+	unsigned long max;
+
+	t->name = name;
+	spy_atomic_inc(&t->buckets[spy_bucket(usec)]);
+	spy_atomic_inc(&t->count);
+	while ((max = t->max) < usec && !spy_atomic_cas(&t->max, max, usec))
+		;
+
+	if (spy_timing_requested && spy_atomic_cas(&spy_timing_requested, 1, 0))
+		spy_timing_report();
+}
+
+#ifdef HAVE_SIGACTION
+static void
+spy_timing_signal(int sig)
+{
+	spy_timing_requested = 1;
+}
+#endif
+
+#define SPY_TIMED(name, params, args)				\
+static CK_RV							\
+timed_##name params						\
+{								\
+	unsigned long start = spy_time_usec();			\
+	CK_RV rv = po->name args;				\
+	spy_timing_record(SPY_INDEX(name), #name, start);	\
+	return rv;						\
+}
+
+SPY_TIMED(C_Initialize, (CK_VOID_PTR pInitArgs), (pInitArgs))
+
+static CK_RV
+timed_C_Finalize(CK_VOID_PTR pReserved)
+{
+	unsigned long start = spy_time_usec();
+	CK_RV rv = po->C_Finalize(pReserved);
+
+	spy_timing_record(SPY_INDEX(C_Finalize), "C_Finalize", start);
+	spy_timing_report();
+	return rv;
+}
+
+SPY_TIMED(C_GetInfo, (CK_INFO_PTR pInfo),
+		(pInfo))
+SPY_TIMED(C_GetSlotList, (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount),
+		(tokenPresent, pSlotList, pulCount))
+SPY_TIMED(C_GetSlotInfo, (CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo),
+		(slotID, pInfo))
+SPY_TIMED(C_GetTokenInfo, (CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo),
+		(slotID, pInfo))
+SPY_TIMED(C_GetMechanismList, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount),
+		(slotID, pMechanismList, pulCount))
+SPY_TIMED(C_GetMechanismInfo, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo),
+		(slotID, type, pInfo))
+SPY_TIMED(C_InitToken, (CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel),
+		(slotID, pPin, ulPinLen, pLabel))
+SPY_TIMED(C_InitPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+		(hSession, pPin, ulPinLen))
+SPY_TIMED(C_SetPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen),
+		(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen))
+SPY_TIMED(C_OpenSession, (CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession),
+		(slotID, flags, pApplication, Notify, phSession))
+SPY_TIMED(C_CloseSession, (CK_SESSION_HANDLE hSession),
+		(hSession))
+SPY_TIMED(C_CloseAllSessions, (CK_SLOT_ID slotID),
+		(slotID))
+SPY_TIMED(C_GetSessionInfo, (CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
+		(hSession, pInfo))
+SPY_TIMED(C_GetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen),
+		(hSession, pOperationState, pulOperationStateLen))
+SPY_TIMED(C_SetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey),
+		(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey))
+SPY_TIMED(C_Login, (CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+		(hSession, userType, pPin, ulPinLen))
+SPY_TIMED(C_Logout, (CK_SESSION_HANDLE hSession),
+		(hSession))
+SPY_TIMED(C_CreateObject, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject),
+		(hSession, pTemplate, ulCount, phObject))
+SPY_TIMED(C_CopyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject),
+		(hSession, hObject, pTemplate, ulCount, phNewObject))
+SPY_TIMED(C_DestroyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+		(hSession, hObject))
+SPY_TIMED(C_GetObjectSize, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize),
+		(hSession, hObject, pulSize))
+SPY_TIMED(C_GetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+		(hSession, hObject, pTemplate, ulCount))
+SPY_TIMED(C_SetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+		(hSession, hObject, pTemplate, ulCount))
+SPY_TIMED(C_FindObjectsInit, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+		(hSession, pTemplate, ulCount))
+SPY_TIMED(C_FindObjects, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount),
+		(hSession, phObject, ulMaxObjectCount, pulObjectCount))
+SPY_TIMED(C_FindObjectsFinal, (CK_SESSION_HANDLE hSession),
+		(hSession))
+SPY_TIMED(C_EncryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_Encrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen),
+		(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen))
+SPY_TIMED(C_EncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_TIMED(C_EncryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen),
+		(hSession, pLastEncryptedPart, pulLastEncryptedPartLen))
+SPY_TIMED(C_DecryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_Decrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+		(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen))
+SPY_TIMED(C_DecryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_TIMED(C_DecryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen),
+		(hSession, pLastPart, pulLastPartLen))
+SPY_TIMED(C_DigestInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism),
+		(hSession, pMechanism))
+SPY_TIMED(C_Digest, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+		(hSession, pData, ulDataLen, pDigest, pulDigestLen))
+SPY_TIMED(C_DigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+		(hSession, pPart, ulPartLen))
+SPY_TIMED(C_DigestKey, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey),
+		(hSession, hKey))
+SPY_TIMED(C_DigestFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+		(hSession, pDigest, pulDigestLen))
+SPY_TIMED(C_SignInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_Sign, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+		(hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+SPY_TIMED(C_SignUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+		(hSession, pPart, ulPartLen))
+SPY_TIMED(C_SignFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+		(hSession, pSignature, pulSignatureLen))
+SPY_TIMED(C_SignRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_SignRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+		(hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+SPY_TIMED(C_VerifyInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_Verify, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+		(hSession, pData, ulDataLen, pSignature, ulSignatureLen))
+SPY_TIMED(C_VerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+		(hSession, pPart, ulPartLen))
+SPY_TIMED(C_VerifyFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+		(hSession, pSignature, ulSignatureLen))
+SPY_TIMED(C_VerifyRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+		(hSession, pMechanism, hKey))
+SPY_TIMED(C_VerifyRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+		(hSession, pSignature, ulSignatureLen, pData, pulDataLen))
+SPY_TIMED(C_DigestEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_TIMED(C_DecryptDigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_TIMED(C_SignEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_TIMED(C_DecryptVerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_TIMED(C_GenerateKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey),
+		(hSession, pMechanism, pTemplate, ulCount, phKey))
+SPY_TIMED(C_GenerateKeyPair, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey),
+		(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey))
+SPY_TIMED(C_WrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen),
+		(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen))
+SPY_TIMED(C_UnwrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+		(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulAttributeCount, phKey))
+SPY_TIMED(C_DeriveKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+		(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey))
+SPY_TIMED(C_SeedRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen),
+		(hSession, pSeed, ulSeedLen))
+SPY_TIMED(C_GenerateRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen),
+		(hSession, RandomData, ulRandomLen))
+SPY_TIMED(C_GetFunctionStatus, (CK_SESSION_HANDLE hSession),
+		(hSession))
+SPY_TIMED(C_CancelFunction, (CK_SESSION_HANDLE hSession),
+		(hSession))
+SPY_TIMED(C_WaitForSlotEvent, (CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved),
+		(flags, pSlot, pRserved))
+
+static void
+init_spy_timing(void)
+{
+#ifdef HAVE_SIGACTION
+	struct sigaction sa;
+
+	/* do not take over a handler installed by the application */
+	if (sigaction(SIGUSR1, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = spy_timing_signal;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+#endif
+
+	spy_timing_list.version = pkcs11_spy->version;
+	spy_timing_list.C_GetFunctionList = C_GetFunctionList;
+	spy_timing_list.C_Initialize = timed_C_Initialize;
+	spy_timing_list.C_Finalize = timed_C_Finalize;
+	spy_timing_list.C_GetInfo = timed_C_GetInfo;
+	spy_timing_list.C_GetSlotList = timed_C_GetSlotList;
+	spy_timing_list.C_GetSlotInfo = timed_C_GetSlotInfo;
+	spy_timing_list.C_GetTokenInfo = timed_C_GetTokenInfo;
+	spy_timing_list.C_GetMechanismList = timed_C_GetMechanismList;
+	spy_timing_list.C_GetMechanismInfo = timed_C_GetMechanismInfo;
+	spy_timing_list.C_InitToken = timed_C_InitToken;
+	spy_timing_list.C_InitPIN = timed_C_InitPIN;
+	spy_timing_list.C_SetPIN = timed_C_SetPIN;
+	spy_timing_list.C_OpenSession = timed_C_OpenSession;
+	spy_timing_list.C_CloseSession = timed_C_CloseSession;
+	spy_timing_list.C_CloseAllSessions = timed_C_CloseAllSessions;
+	spy_timing_list.C_GetSessionInfo = timed_C_GetSessionInfo;
+	spy_timing_list.C_GetOperationState = timed_C_GetOperationState;
+	spy_timing_list.C_SetOperationState = timed_C_SetOperationState;
+	spy_timing_list.C_Login = timed_C_Login;
+	spy_timing_list.C_Logout = timed_C_Logout;
+	spy_timing_list.C_CreateObject = timed_C_CreateObject;
+	spy_timing_list.C_CopyObject = timed_C_CopyObject;
+	spy_timing_list.C_DestroyObject = timed_C_DestroyObject;
+	spy_timing_list.C_GetObjectSize = timed_C_GetObjectSize;
+	spy_timing_list.C_GetAttributeValue = timed_C_GetAttributeValue;
+	spy_timing_list.C_SetAttributeValue = timed_C_SetAttributeValue;
+	spy_timing_list.C_FindObjectsInit = timed_C_FindObjectsInit;
+	spy_timing_list.C_FindObjects = timed_C_FindObjects;
+	spy_timing_list.C_FindObjectsFinal = timed_C_FindObjectsFinal;
+	spy_timing_list.C_EncryptInit = timed_C_EncryptInit;
+	spy_timing_list.C_Encrypt = timed_C_Encrypt;
+	spy_timing_list.C_EncryptUpdate = timed_C_EncryptUpdate;
+	spy_timing_list.C_EncryptFinal = timed_C_EncryptFinal;
+	spy_timing_list.C_DecryptInit = timed_C_DecryptInit;
+	spy_timing_list.C_Decrypt = timed_C_Decrypt;
+	spy_timing_list.C_DecryptUpdate = timed_C_DecryptUpdate;
+	spy_timing_list.C_DecryptFinal = timed_C_DecryptFinal;
+	spy_timing_list.C_DigestInit = timed_C_DigestInit;
+	spy_timing_list.C_Digest = timed_C_Digest;
+	spy_timing_list.C_DigestUpdate = timed_C_DigestUpdate;
+	spy_timing_list.C_DigestKey = timed_C_DigestKey;
+	spy_timing_list.C_DigestFinal = timed_C_DigestFinal;
+	spy_timing_list.C_SignInit = timed_C_SignInit;
+	spy_timing_list.C_Sign = timed_C_Sign;
+	spy_timing_list.C_SignUpdate = timed_C_SignUpdate;
+	spy_timing_list.C_SignFinal = timed_C_SignFinal;
+	spy_timing_list.C_SignRecoverInit = timed_C_SignRecoverInit;
+	spy_timing_list.C_SignRecover = timed_C_SignRecover;
+	spy_timing_list.C_VerifyInit = timed_C_VerifyInit;
+	spy_timing_list.C_Verify = timed_C_Verify;
+	spy_timing_list.C_VerifyUpdate = timed_C_VerifyUpdate;
+	spy_timing_list.C_VerifyFinal = timed_C_VerifyFinal;
+	spy_timing_list.C_VerifyRecoverInit = timed_C_VerifyRecoverInit;
+	spy_timing_list.C_VerifyRecover = timed_C_VerifyRecover;
+	spy_timing_list.C_DigestEncryptUpdate = timed_C_DigestEncryptUpdate;
+	spy_timing_list.C_DecryptDigestUpdate = timed_C_DecryptDigestUpdate;
+	spy_timing_list.C_SignEncryptUpdate = timed_C_SignEncryptUpdate;
+	spy_timing_list.C_DecryptVerifyUpdate = timed_C_DecryptVerifyUpdate;
+	spy_timing_list.C_GenerateKey = timed_C_GenerateKey;
+	spy_timing_list.C_GenerateKeyPair = timed_C_GenerateKeyPair;
+	spy_timing_list.C_WrapKey = timed_C_WrapKey;
+	spy_timing_list.C_UnwrapKey = timed_C_UnwrapKey;
+	spy_timing_list.C_DeriveKey = timed_C_DeriveKey;
+	spy_timing_list.C_SeedRandom = timed_C_SeedRandom;
+	spy_timing_list.C_GenerateRandom = timed_C_GenerateRandom;
+	spy_timing_list.C_GetFunctionStatus = timed_C_GetFunctionStatus;
+	spy_timing_list.C_CancelFunction = timed_C_CancelFunction;
+	spy_timing_list.C_WaitForSlotEvent = timed_C_WaitForSlotEvent;
+
+	spy_timing_enabled = 1;
+	fprintf(spy_output, "Timing mode: call latencies are reported at C_Finalize\n");
+}
@@ -53,6 +53,8 @@ extern "C" {
 
 #define SC_PKCS11_SLOT_FOR_PINS		(SC_PKCS11_SLOT_FOR_PIN_USER | SC_PKCS11_SLOT_FOR_PIN_SIGN)
 
+#define SC_PKCS11_MAX_POOL_KEYS		8
+
 extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
 extern CK_RV C_UnloadModule(void *module);
 
@@ -86,6 +88,9 @@ struct sc_pkcs11_config {
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	/* Tokens holding private keys with all these IDs form a pool */
+	struct sc_pkcs15_id pool_key_ids[SC_PKCS11_MAX_POOL_KEYS];
+	unsigned int num_pool_key_ids;
 };
 
 /*
@@ -138,6 +143,7 @@ struct sc_pkcs11_object {
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+#define SC_PKCS11_OBJECT_POOLED	0x0004	/* held by every token of the pool */
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -203,6 +209,24 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+
+	/* Held while the card is used, see sc_pkcs11_lock_card() */
+	void *lock;
+	unsigned int users;
+	int removed;
+};
+
+/* Hash table from a session, slot or object handle to the structure it
+ * refers to */
+struct sc_pkcs11_handle_entry {
+	CK_ULONG handle;
+	void *ptr;
+};
+
+struct sc_pkcs11_handle_table {
+	struct sc_pkcs11_handle_entry *entries;
+	unsigned int size;		/* power of two, or 0 */
+	unsigned int count;
 };
 
 struct sc_pkcs11_slot {
@@ -215,12 +239,17 @@ struct sc_pkcs11_slot {
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
 	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_handle_table object_table;	/* Objects by handle */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
+	int detect_failed;		/* card_detect() failed, see slot_update_state() */
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application assosiated to slot */
 	list_t logins;			/* tracks all calls to C_Login if atomic operations are requested */
+	struct sc_pkcs11_slot *pool;	/* First slot of the token pool, see pool_key_ids */
+	struct sc_pkcs11_slot *pool_next;	/* Next slot in the token pool */
+	unsigned int pool_ops;		/* Operations of our sessions running on other tokens of the pool */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -317,6 +346,8 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Slot of the pool doing the current key operation */
+	struct sc_pkcs11_slot *pool_slot;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
@@ -324,7 +355,9 @@ typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
 extern list_t sessions;
+extern struct sc_pkcs11_handle_table session_table;
 extern list_t virtual_slots;
+extern struct sc_pkcs11_handle_table slot_table;
 extern list_t cards;
 
 /* Framework definitions */
@@ -332,6 +365,10 @@ extern struct sc_pkcs11_framework_ops framework_pkcs15;
 extern struct sc_pkcs11_framework_ops framework_pkcs15init;
 
 void strcpy_bp(u8 *dst, const char *src, size_t dstsize);
+CK_RV handle_table_add(struct sc_pkcs11_handle_table *, CK_ULONG, void *);
+void *handle_table_get(const struct sc_pkcs11_handle_table *, CK_ULONG);
+void handle_table_remove(struct sc_pkcs11_handle_table *, CK_ULONG);
+void handle_table_clear(struct sc_pkcs11_handle_table *);
 CK_RV sc_to_cryptoki_error(int rc, const char *ctx);
 void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const char *function,
 		const char *info, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
@@ -350,17 +387,38 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+CK_RV slot_monitor_start(unsigned long *generation);
+CK_RV slot_monitor_wait(unsigned long generation, unsigned int *events);
+void slot_monitor_stop(void);
+void slot_monitor_forget(void);
+CK_RV slot_update_state(void);
+void slot_pool_join(struct sc_pkcs11_slot *);
+void slot_pool_leave(struct sc_pkcs11_slot *);
+void slot_pool_op_begin(struct sc_pkcs11_slot *);
+void slot_pool_op_end(struct sc_pkcs11_slot *);
+void slot_pool_wait(struct sc_pkcs11_slot *);
+struct sc_pkcs11_slot *slot_pool_select(struct sc_pkcs11_slot *);
 
 /* Login tracking functions */
 CK_RV restore_login_state(struct sc_pkcs11_slot *slot);
 CK_RV reset_login_state(struct sc_pkcs11_slot *slot, CK_RV rv);
 CK_RV push_login_state(struct sc_pkcs11_slot *slot,
 		CK_USER_TYPE userType, CK_CHAR_PTR pPin, CK_ULONG ulPinLen);
+CK_RV copy_login_states(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *from);
 void pop_login_state(struct sc_pkcs11_slot *slot);
 void pop_all_login_states(struct sc_pkcs11_slot *slot);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+struct sc_pkcs11_slot *session_slot(struct sc_pkcs11_session *session);
+CK_RV get_session_card(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session,
+		struct sc_pkcs11_card ** p11card);
+CK_RV get_session_pool_card(CK_SESSION_HANDLE hSession, int type,
+		struct sc_pkcs11_session ** session, struct sc_pkcs11_card ** p11card);
+void release_session_card(struct sc_pkcs11_session *session, struct sc_pkcs11_card *p11card);
 CK_RV session_start_operation(struct sc_pkcs11_session *,
 			int, sc_pkcs11_mechanism_type_t *,
 			struct sc_pkcs11_operation **);
@@ -368,6 +426,7 @@ CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
+void sc_pkcs11_move_sessions(struct sc_pkcs11_slot *, struct sc_pkcs11_slot *);
 
 /* Generic secret key stuff */
 CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
@@ -410,6 +469,7 @@ CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+struct sc_pkcs11_object *sc_pkcs11_operation_key(struct sc_pkcs11_session *, int);
 CK_RV sc_pkcs11_deri(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_KEY_TYPE,
 				CK_SESSION_HANDLE, CK_OBJECT_HANDLE, struct sc_pkcs11_object *);
@@ -445,6 +505,12 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+int sc_pkcs11_threads_allowed(void);
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_card_io_begin(void);
+void sc_pkcs11_card_io_end(void);
 
 #ifdef __cplusplus
 }
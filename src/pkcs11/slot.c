@@ -24,6 +24,18 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(PKCS11_THREAD_LOCKING) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+#define SLOT_MONITOR_THREAD
+#define SLOT_POOL_COND
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -87,6 +99,11 @@ CK_RV create_slot(sc_reader_t *reader)
 	list_append(&virtual_slots, slot);
 	slot->login_user = -1;
 	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
+	if (handle_table_add(&slot_table, slot->id, slot) != CKR_OK) {
+		list_delete(&virtual_slots, slot);
+		free(slot);
+		return CKR_HOST_MEMORY;
+	}
 	sc_log(context, "Creating slot with id 0x%lx", slot->id);
 
 	list_init(&slot->objects);
@@ -109,20 +126,20 @@ CK_RV create_slot(sc_reader_t *reader)
 void delete_slot(struct sc_pkcs11_slot *slot)
 {
 	if (slot) {
+		slot_pool_leave(slot);
 		list_destroy(&slot->objects);
+		handle_table_clear(&slot->object_table);
 		list_destroy(&slot->logins);
+		if (handle_table_get(&slot_table, slot->id) == slot)
+			handle_table_remove(&slot_table, slot->id);
 		list_delete(&virtual_slots, slot);
 		free(slot);
 	}
 }
 
 
-/* create slots associated with a reader, called whenever a reader is seen. */
-CK_RV initialize_reader(sc_reader_t *reader)
+static int reader_ignored(sc_reader_t *reader)
 {
-	unsigned int i;
-	CK_RV rv;
-
 	scconf_block *conf_block = NULL;
 	const scconf_list *list = NULL;
 
@@ -132,22 +149,58 @@ CK_RV initialize_reader(sc_reader_t *reader)
 		while (list != NULL) {
 			if (strstr(reader->name, list->data) != NULL) {
 				sc_log(context, "Ignoring reader \'%s\' because of \'%s\'\n", reader->name, list->data);
-				return CKR_OK;
+				return 1;
 			}
 			list = list->next;
 		}
 	}
+	return 0;
+}
+
+static CK_RV create_reader_slots(sc_reader_t *reader)
+{
+	unsigned int i;
+	CK_RV rv;
 
 	for (i = 0; i < sc_pkcs11_conf.slots_per_card; i++) {
 		rv = create_slot(reader);
 		if (rv != CKR_OK)
 			return rv;
 	}
+	return CKR_OK;
+}
+
+/* Remembers whether the state of the card in the reader is known. An
+ * absent or unsupported card is a known state, other errors are not. */
+static void reader_detect_result(sc_reader_t *reader, CK_RV rv)
+{
+	unsigned int i;
+	int failed = rv != CKR_OK && rv != CKR_TOKEN_NOT_PRESENT
+		&& rv != CKR_TOKEN_NOT_RECOGNIZED;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader)
+			slot->detect_failed = failed;
+	}
+}
+
+/* create slots associated with a reader, called whenever a reader is seen. */
+CK_RV initialize_reader(sc_reader_t *reader)
+{
+	CK_RV rv;
+
+	if (reader_ignored(reader))
+		return CKR_OK;
+
+	rv = create_reader_slots(reader);
+	if (rv != CKR_OK)
+		return rv;
 
 	sc_log(context, "Initialize reader '%s': detect SC card presence", reader->name);
 	if (sc_detect_card_presence(reader))   {
 		sc_log(context, "Initialize reader '%s': detect PKCS11 card presence", reader->name);
-		card_detect(reader);
+		reader_detect_result(reader, card_detect(reader));
 	}
 
 	sc_log(context, "Reader '%s' initialized", reader->name);
@@ -163,17 +216,41 @@ CK_RV card_removed(sc_reader_t * reader)
 	sc_log(context, "%s: card removed", reader->name);
 
 
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader && slot->p11card) {
+			p11card = slot->p11card;
+			break;
+		}
+	}
+
+	/* Wait until nobody uses the card. The card is not freed before the
+	 * last thread waiting for it has seen that it was removed. */
+	if (p11card && sc_pkcs11_lock_card(p11card) != CKR_OK)
+		return CKR_OK;
+
+	/* Sessions of a token pool may still use the other tokens */
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
 		if (slot->reader == reader) {
-			/* Save the "card" object */
-			if (slot->p11card)
-				p11card = slot->p11card;
-			slot_token_removed(slot->id);
+			struct sc_pkcs11_slot *next = slot->pool == slot ? slot->pool_next : NULL;
+
+			slot_pool_leave(slot);
+			slot_pool_wait(slot);
+			/* the sessions stay with the pool */
+			if (next)
+				sc_pkcs11_move_sessions(slot, next);
 		}
 	}
 
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader)
+			slot_token_removed(slot->id);
+	}
+
 	if (p11card) {
+		p11card->removed = 1;
 		p11card->framework->unbind(p11card);
 		sc_disconnect_card(p11card->card);
 		for (i=0; i < p11card->nmechanisms; ++i) {
@@ -183,7 +260,7 @@ CK_RV card_removed(sc_reader_t * reader)
 			free(p11card->mechanisms[i]);
 		}
 		free(p11card->mechanisms);
-		free(p11card);
+		sc_pkcs11_unlock_card(p11card);
 	}
 
 	return CKR_OK;
@@ -242,6 +319,11 @@ again:
 		if (!p11card)
 			return CKR_HOST_MEMORY;
 		p11card->reader = reader;
+		rv = sc_pkcs11_init_card_lock(p11card);
+		if (rv != CKR_OK) {
+			free(p11card);
+			return rv;
+		}
 	}
 
 	if (p11card->card == NULL) {
@@ -351,7 +433,7 @@ card_detect_all(void)
 			if (!reader_get_slot(reader))
 				initialize_reader(reader);
 			else
-				card_detect(sc_ctx_get_reader(context, i));
+				reader_detect_result(reader, card_detect(reader));
 		}
 	}
 	sc_log(context, "All cards detected");
@@ -384,7 +466,7 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	*slot = handle_table_get(&slot_table, id);
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
@@ -428,6 +510,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 		return rv;
 
 	token_was_present = (slot->slot_info.flags & CKF_TOKEN_PRESENT);
+	slot_pool_leave(slot);
 
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
@@ -436,6 +519,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	handle_table_clear(&slot->object_table);
 
 	/* Release framework stuff */
 	if (slot->p11card != NULL) {
@@ -457,6 +541,32 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	CK_RV rv;
+
+	rv = handle_table_add(&slot->object_table, object->handle, object);
+	if (rv != CKR_OK)
+		return rv;
+	if (list_append(&slot->objects, object) < 0) {
+		handle_table_remove(&slot->object_table, object->handle);
+		return CKR_HOST_MEMORY;
+	}
+	return CKR_OK;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	if (handle_table_get(&slot->object_table, object->handle) == object)
+		handle_table_remove(&slot->object_table, object->handle);
+	list_delete(&slot->objects, object);
+}
+
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	return handle_table_get(&slot->object_table, handle);
+}
+
 /* Called from C_WaitForSlotEvent */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
@@ -482,3 +592,426 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * Token pools
+ *
+ * Tokens holding private keys with all IDs listed in 'pool_key_ids' are
+ * presented as a single slot, the slot of the first such token. Sign and
+ * decrypt operations with these keys are spread over the tokens of the
+ * pool. The other tokens are not listed by C_GetSlotList(). If the first
+ * token is removed, the next token presents the pool and takes over its
+ * sessions.
+ */
+#ifdef SLOT_POOL_COND
+/* Protects pool_ops, which is also read without the global lock */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* A session of the first slot starts an operation on another token */
+void slot_pool_op_begin(struct sc_pkcs11_slot *head)
+{
+#ifdef SLOT_POOL_COND
+	pthread_mutex_lock(&pool_mutex);
+#endif
+	head->pool_ops++;
+#ifdef SLOT_POOL_COND
+	pthread_mutex_unlock(&pool_mutex);
+#endif
+}
+
+void slot_pool_op_end(struct sc_pkcs11_slot *head)
+{
+#ifdef SLOT_POOL_COND
+	pthread_mutex_lock(&pool_mutex);
+	if (--head->pool_ops == 0)
+		pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+#else
+	head->pool_ops--;
+#endif
+}
+
+/* Waits until no session of a slot that left the pool uses the other
+ * tokens. The global lock is released while waiting. Without pthreads,
+ * for example on Windows before Vista, pool_ops is polled. */
+void slot_pool_wait(struct sc_pkcs11_slot *slot)
+{
+#ifdef SLOT_POOL_COND
+	pthread_mutex_lock(&pool_mutex);
+	if (slot->pool_ops == 0) {
+		pthread_mutex_unlock(&pool_mutex);
+		return;
+	}
+	sc_pkcs11_card_io_begin();
+	while (slot->pool_ops > 0)
+		pthread_cond_wait(&pool_cond, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+	sc_pkcs11_card_io_end();
+#else
+	while (slot->pool_ops > 0) {
+		sc_pkcs11_card_io_begin();
+#ifdef _WIN32
+		Sleep(1);
+#else
+		usleep(1000);
+#endif
+		sc_pkcs11_card_io_end();
+	}
+#endif
+}
+
+/* Logs a token joining the pool after C_Login() in like the first token.
+ * This needs the PINs kept for the 'atomic' option; otherwise the token
+ * is used after the next C_Login(). */
+static void slot_pool_login(struct sc_pkcs11_slot *head, struct sc_pkcs11_slot *slot)
+{
+	if (head->login_user < 0 || slot->login_user >= 0 || !sc_pkcs11_conf.atomic)
+		return;
+	if (copy_login_states(slot, head) != CKR_OK)
+		return;
+	slot->login_user = head->login_user;
+	sc_log(context, "Slot 0x%lx uses the login of slot 0x%lx", slot->id, head->id);
+}
+
+void slot_pool_join(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	if (slot->pool != NULL)
+		return;
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *head = (struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i);
+		if (head != slot && head->pool == head) {
+			struct sc_pkcs11_slot *last = head;
+
+			while (last->pool_next)
+				last = last->pool_next;
+			last->pool_next = slot;
+			slot->pool = head;
+			sc_log(context, "Slot 0x%lx joins the token pool of slot 0x%lx", slot->id, head->id);
+			slot_pool_login(head, slot);
+			return;
+		}
+	}
+	slot->pool = slot;
+	sc_log(context, "Slot 0x%lx presents the token pool", slot->id);
+}
+
+void slot_pool_leave(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *head = slot->pool, *tmp;
+
+	if (head == NULL)
+		return;
+	if (head == slot) {
+		/* the next token presents the pool */
+		for (tmp = slot->pool_next; tmp; tmp = tmp->pool_next)
+			tmp->pool = slot->pool_next;
+		if (slot->pool_next)
+			sc_log(context, "Slot 0x%lx presents the token pool", slot->pool_next->id);
+	} else {
+		for (tmp = head; tmp->pool_next != slot; tmp = tmp->pool_next)
+			;
+		tmp->pool_next = slot->pool_next;
+	}
+	slot->pool = NULL;
+	slot->pool_next = NULL;
+}
+
+/* Returns the least used token of the pool that can work for the
+ * sessions of its first slot */
+struct sc_pkcs11_slot *slot_pool_select(struct sc_pkcs11_slot *head)
+{
+	struct sc_pkcs11_slot *slot, *best = head;
+
+	for (slot = head->pool_next; slot; slot = slot->pool_next) {
+		if (slot->p11card == NULL || slot->p11card->removed
+				|| slot->login_user != head->login_user)
+			continue;
+		if (best->p11card == NULL || slot->p11card->users < best->p11card->users)
+			best = slot;
+	}
+	return best;
+}
+
+/*
+ * Reader event monitor
+ *
+ * A single thread waits in sc_wait_for_event() for card and reader events
+ * and bumps a generation counter for every event it sees. Blocking callers
+ * of C_WaitForSlotEvent() sleep on a condition variable until the counter
+ * moves, so only one reader state query is pending no matter how many
+ * threads wait. The thread only adds the slots of attached readers, so
+ * that it can watch them; the waiters detect card changes themselves under
+ * the global lock.
+ */
+/* Event count at the last time the slots were brought up to date */
+static unsigned long state_generation;
+static int state_valid = 0;
+
+#ifdef SLOT_MONITOR_THREAD
+
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	pthread_t thread;
+	int started;			/* thread was created and not joined yet */
+	int running;			/* thread is still waiting for events */
+	int stop;			/* C_Finalize() wants the thread gone */
+	int error;			/* why the thread ended, if it did */
+	unsigned long generation;	/* number of events seen */
+	unsigned int events;		/* SC_EVENT_* of the last event */
+	unsigned int waiters;
+	time_t start_time;
+} monitor;
+
+/* Detects attached readers and creates their slots. The first slot of a
+ * new reader reports the attach to C_WaitForSlotEvent(). Returns 1 if
+ * C_Finalize() stops the thread. */
+static int slot_monitor_attach(void)
+{
+	unsigned int i;
+	int stop;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return 1;
+	pthread_mutex_lock(&monitor_mutex);
+	stop = monitor.stop;
+	pthread_mutex_unlock(&monitor_mutex);
+
+	if (!stop) {
+		sc_ctx_detect_readers(context);
+		for (i = 0; i < sc_ctx_get_reader_count(context); i++) {
+			sc_reader_t *reader = sc_ctx_get_reader(context, i);
+			struct sc_pkcs11_slot *slot;
+
+			if ((reader->flags & SC_READER_REMOVED) || reader_get_slot(reader)
+					|| reader_ignored(reader))
+				continue;
+			sc_log(context, "Reader '%s' attached", reader->name);
+			if (create_reader_slots(reader) != CKR_OK)
+				continue;
+			slot = reader_get_slot(reader);
+			if (slot)
+				slot->events |= SC_EVENT_READER_ATTACHED;
+		}
+	}
+	sc_pkcs11_unlock();
+	return stop;
+}
+
+static void *slot_monitor_main(void *arg)
+{
+	unsigned int mask = SC_EVENT_CARD_EVENTS | SC_EVENT_READER_EVENTS;
+	void *reader_states = NULL;
+	sc_reader_t *found;
+	unsigned int events;
+	int r;
+
+	for (;;) {
+		events = 0;
+		r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
+
+		pthread_mutex_lock(&monitor_mutex);
+		if (monitor.stop || r != SC_SUCCESS) {
+			monitor.error = r;
+			monitor.running = 0;
+			pthread_cond_broadcast(&monitor_cond);
+			pthread_mutex_unlock(&monitor_mutex);
+			break;
+		}
+		monitor.generation++;
+		monitor.events = events;
+		pthread_cond_broadcast(&monitor_cond);
+		pthread_mutex_unlock(&monitor_mutex);
+
+		/* watch the new reader, too */
+		if (events & SC_EVENT_READER_ATTACHED) {
+			if (slot_monitor_attach())
+				break;
+			if (reader_states) {
+				sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+				reader_states = NULL;
+			}
+		}
+	}
+
+	if (reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+	return NULL;
+}
+
+static CK_RV slot_monitor_error(void)
+{
+	if (monitor.error == SC_ERROR_NOT_SUPPORTED)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	return sc_to_cryptoki_error(monitor.error, "C_WaitForSlotEvent");
+}
+
+CK_RV slot_monitor_start(unsigned long *generation)
+{
+	CK_RV rv = CKR_OK;
+	time_t now;
+
+	if (context->reader_driver->ops->wait_for_event == NULL
+			|| !sc_pkcs11_threads_allowed())
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&monitor_mutex);
+	now = time(NULL);
+	if (monitor.stop) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	} else if (!monitor.running && monitor.started && now == monitor.start_time) {
+		/* do not spin up a thread on every call while the readers
+		 * cannot be watched, e.g. because there are none */
+		rv = slot_monitor_error();
+	} else if (!monitor.running) {
+		/* reap a thread that ended with an error */
+		if (monitor.started)
+			pthread_join(monitor.thread, NULL);
+		monitor.started = 0;
+		monitor.error = SC_SUCCESS;
+		monitor.start_time = now;
+		if (pthread_create(&monitor.thread, NULL, slot_monitor_main, NULL) != 0) {
+			rv = CKR_GENERAL_ERROR;
+		} else {
+			monitor.started = 1;
+			monitor.running = 1;
+		}
+	}
+	*generation = monitor.generation;
+	pthread_mutex_unlock(&monitor_mutex);
+	return rv;
+}
+
+CK_RV slot_monitor_wait(unsigned long generation, unsigned int *events)
+{
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&monitor_mutex);
+	monitor.waiters++;
+	while (monitor.generation == generation && monitor.running && !monitor.stop)
+		pthread_cond_wait(&monitor_cond, &monitor_mutex);
+	monitor.waiters--;
+
+	if (monitor.stop) {
+		/* let C_Finalize() know this was the last one */
+		pthread_cond_broadcast(&monitor_cond);
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	} else if (monitor.generation != generation) {
+		*events = monitor.events;
+	} else {
+		rv = slot_monitor_error();
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+	return rv;
+}
+
+void slot_monitor_stop(void)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	pthread_mutex_lock(&monitor_mutex);
+	if (!monitor.started) {
+		pthread_mutex_unlock(&monitor_mutex);
+		return;
+	}
+	monitor.stop = 1;
+	pthread_cond_broadcast(&monitor_cond);
+	/* C_Finalize() holds the global lock, which the thread needs to add
+	 * the slots of an attached reader */
+	sc_pkcs11_unlock();
+	while (monitor.running || monitor.waiters) {
+		/* the thread may not have reached the blocking call yet when
+		 * the wait is cancelled, so cancel until it is gone */
+		pthread_mutex_unlock(&monitor_mutex);
+		sc_cancel(context);
+		pthread_mutex_lock(&monitor_mutex);
+
+		gettimeofday(&tv, NULL);
+		tv.tv_usec += 100000;
+		ts.tv_sec = tv.tv_sec + tv.tv_usec / 1000000;
+		ts.tv_nsec = (tv.tv_usec % 1000000) * 1000;
+		if (monitor.running || monitor.waiters)
+			pthread_cond_timedwait(&monitor_cond, &monitor_mutex, &ts);
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+
+	pthread_join(monitor.thread, NULL);
+	sc_pkcs11_lock();
+	monitor.started = 0;
+	monitor.stop = 0;
+	state_valid = 0;
+}
+
+void slot_monitor_forget(void)
+{
+	/* after fork() the thread belongs to the parent */
+	pthread_mutex_init(&monitor_mutex, NULL);
+	pthread_cond_init(&monitor_cond, NULL);
+	monitor.started = 0;
+	monitor.running = 0;
+	monitor.stop = 0;
+	monitor.waiters = 0;
+	state_valid = 0;
+}
+
+#else
+
+CK_RV slot_monitor_start(unsigned long *generation)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV slot_monitor_wait(unsigned long generation, unsigned int *events)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+void slot_monitor_stop(void)
+{
+}
+
+void slot_monitor_forget(void)
+{
+}
+
+#endif /* SLOT_MONITOR_THREAD */
+
+/*
+ * Brings the slots up to date if the monitor thread saw a reader event
+ * since the last call, so callers can answer from the slot state without
+ * asking the readers. Cards that could not be detected are tried again on
+ * every call. Returns CKR_FUNCTION_NOT_SUPPORTED if reader events cannot
+ * be watched, e.g. because C_Initialize() did not allow threads, and the
+ * caller has to detect the cards itself.
+ */
+CK_RV slot_update_state(void)
+{
+	unsigned long generation;
+	unsigned int i;
+	CK_RV rv;
+
+	rv = slot_monitor_start(&generation);
+	if (rv != CKR_OK)
+		return rv;
+	if (state_valid && generation == state_generation) {
+		for (i = 0; i < list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			if (slot->detect_failed && slot->reader)
+				reader_detect_result(slot->reader, card_detect(slot->reader));
+		}
+		return CKR_OK;
+	}
+
+	sc_log(context, "Reader event seen, updating the slots");
+	/* Events arriving while detecting will trigger the next update */
+	state_generation = generation;
+	state_valid = 1;
+	sc_ctx_detect_readers(context);
+	return card_detect_all();
+}
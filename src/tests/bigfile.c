@@ -0,0 +1,208 @@
+/*
+ * bigfile.c: Test for reading transparent EFs larger than 32 KiB
+ *
+ * Reads the EF with sc_read_binary() in one call, then again at offsets
+ * above and across 0x7FFF and finally with sc_read_binary_stream(), and
+ * compares the results. Meant to be run with the virtual reader driver,
+ * for example with
+ *
+ *	enable_default_driver = true;
+ *	reader_driver virtual {
+ *		enable = true;
+ *		images = /path/to/card.img;
+ *		max_recv_size = 65536;
+ *	}
+ *
+ * and an image containing a file of at least 64 KiB:
+ *
+ *	atr = "3B:8A:80:01:00:31:C1:73:C8:40:00:00:90:00:90";
+ *	file 3F000020 { content_file = "/path/to/big.bin"; }
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/compat_getopt.h"
+#include "libopensc/opensc.h"
+
+struct stream_state {
+	const u8 *ref;
+	size_t size;
+	unsigned int next;
+	int error;
+};
+
+static const struct option options[] = {
+	{ "path",	1, NULL, 'p' },
+	{ "reader",	1, NULL, 'r' },
+	{ "debug",	0, NULL, 'd' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static int stream_cb(void *arg, unsigned int idx, const u8 *data, size_t len)
+{
+	struct stream_state *s = (struct stream_state *) arg;
+
+	/* the chunks have to arrive in order and without gaps */
+	if (idx != s->next || idx + len > s->size
+			|| memcmp(s->ref + idx, data, len) != 0) {
+		s->error = 1;
+		return SC_ERROR_INVALID_DATA;
+	}
+	s->next += len;
+	return SC_SUCCESS;
+}
+
+static int check_read(sc_card_t *card, const u8 *ref, size_t size,
+		unsigned int idx, size_t count)
+{
+	u8 *buf;
+	int r;
+
+	if (idx + count > size) {
+		printf("read %u+%lu: file too small\n", idx, (unsigned long) count);
+		return 1;
+	}
+	buf = malloc(count);
+	if (buf == NULL)
+		return 1;
+	r = sc_read_binary(card, idx, buf, count, 0);
+	if (r < 0)
+		printf("read %u+%lu: %s\n", idx, (unsigned long) count, sc_strerror(r));
+	else if ((size_t) r != count || memcmp(buf, ref + idx, count) != 0)
+		printf("read %u+%lu: wrong data\n", idx, (unsigned long) count);
+	else
+		printf("read %u+%lu: ok\n", idx, (unsigned long) count);
+	free(buf);
+	return r < 0 || (size_t) r != count;
+}
+
+static int check_stream(sc_card_t *card, const u8 *ref, size_t size,
+		unsigned int idx)
+{
+	struct stream_state s;
+	int r;
+
+	s.ref = ref;
+	s.size = size;
+	s.next = idx;
+	s.error = 0;
+	/* ask for more than there is, reading has to stop at the end */
+	r = sc_read_binary_stream(card, idx, size - idx + 1000, 0, stream_cb, &s);
+	if (r < 0) {
+		printf("stream %u: %s\n", idx, sc_strerror(r));
+		return 1;
+	}
+	if (s.error || (size_t) r != size - idx || s.next != size) {
+		printf("stream %u: wrong data (%d bytes)\n", idx, r);
+		return 1;
+	}
+	printf("stream %u: ok\n", idx);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_param_t ctx_param;
+	sc_context_t *ctx = NULL;
+	sc_card_t *card = NULL;
+	sc_file_t *file = NULL;
+	sc_path_t path;
+	const char *opt_path = "3F000020";
+	unsigned int reader = 0;
+	u8 *ref = NULL;
+	size_t size;
+	int c, r, debug = 0, failed = 0;
+
+	while ((c = getopt_long(argc, argv, "p:r:d", options, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			opt_path = optarg;
+			break;
+		case 'r':
+			reader = atoi(optarg);
+			break;
+		case 'd':
+			debug++;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p path] [-r reader] [-d]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver = 0;
+	ctx_param.app_name = "bigfile";
+
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (debug)
+		ctx->debug = debug;
+
+	if (reader >= sc_ctx_get_reader_count(ctx)) {
+		fprintf(stderr, "No reader %u configured.\n", reader);
+		failed = 1;
+		goto out;
+	}
+	r = sc_connect_card(sc_ctx_get_reader(ctx, reader), &card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to connect to card: %s\n", sc_strerror(r));
+		failed = 1;
+		goto out;
+	}
+
+	sc_format_path(opt_path, &path);
+	r = sc_select_file(card, &path, &file);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to select %s: %s\n", opt_path, sc_strerror(r));
+		failed = 1;
+		goto out;
+	}
+	size = file->size;
+	if (size <= 0x8000 + 1000) {
+		fprintf(stderr, "%s has only %lu bytes, need more than 32 KiB.\n",
+				opt_path, (unsigned long) size);
+		failed = 1;
+		goto out;
+	}
+	printf("Reading %lu bytes from %s.\n", (unsigned long) size, opt_path);
+
+	ref = malloc(size);
+	if (ref == NULL) {
+		failed = 1;
+		goto out;
+	}
+	r = sc_read_binary(card, 0, ref, size, 0);
+	if (r < 0 || (size_t) r != size) {
+		printf("read 0+%lu: %s\n", (unsigned long) size,
+				r < 0 ? sc_strerror(r) : "short read");
+		failed = 1;
+		goto out;
+	}
+	printf("read 0+%lu: ok\n", (unsigned long) size);
+
+	/* beyond the 15 bit offset of the short READ BINARY */
+	failed |= check_read(card, ref, size, 0x8000, 1000);
+	failed |= check_read(card, ref, size, size - 100, 100);
+	/* across the boundary */
+	failed |= check_read(card, ref, size, 0x7F00, 1000);
+
+	failed |= check_stream(card, ref, size, 0);
+	failed |= check_stream(card, ref, size, 0x7F00);
+
+out:
+	free(ref);
+	if (file != NULL)
+		sc_file_free(file);
+	if (card != NULL)
+		sc_disconnect_card(card);
+	sc_release_context(ctx);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * multireader.c: Stress test for using several readers from several threads
+ *
+ * The cards in all readers are connected first. Then every reader gets a
+ * thread of its own, which selects the MF in a loop, all threads sharing
+ * one context. Meant to
+ * be run with the virtual reader driver, for example with
+ *
+ *	enable_default_driver = true;
+ *	reader_driver virtual {
+ *		enable = true;
+ *		images = /path/to/card.img;
+ *		readers = 8;
+ *		latency = 2000;
+ *	}
+ *
+ * With a latency set, the run time does not grow with the number of
+ * readers as long as the readers are used in parallel. With -a a single
+ * thread drives all readers through sc_transmit_apdu_async() instead.
+ *
+ * With -c the readers are first used one after the other from the main
+ * thread, and the test fails unless the parallel run takes less than
+ * half of that time. 'make check' runs it this way (test-multireader.sh).
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "common/compat_getopt.h"
+#include "libopensc/opensc.h"
+
+#define MAX_THREADS	64
+
+struct worker {
+	pthread_t thread;
+	sc_context_t *ctx;
+	sc_reader_t *reader;
+	sc_card_t *card;
+	sc_apdu_t apdu;
+	u8 path[2];
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	unsigned int iterations;
+	unsigned int done;
+	int error;
+};
+
+static const struct option options[] = {
+	{ "iterations",	1, NULL, 'n' },
+	{ "threads",	1, NULL, 't' },
+	{ "async",	0, NULL, 'a' },
+	{ "check",	0, NULL, 'c' },
+	{ "debug",	0, NULL, 'd' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static int mutex_create(void **m)
+{
+	pthread_mutex_t *mutex;
+
+	mutex = malloc(sizeof(pthread_mutex_t));
+	if (mutex == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(mutex, NULL);
+	*m = mutex;
+	return SC_SUCCESS;
+}
+
+static int mutex_lock(void *m)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) m) == 0 ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+static int mutex_unlock(void *m)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) m) == 0 ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+static int mutex_destroy(void *m)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) m);
+	free(m);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t thread_ctx = {
+	0, mutex_create, mutex_lock, mutex_unlock, mutex_destroy, NULL
+};
+
+static void format_select_mf(struct worker *w)
+{
+	w->path[0] = 0x3F;
+	w->path[1] = 0x00;
+	sc_format_apdu(w->card, &w->apdu, SC_APDU_CASE_4_SHORT, 0xA4, 0x00, 0x00);
+	w->apdu.lc = sizeof(w->path);
+	w->apdu.datalen = sizeof(w->path);
+	w->apdu.data = w->path;
+	w->apdu.le = 256;
+	w->apdu.resplen = sizeof(w->rbuf);
+	w->apdu.resp = w->rbuf;
+}
+
+static int check_select_mf(struct worker *w)
+{
+	int r;
+
+	r = sc_check_sw(w->card, w->apdu.sw1, w->apdu.sw2);
+	if (r != SC_SUCCESS)
+		return r;
+	/* the FCI of the MF */
+	if (w->apdu.resplen < 2 || w->rbuf[0] != 0x6F)
+		return SC_ERROR_INVALID_DATA;
+	return SC_SUCCESS;
+}
+
+static int select_mf(struct worker *w)
+{
+	int r;
+
+	format_select_mf(w);
+	r = sc_transmit_apdu(w->card, &w->apdu);
+	if (r != SC_SUCCESS)
+		return r;
+	return check_select_mf(w);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	unsigned int i;
+	int r;
+
+	if (w->card == NULL)
+		return NULL;
+
+	for (i = 0; i < w->iterations; i++) {
+		r = sc_lock(w->card);
+		if (r == SC_SUCCESS) {
+			r = select_mf(w);
+			sc_unlock(w->card);
+		}
+		if (r != SC_SUCCESS) {
+			w->error = r;
+			break;
+		}
+		w->done++;
+	}
+
+	return NULL;
+}
+
+/* Keeps all readers busy from the calling thread */
+static void run_async(struct worker *workers, unsigned int nworkers, unsigned int iterations)
+{
+	sc_apdu_future_t *futures[MAX_THREADS];
+	unsigned int i, n;
+	int r;
+
+	for (i = 0; i < iterations; i++) {
+		for (n = 0; n < nworkers; n++) {
+			futures[n] = NULL;
+			if (workers[n].error != SC_SUCCESS)
+				continue;
+			format_select_mf(&workers[n]);
+			r = sc_transmit_apdu_async(workers[n].card, &workers[n].apdu, NULL, NULL, &futures[n]);
+			if (r != SC_SUCCESS)
+				workers[n].error = r;
+		}
+		for (n = 0; n < nworkers; n++) {
+			if (futures[n] == NULL)
+				continue;
+			r = sc_apdu_future_wait(futures[n], -1);
+			sc_apdu_future_free(futures[n]);
+			if (r == SC_SUCCESS)
+				r = check_select_mf(&workers[n]);
+			if (r != SC_SUCCESS)
+				workers[n].error = r;
+			else
+				workers[n].done++;
+		}
+	}
+}
+
+static long elapsed_msec(const struct timeval *tv1)
+{
+	struct timeval tv2;
+
+	gettimeofday(&tv2, NULL);
+	return (tv2.tv_sec - tv1->tv_sec) * 1000 + (tv2.tv_usec - tv1->tv_usec) / 1000;
+}
+
+/* Uses the readers one after the other, as the reference for -c */
+static long run_serial(struct worker *workers, unsigned int nworkers)
+{
+	struct timeval tv1;
+	unsigned int i;
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < nworkers; i++)
+		worker_main(&workers[i]);
+	return elapsed_msec(&tv1);
+}
+
+static long run_parallel(struct worker *workers, unsigned int nworkers,
+		unsigned int iterations, int async, int *failed)
+{
+	struct timeval tv1;
+	unsigned int i, nthreads = nworkers;
+
+	gettimeofday(&tv1, NULL);
+	if (async) {
+		run_async(workers, nworkers, iterations);
+	} else {
+		for (i = 0; i < nworkers; i++) {
+			if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+				fprintf(stderr, "Cannot start thread %u\n", i);
+				nthreads = i;
+				*failed = 1;
+				break;
+			}
+		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	return elapsed_msec(&tv1);
+}
+
+static int check_workers(struct worker *workers, unsigned int nworkers,
+		unsigned int iterations, unsigned int *total)
+{
+	unsigned int i;
+	int failed = 0;
+
+	*total = 0;
+	for (i = 0; i < nworkers; i++) {
+		*total += workers[i].done;
+		if (workers[i].error != SC_SUCCESS || workers[i].done != iterations) {
+			printf("%s: failed after %u commands: %s\n", workers[i].reader->name,
+					workers[i].done, sc_strerror(workers[i].error));
+			failed = 1;
+		}
+		workers[i].done = 0;
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker workers[MAX_THREADS];
+	sc_context_param_t ctx_param;
+	sc_context_t *ctx = NULL;
+	unsigned int iterations = 100, nthreads = 0, i, total = 0;
+	int c, r, debug = 0, failed = 0, async = 0, check = 0;
+	long msec, serial_msec = 0;
+
+	while ((c = getopt_long(argc, argv, "n:t:acd", options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'a':
+			async = 1;
+			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'd':
+			debug++;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-t threads] [-a] [-c] [-d]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver = 0;
+	ctx_param.app_name = "multireader";
+	ctx_param.thread_ctx = &thread_ctx;
+
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (debug)
+		ctx->debug = debug;
+
+	if (nthreads == 0 || nthreads > sc_ctx_get_reader_count(ctx))
+		nthreads = sc_ctx_get_reader_count(ctx);
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (nthreads == 0) {
+		fprintf(stderr, "No readers configured.\n");
+		sc_release_context(ctx);
+		return 1;
+	}
+	if (check && nthreads < 2) {
+		fprintf(stderr, "Checking the parallelism needs at least 2 readers.\n");
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	printf("Using %u readers, %u commands each.\n", nthreads, iterations);
+
+	/* connect outside of the timed part */
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < nthreads; i++) {
+		workers[i].ctx = ctx;
+		workers[i].reader = sc_ctx_get_reader(ctx, i);
+		workers[i].iterations = iterations;
+		r = sc_connect_card(workers[i].reader, &workers[i].card);
+		if (r != SC_SUCCESS)
+			workers[i].error = r;
+	}
+
+	if (check) {
+		serial_msec = run_serial(workers, nthreads);
+		if (check_workers(workers, nthreads, iterations, &total))
+			failed = 1;
+		printf("%u commands in %ld ms one reader after the other\n", total, serial_msec);
+	}
+
+	msec = run_parallel(workers, nthreads, iterations, async, &failed);
+	if (check_workers(workers, nthreads, iterations, &total))
+		failed = 1;
+	printf("%u commands in %ld ms\n", total, msec);
+
+	if (check && !failed && msec * 2 >= serial_msec) {
+		printf("The readers were not used in parallel.\n");
+		failed = 1;
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (workers[i].card != NULL)
+			sc_disconnect_card(workers[i].card);
+
+	sc_release_context(ctx);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Reads a 100000 byte EF through the virtual reader with bigfile, so
+# offsets beyond 0x7FFF and sc_read_binary_stream() are covered.
+
+DIR=`mktemp -d "${TMPDIR:-/tmp}/opensc-bigfile.XXXXXX"` || exit 1
+trap 'rm -rf "$DIR"' 0
+
+dd if=/dev/urandom of="$DIR/big.bin" bs=1000 count=100 2>/dev/null || exit 1
+
+cat > "$DIR/card.img" <<EOF
+atr = "3B:8A:80:01:00:31:C1:73:C8:40:00:00:90:00:90";
+file 3F000020 { content_file = "$DIR/big.bin"; }
+EOF
+
+cat > "$DIR/opensc.conf" <<EOF
+app default {
+	enable_default_driver = true;
+	reader_driver virtual {
+		enable = true;
+		images = $DIR/card.img;
+		max_recv_size = 65536;
+		max_send_size = 65535;
+	}
+}
+EOF
+
+OPENSC_CONF="$DIR/opensc.conf" ./bigfile -p 3F000020
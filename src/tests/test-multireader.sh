@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Runs multireader -c against four virtual readers with a latency, so the
+# test fails when cards in different readers are not used in parallel.
+
+DIR=`mktemp -d "${TMPDIR:-/tmp}/opensc-multireader.XXXXXX"` || exit 1
+trap 'rm -rf "$DIR"' 0
+
+cat > "$DIR/card.img" <<EOF
+atr = "3B:8A:80:01:00:31:C1:73:C8:40:00:00:90:00:90";
+file 3F000010 { content = "01:02:03"; }
+EOF
+
+cat > "$DIR/opensc.conf" <<EOF
+app default {
+	enable_default_driver = true;
+	reader_driver virtual {
+		enable = true;
+		images = $DIR/card.img;
+		readers = 4;
+		latency = 5000;
+	}
+}
+EOF
+
+OPENSC_CONF="$DIR/opensc.conf"
+export OPENSC_CONF
+./multireader -c -n 20 || exit 1
+./multireader -c -a -n 20